@@ -13,183 +13,6591 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cs1550.h"
+
+//options that can be given at mount time with -o
+struct cs1550_options
+{
+	int mmap;		//map the whole image instead of using pread/pwrite
+	int writeback;	//seconds dirty metadata may stay in memory
+	long indexRuns;	//runs all the in-memory block indexes may hold together
+	int delalloc;	//KB of appended data a file may buffer before it gets blocks (0: allocate as written)
+	int cache;		//KB of data blocks kept in the block cache (0: no cache)
+	int readahead;	//most blocks read ahead of a file being read straight through (0: none)
+	int inlineFiles;	//new files keep their bytes in their inode until they outgrow it
+	int compress;	//appended data is stored compressed, COMPRESS_CLUSTER blocks at a time
+	int dedup;		//blocks the same as one already stored share it instead of being written
+};
+static struct cs1550_options options = {
+	.writeback = 5,
+	.indexRuns = 65536,
+	.delalloc = 1024,
+	.cache = 4096,
+	.readahead = 64,
+};
+
+#define CS1550_OPT(t, p, v) { t, offsetof(struct cs1550_options, p), v }
+
+static const struct fuse_opt cs1550_opts[] = {
+	CS1550_OPT("mmap", mmap, 1),
+	CS1550_OPT("writeback=%d", writeback, 0),
+	CS1550_OPT("index_runs=%ld", indexRuns, 0),
+	CS1550_OPT("delalloc=%d", delalloc, 0),
+	CS1550_OPT("cache=%d", cache, 0),
+	CS1550_OPT("readahead=%d", readahead, 0),
+	CS1550_OPT("inline", inlineFiles, 1),
+	CS1550_OPT("compress", compress, 1),
+	CS1550_OPT("dedup", dedup, 1),
+	FUSE_OPT_END
+};
+
+//path to the backing image. main resolves this to an absolute path before
+//fuse_main runs, because daemonizing changes the working directory to /
+static char diskPath[PATH_MAX] = ".disk";
+
+//Inode numbers are the block something starts at plus one: a directory's
+//block, or a file's inode (or first block, for a version 1 file). That
+//makes the root, at block 0, FUSE's root inode 1. The stats file gets the
+//block past the end of the image. getattr and readdir report them, and
+//the low-level frontend (cs1550_lowlevel.c) hands them to the kernel
+#define CS1550_INO(block) ((ino_t)(block) + 1)
+
+//Every handler call is counted and timed, along with the bytes it moved, and
+//so is every access to the backing image. They're published as the read-only
+//file /.stats, which is made up on the spot from these counters and never
+//touches the image. It isn't listed in the root, so ls and du don't see it.
+//The counters are bumped with atomic adds rather than under a lock, since
+//every call on every thread goes through them
+#define STATS_PATH "/.stats"
+//bucket k of a histogram counts calls that took under 2^k microseconds (and
+//at least 2^(k-1)), so the last one holds anything over half an hour
+#define STATS_BUCKETS 32
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+enum { STAT_GETATTR, STAT_READDIR, STAT_READ, STAT_WRITE, STAT_MKNOD, STAT_MKDIR, STAT_UNLINK, STAT_RMDIR, STAT_OPS };
+
+static const char *statNames[STAT_OPS] = { "getattr", "readdir", "read", "write", "mknod", "mkdir", "unlink", "rmdir" };
+
+struct cs1550_op_stats
+{
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long totalUs;
+	unsigned long buckets[STATS_BUCKETS];
+};
+
+static struct cs1550_op_stats opStats[STAT_OPS];
+static unsigned long statBytesRead = 0, statBytesWritten = 0, statBlocksAllocated = 0, statBlocksFreed = 0;
+static unsigned long statDiskReads = 0, statDiskWrites = 0, statDiskBytesRead = 0, statDiskBytesWritten = 0;
+static unsigned long statCompressIn = 0, statCompressOut = 0, statCompressUs = 0, statDecompressBytes = 0, statDecompressUs = 0;
+static unsigned long statDedupLookups = 0, statDedupHits = 0;
+
+//function to get the time a handler call started, in microseconds
+static unsigned long stats_clock(){
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec*1000000UL + ts.tv_nsec/1000;
+}
+
+//function to count a handler call that started at start and returned res
+static void stats_record(int op, unsigned long start, int res){
+
+	unsigned long us = stats_clock() - start;
+	int k = us == 0 ? 0 : 64 - __builtin_clzl(us);
+
+	STAT_ADD(opStats[op].calls, 1);
+	STAT_ADD(opStats[op].totalUs, us);
+	STAT_ADD(opStats[op].buckets[k < STATS_BUCKETS ? k : STATS_BUCKETS - 1], 1);
+	if(res < 0)
+	{
+		STAT_ADD(opStats[op].errors, 1);
+	}
+}
+
+//the backing image is opened once at mount (cs1550_init) and every block
+//access goes through this descriptor with positioned reads and writes
+static int diskFd = -1;
+
+//with -o mmap the whole image is mapped here and block accesses become plain
+//memory accesses. diskDirtyLo/diskDirtyHi bound the bytes written since the
+//last msync so a flush only has to push that range back
+static off_t diskSize = 0;
+//bytes in a block of the mounted image. alloc_init sets it from the header
+//before anything but the header itself is read
+static long blockSize = BLOCK_SIZE;
+static char *diskMap = NULL;
+static size_t diskMapSize = 0;
+static off_t diskDirtyLo = -1, diskDirtyHi = -1;
+static pthread_mutex_t diskLock = PTHREAD_MUTEX_INITIALIZER;
+//cs1550_bench's crash workload has the image stop taking writes once this
+//many more metadata blocks have gone to their homes, as if the machine went
+//down there. -1 lets every write through
+static long homeWritesLeft = -1;
+
+//function to open the backing image for the lifetime of the mount
+static int disk_open(const char *path){
+
+	struct stat st;
+	void *map;
+	int res;
+
+	diskFd = open(path, O_RDWR);
+	if(diskFd < 0)
+	{
+		return -errno;
+	}
+	if(fstat(diskFd, &st) != 0)
+	{
+		//errno is what cs1550_init reports, so close mustn't change it
+		res = -errno;
+		close(diskFd);
+		diskFd = -1;
+		errno = -res;
+		return res;
+	}
+	diskSize = st.st_size;
+	if(options.mmap)
+	{
+		if(st.st_size == 0)
+		{
+			return 0;
+		}
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskFd, 0);
+		if(map == MAP_FAILED)
+		{
+			//fall back to pread/pwrite
+			fprintf(stderr, "cs1550: mmap of %s failed: %s\n", path, strerror(errno));
+			return 0;
+		}
+		diskMap = map;
+		diskMapSize = st.st_size;
+	}
+	return 0;
+}
+
+//function to push everything written through the mapping back to the image
+static int disk_sync(){
+
+	long page = sysconf(_SC_PAGESIZE);
+	off_t start;
+	int res = 0;
+
+	pthread_mutex_lock(&diskLock);
+	if(diskMap != NULL && diskDirtyLo >= 0)
+	{
+		//msync wants a page aligned start address
+		start = diskDirtyLo - diskDirtyLo % page;
+		if(msync(diskMap + start, diskDirtyHi - start, MS_SYNC) != 0)
+		{
+			res = -errno;
+		}
+		else
+		{
+			diskDirtyLo = diskDirtyHi = -1;
+		}
+	}
+	pthread_mutex_unlock(&diskLock);
+	return res;
+}
+
+//function to get everything written to the image so far onto stable storage
+static int disk_flush(){
+
+	int res = disk_sync();
+
+	if(res == 0 && fdatasync(diskFd) != 0)
+	{
+		res = -errno;
+	}
+	return res;
+}
+
+//function to close the backing image at unmount
+static void disk_close(){
+
+	if(diskMap != NULL)
+	{
+		disk_sync();
+		munmap(diskMap, diskMapSize);
+		diskMap = NULL;
+		diskMapSize = 0;
+	}
+	if(diskFd >= 0)
+	{
+		fsync(diskFd);
+		close(diskFd);
+		diskFd = -1;
+	}
+}
+
+//function to get a pointer straight into the mapped image for a block
+//returns NULL when the image isn't mapped (or the block is past its end) so
+//callers know to go through a copy instead
+static void *disk_block_ptr(long blockNum){
+
+	if(diskMap == NULL || blockNum < 0 || (size_t)(blockNum+1)*blockSize > diskMapSize)
+	{
+		return NULL;
+	}
+	return diskMap + blockNum*blockSize;
+}
+
+//function to record that a byte range of the mapping has been modified
+static void disk_mark_dirty(off_t offset, size_t len){
+
+	pthread_mutex_lock(&diskLock);
+	if(diskDirtyLo < 0 || offset < diskDirtyLo)
+	{
+		diskDirtyLo = offset;
+	}
+	if(diskDirtyHi < 0 || offset + (off_t)len > diskDirtyHi)
+	{
+		diskDirtyHi = offset + len;
+	}
+	pthread_mutex_unlock(&diskLock);
+}
+
+//function to read len bytes starting at a byte offset into the image
+//anything past the end of the image reads back as zeros, like a fresh disk
+static int disk_pread(void *buf, size_t len, off_t offset){
+
+	size_t done = 0;
+	ssize_t n;
+
+	if(diskFd < 0)
+	{
+		return -EIO;
+	}
+	STAT_ADD(statDiskReads, 1);
+	STAT_ADD(statDiskBytesRead, len);
+	if(diskMap != NULL)
+	{
+		if((size_t)offset >= diskMapSize)
+		{
+			memset(buf, 0, len);
+		}
+		else if(offset + len > diskMapSize)
+		{
+			memcpy(buf, diskMap + offset, diskMapSize - offset);
+			memset((char *)buf + (diskMapSize - offset), 0, len - (diskMapSize - offset));
+		}
+		else
+		{
+			memcpy(buf, diskMap + offset, len);
+		}
+		return 0;
+	}
+	while(done < len)
+	{
+		n = pread(diskFd, (char *)buf + done, len - done, offset + done);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -errno;
+		}
+		if(n == 0)
+		{
+			//end of the image
+			memset((char *)buf + done, 0, len - done);
+			break;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+//function to write len bytes starting at a byte offset into the image
+static int disk_pwrite(const void *buf, size_t len, off_t offset){
+
+	size_t done = 0;
+	ssize_t n;
+
+	if(diskFd < 0 || __atomic_load_n(&homeWritesLeft, __ATOMIC_RELAXED) == 0)
+	{
+		return -EIO;
+	}
+	STAT_ADD(statDiskWrites, 1);
+	STAT_ADD(statDiskBytesWritten, len);
+	if(diskMap != NULL)
+	{
+		//the mapping can't grow, so the image is full
+		if(offset + len > diskMapSize)
+		{
+			return -ENOSPC;
+		}
+		memcpy(diskMap + offset, buf, len);
+		disk_mark_dirty(offset, len);
+		return 0;
+	}
+	while(done < len)
+	{
+		n = pwrite(diskFd, (const char *)buf + done, len - done, offset + done);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -errno;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+//function to read count whole blocks starting at blockNum
+static int disk_read_blocks(long blockNum, int count, void *buf){
+	return disk_pread(buf, (size_t)count*blockSize, (off_t)blockNum*blockSize);
+}
+
+//function to write count whole blocks starting at blockNum
+static int disk_write_blocks(long blockNum, int count, const void *buf){
+	return disk_pwrite(buf, (size_t)count*blockSize, (off_t)blockNum*blockSize);
+}
+
+//Metadata blocks (the root, the allocation table and the directory blocks)
+//are read from the image once and then stay resident. Handlers change them in
+//place and mark them dirty, and dirty blocks only go back to the image on
+//flush, fsync, unmount, or when a handler notices the write back interval
+//has passed. In mmap mode the resident copy is the mapping itself.
+struct cs1550_meta_block
+{
+	long blockNum;		//first block this entry covers
+	int nBlocks;		//how many consecutive blocks it covers
+	int dirty;			//changed since it was last written back
+	int dirtyLo, dirtyHi;	//which of its blocks changed, when dirty
+	int mapped;			//data points into the mapping rather than the heap
+	char *data;			//nBlocks*blockSize bytes
+	struct cs1550_meta_block *next;	//next entry in the same hash bucket
+};
+
+#define META_BUCKETS 64
+static struct cs1550_meta_block *metaCache[META_BUCKETS];
+static int metaDirtyCount = 0;
+//how many blocks those dirty entries have changed
+static long metaDirtyBlocks = 0;
+static time_t metaLastWriteback = 0;
+//set when the image has a journal: metadata then has to get there before
+//the image, so it's never changed in place in the mapping
+static int metaJournaled = 0;
+//guards the hash chains and dirty flags. The contents of a block are guarded
+//by the lock of whatever it holds (the root, a directory, a file, the allocator)
+static pthread_mutex_t metaLock = PTHREAD_MUTEX_INITIALIZER;
+
+//function to find the resident entry for a metadata block, if there is one
+static struct cs1550_meta_block *meta_lookup(long blockNum){
+
+	struct cs1550_meta_block *mb;
+
+	for(mb = metaCache[blockNum % META_BUCKETS]; mb != NULL; mb = mb->next)
+	{
+		if(mb->blockNum == blockNum)
+		{
+			return mb;
+		}
+	}
+	return NULL;
+}
+
+//function to make a new resident entry. The data is left for the caller to fill
+static struct cs1550_meta_block *meta_insert(long blockNum, int nBlocks){
+
+	struct cs1550_meta_block *mb = calloc(1, sizeof(struct cs1550_meta_block));
+
+	if(mb == NULL)
+	{
+		return NULL;
+	}
+	mb->blockNum = blockNum;
+	mb->nBlocks = nBlocks;
+	mb->data = metaJournaled ? NULL : disk_block_ptr(blockNum);
+	if(mb->data != NULL && disk_block_ptr(blockNum + nBlocks - 1) != NULL)
+	{
+		mb->mapped = 1;
+	}
+	else
+	{
+		mb->data = malloc((size_t)nBlocks*blockSize);
+		if(mb->data == NULL)
+		{
+			free(mb);
+			return NULL;
+		}
+	}
+	mb->next = metaCache[blockNum % META_BUCKETS];
+	metaCache[blockNum % META_BUCKETS] = mb;
+	return mb;
+}
+
+//function to throw away a resident entry without writing it back
+static void meta_remove(long blockNum){
+
+	struct cs1550_meta_block **link = &metaCache[blockNum % META_BUCKETS];
+	struct cs1550_meta_block *mb;
+
+	pthread_mutex_lock(&metaLock);
+	while((mb = *link) != NULL)
+	{
+		if(mb->blockNum == blockNum)
+		{
+			*link = mb->next;
+			if(mb->dirty)
+			{
+				metaDirtyCount--;
+				metaDirtyBlocks -= mb->dirtyHi - mb->dirtyLo;
+			}
+			if(!mb->mapped)
+			{
+				free(mb->data);
+			}
+			free(mb);
+			break;
+		}
+		link = &mb->next;
+	}
+	pthread_mutex_unlock(&metaLock);
+}
+
+//function to get the resident copy of a metadata block, reading it on first use
+//returns NULL if the block can't be read
+static void *meta_get(long blockNum, int nBlocks){
+
+	struct cs1550_meta_block *mb;
+	void *data = NULL;
+
+	pthread_mutex_lock(&metaLock);
+	mb = meta_lookup(blockNum);
+	if(mb == NULL)
+	{
+		mb = meta_insert(blockNum, nBlocks);
+		if(mb != NULL && !mb->mapped && disk_read_blocks(blockNum, nBlocks, mb->data) != 0)
+		{
+			//it went in at the head of its bucket
+			metaCache[blockNum % META_BUCKETS] = mb->next;
+			free(mb->data);
+			free(mb);
+			mb = NULL;
+		}
+	}
+	if(mb != NULL)
+	{
+		data = mb->data;
+	}
+	pthread_mutex_unlock(&metaLock);
+	return data;
+}
+
+//function to mark blocks first to first+count-1 of a resident entry as changed
+//called with metaLock held
+static void meta_mark(struct cs1550_meta_block *mb, int first, int count){
+
+	if(mb->mapped)
+	{
+		disk_mark_dirty((off_t)(mb->blockNum + first)*blockSize, (size_t)count*blockSize);
+	}
+	else if(!mb->dirty)
+	{
+		mb->dirty = 1;
+		mb->dirtyLo = first;
+		mb->dirtyHi = first + count;
+		metaDirtyCount++;
+		metaDirtyBlocks += count;
+	}
+	else
+	{
+		metaDirtyBlocks -= mb->dirtyHi - mb->dirtyLo;
+		if(first < mb->dirtyLo)
+		{
+			mb->dirtyLo = first;
+		}
+		if(first + count > mb->dirtyHi)
+		{
+			mb->dirtyHi = first + count;
+		}
+		metaDirtyBlocks += mb->dirtyHi - mb->dirtyLo;
+	}
+}
+
+//function to record that a metadata block has changed. If buf isn't the
+//resident copy it is copied in, so it must hold nBlocks whole blocks
+static int meta_put(long blockNum, int nBlocks, const void *buf){
+
+	struct cs1550_meta_block *mb;
+
+	pthread_mutex_lock(&metaLock);
+	mb = meta_lookup(blockNum);
+	if(mb == NULL)
+	{
+		mb = meta_insert(blockNum, nBlocks);
+		if(mb == NULL)
+		{
+			pthread_mutex_unlock(&metaLock);
+			return -ENOMEM;
+		}
+	}
+	if(buf != mb->data)
+	{
+		memcpy(mb->data, buf, (size_t)nBlocks*blockSize);
+	}
+	meta_mark(mb, 0, nBlocks);
+	pthread_mutex_unlock(&metaLock);
+	return 0;
+}
+
+//function to record that only some blocks of a resident entry have changed,
+//so a big one (the bitmap) writes back just those
+static void meta_put_range(long blockNum, int first, int count){
+
+	struct cs1550_meta_block *mb;
+
+	pthread_mutex_lock(&metaLock);
+	mb = meta_lookup(blockNum);
+	if(mb != NULL)
+	{
+		meta_mark(mb, first, count);
+	}
+	pthread_mutex_unlock(&metaLock);
+}
+
+//function to get a zeroed resident copy of a block that has just been
+//allocated, without reading what was there before. The caller fills in its
+//record and meta_puts it
+//returns NULL if there's no memory for it
+static void *meta_new(long blockNum){
+
+	struct cs1550_meta_block *mb;
+	void *data = NULL;
+
+	pthread_mutex_lock(&metaLock);
+	mb = meta_lookup(blockNum);
+	if(mb == NULL)
+	{
+		mb = meta_insert(blockNum, 1);
+	}
+	if(mb != NULL)
+	{
+		memset(mb->data, 0, blockSize);
+		data = mb->data;
+	}
+	pthread_mutex_unlock(&metaLock);
+	return data;
+}
+
+//function to write one dirty metadata block to its home, with metaLock held
+static int meta_write_home(struct cs1550_meta_block *mb){
+
+	if(disk_write_blocks(mb->blockNum + mb->dirtyLo, mb->dirtyHi - mb->dirtyLo, mb->data + (size_t)mb->dirtyLo*blockSize) != 0)
+	{
+		return -EIO;
+	}
+	if(homeWritesLeft > 0)
+	{
+		__atomic_store_n(&homeWritesLeft, homeWritesLeft - 1, __ATOMIC_RELAXED);
+	}
+	mb->dirty = 0;
+	metaDirtyCount--;
+	metaDirtyBlocks -= mb->dirtyHi - mb->dirtyLo;
+	return 0;
+}
+
+//function to write every dirty metadata block back to the image. The block
+//holding lastBlock (the header, on a journaled image) goes last, once the
+//rest are stable: mount only replays the transaction after the header's
+//sequence number, so the header must not reach its home before the others
+static int meta_writeback(long lastBlock){
+
+	struct cs1550_meta_block *mb, *last = NULL;
+	int i, res = 0;
+
+	pthread_mutex_lock(&metaLock);
+	for(i = 0; i < META_BUCKETS && metaDirtyCount > 0; i++)
+	{
+		for(mb = metaCache[i]; mb != NULL; mb = mb->next)
+		{
+			if(!mb->dirty)
+			{
+				continue;
+			}
+			if(lastBlock >= mb->blockNum && lastBlock < mb->blockNum + mb->nBlocks)
+			{
+				last = mb;
+			}
+			else if(meta_write_home(mb) != 0)
+			{
+				res = -EIO;
+			}
+		}
+	}
+	if(last != NULL && res == 0 && (disk_flush() != 0 || meta_write_home(last) != 0))
+	{
+		res = -EIO;
+	}
+	metaLastWriteback = time(NULL);
+	pthread_mutex_unlock(&metaLock);
+	if(res == 0)
+	{
+		res = disk_sync();
+	}
+	return res;
+}
+
+//function to drop every resident metadata block (at unmount, after a write back)
+static void meta_drop_all(){
+
+	struct cs1550_meta_block *mb;
+	int i;
+
+	for(i = 0; i < META_BUCKETS; i++)
+	{
+		while((mb = metaCache[i]) != NULL)
+		{
+			metaCache[i] = mb->next;
+			if(!mb->mapped)
+			{
+				free(mb->data);
+			}
+			free(mb);
+		}
+	}
+	metaDirtyCount = 0;
+	metaDirtyBlocks = 0;
+}
+
+//File data goes through a block cache of -o cache KB. Blocks are kept on an
+//LRU list and the least recently used one is thrown out to make room,
+//written back first if it's dirty. Writes only change the cached copy; dirty
+//blocks reach the image on eviction, flush, fsync and unmount, sorted and in
+//runs of consecutive blocks. In mmap mode the mapping already is a cache, so
+//this one stays out of the way.
+struct cs1550_cache_block
+{
+	long blockNum;
+	int dirty;			//changed since it was last written back
+	struct cs1550_cache_block *hashNext;
+	struct cs1550_cache_block *lruPrev, *lruNext;
+	char data[];		//blockSize bytes
+};
+
+#define CACHE_BUCKETS 1024
+//most bytes read from or written to the image in one go, though always at
+//least a block
+#define CACHE_BATCH_BYTES 16384
+static struct cs1550_cache_block *cacheHash[CACHE_BUCKETS];
+static struct cs1550_cache_block *cacheLruHead = NULL, *cacheLruTail = NULL;
+static long cacheBlocks = 0, cacheDirty = 0;
+static long cacheHits = 0, cacheMisses = 0, cacheEvictions = 0, cacheReadahead = 0;
+//guards everything above. It's let go while a miss is read from the image,
+//which is safe because the file's own lock keeps writers to those blocks out
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+//function to tell whether data should go through the cache at all
+static int cache_enabled(){
+	return options.cache > 0 && diskMap == NULL;
+}
+
+//function to get how many blocks go to or from the image in one go
+static long cache_batch(){
+	return blockSize < CACHE_BATCH_BYTES ? CACHE_BATCH_BYTES / blockSize : 1;
+}
+
+//function to find a cached block, if it's there
+static struct cs1550_cache_block *cache_find(long blockNum){
+
+	struct cs1550_cache_block *cb;
+
+	for(cb = cacheHash[blockNum % CACHE_BUCKETS]; cb != NULL; cb = cb->hashNext)
+	{
+		if(cb->blockNum == blockNum)
+		{
+			break;
+		}
+	}
+	return cb;
+}
+
+//function to take a block off the LRU list
+static void cache_lru_unlink(struct cs1550_cache_block *cb){
+
+	if(cb->lruPrev != NULL)
+	{
+		cb->lruPrev->lruNext = cb->lruNext;
+	}
+	else
+	{
+		cacheLruHead = cb->lruNext;
+	}
+	if(cb->lruNext != NULL)
+	{
+		cb->lruNext->lruPrev = cb->lruPrev;
+	}
+	else
+	{
+		cacheLruTail = cb->lruPrev;
+	}
+	cb->lruPrev = cb->lruNext = NULL;
+}
+
+//function to put a block at the most recently used end of the LRU list
+static void cache_lru_push(struct cs1550_cache_block *cb){
+
+	cb->lruNext = cacheLruHead;
+	if(cacheLruHead != NULL)
+	{
+		cacheLruHead->lruPrev = cb;
+	}
+	cacheLruHead = cb;
+	if(cacheLruTail == NULL)
+	{
+		cacheLruTail = cb;
+	}
+}
+
+//function to take a block out of the cache and free it, without writing it
+static void cache_free(struct cs1550_cache_block *cb){
+
+	struct cs1550_cache_block **link = &cacheHash[cb->blockNum % CACHE_BUCKETS];
+
+	while(*link != cb)
+	{
+		link = &(*link)->hashNext;
+	}
+	*link = cb->hashNext;
+	cache_lru_unlink(cb);
+	if(cb->dirty)
+	{
+		cacheDirty--;
+	}
+	cacheBlocks--;
+	free(cb);
+}
+
+//function to make room by throwing out the least recently used block
+static int cache_evict(){
+
+	struct cs1550_cache_block *cb = cacheLruTail;
+	int res;
+
+	if(cb == NULL)
+	{
+		return 0;
+	}
+	if(cb->dirty)
+	{
+		res = disk_write_blocks(cb->blockNum, 1, cb->data);
+		if(res != 0)
+		{
+			return res;
+		}
+	}
+	cache_free(cb);
+	cacheEvictions++;
+	return 0;
+}
+
+//function to add a block to the cache. The data is left for the caller to fill
+static struct cs1550_cache_block *cache_insert(long blockNum){
+
+	struct cs1550_cache_block *cb;
+
+	while(cacheBlocks >= (long)options.cache*1024/blockSize && cacheLruTail != NULL)
+	{
+		if(cache_evict() != 0)
+		{
+			return NULL;
+		}
+	}
+	cb = calloc(1, sizeof(struct cs1550_cache_block) + blockSize);
+	if(cb == NULL)
+	{
+		return NULL;
+	}
+	cb->blockNum = blockNum;
+	cb->hashNext = cacheHash[blockNum % CACHE_BUCKETS];
+	cacheHash[blockNum % CACHE_BUCKETS] = cb;
+	cache_lru_push(cb);
+	cacheBlocks++;
+	return cb;
+}
+
+//function to read len bytes at a byte offset into the image through the cache
+//blocks that aren't cached are read in runs of up to cache_batch() at a time
+static int cache_pread(void *buf, size_t len, off_t offset){
+
+	char *batch = NULL;
+	struct cs1550_cache_block *cb;
+	size_t done = 0, within, n;
+	long blockNum, count, i;
+	int res;
+
+	if(!cache_enabled())
+	{
+		return disk_pread(buf, len, offset);
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	while(done < len)
+	{
+		blockNum = (offset + done) / blockSize;
+		within = (offset + done) % blockSize;
+		n = blockSize - within;
+		if(n > len - done)
+		{
+			n = len - done;
+		}
+
+		cb = cache_find(blockNum);
+		if(cb != NULL)
+		{
+			cacheHits++;
+			cache_lru_unlink(cb);
+			cache_lru_push(cb);
+			memcpy((char *)buf + done, cb->data + within, n);
+			done += n;
+			continue;
+		}
+
+		//a miss: read it along with the uncached blocks after it that are wanted too
+		count = 1;
+		while(count < cache_batch() && (blockNum + count)*blockSize < offset + (off_t)len && cache_find(blockNum + count) == NULL)
+		{
+			count++;
+		}
+		cacheMisses += count;
+		pthread_mutex_unlock(&cacheLock);
+		if(batch == NULL)
+		{
+			batch = malloc(cache_batch()*blockSize);
+		}
+		res = batch != NULL ? disk_read_blocks(blockNum, count, batch) : -ENOMEM;
+		pthread_mutex_lock(&cacheLock);
+		if(res != 0)
+		{
+			pthread_mutex_unlock(&cacheLock);
+			free(batch);
+			return res;
+		}
+		for(i = 0; i < count && done < len; i++)
+		{
+			//another reader may have brought it in meanwhile
+			cb = cache_find(blockNum + i);
+			if(cb == NULL)
+			{
+				cb = cache_insert(blockNum + i);
+				if(cb != NULL)
+				{
+					memcpy(cb->data, batch + i*blockSize, blockSize);
+				}
+			}
+			within = (offset + done) % blockSize;
+			n = blockSize - within;
+			if(n > len - done)
+			{
+				n = len - done;
+			}
+			memcpy((char *)buf + done, (cb != NULL ? cb->data : batch + i*blockSize) + within, n);
+			done += n;
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+	free(batch);
+	return 0;
+}
+
+//function to write len bytes at a byte offset into the image through the cache
+//the cached blocks are marked dirty and written back later
+static int cache_pwrite(const void *buf, size_t len, off_t offset){
+
+	struct cs1550_cache_block *cb;
+	size_t done = 0, within, n;
+	long blockNum;
+	int res;
+
+	if(!cache_enabled())
+	{
+		return disk_pwrite(buf, len, offset);
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	while(done < len)
+	{
+		blockNum = (offset + done) / blockSize;
+		within = (offset + done) % blockSize;
+		n = blockSize - within;
+		if(n > len - done)
+		{
+			n = len - done;
+		}
+
+		cb = cache_find(blockNum);
+		if(cb != NULL)
+		{
+			cacheHits++;
+			cache_lru_unlink(cb);
+			cache_lru_push(cb);
+		}
+		else
+		{
+			cacheMisses++;
+			cb = cache_insert(blockNum);
+			if(cb == NULL)
+			{
+				//no room, so this part goes straight to the image
+				res = disk_pwrite((const char *)buf + done, n, offset + done);
+				if(res != 0)
+				{
+					pthread_mutex_unlock(&cacheLock);
+					return res;
+				}
+				done += n;
+				continue;
+			}
+			//only a partly written block needs its old contents
+			if(n < (size_t)blockSize && (res = disk_read_blocks(blockNum, 1, cb->data)) != 0)
+			{
+				cache_free(cb);
+				pthread_mutex_unlock(&cacheLock);
+				return res;
+			}
+		}
+		memcpy(cb->data + within, (const char *)buf + done, n);
+		if(!cb->dirty)
+		{
+			cb->dirty = 1;
+			cacheDirty++;
+		}
+		done += n;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	return 0;
+}
+
+//function to bring count blocks from blockNum into the cache ahead of being
+//asked for. Blocks already cached are left alone; the rest are read in runs
+static int cache_prefetch(long blockNum, long count){
+
+	char *batch = NULL;
+	struct cs1550_cache_block *cb;
+	off_t start, end;
+	long i, n;
+	int res = 0;
+
+	if(diskMap != NULL)
+	{
+		//the kernel does the reading for a mapping, it only needs telling
+		start = (off_t)blockNum*blockSize;
+		end = start + (off_t)count*blockSize;
+		start -= start % sysconf(_SC_PAGESIZE);
+		if(end > (off_t)diskMapSize)
+		{
+			end = diskMapSize;
+		}
+		if(start < end)
+		{
+			madvise(diskMap + start, end - start, MADV_WILLNEED);
+		}
+		return 0;
+	}
+	if(!cache_enabled())
+	{
+		return 0;
+	}
+	batch = malloc(cache_batch()*blockSize);
+	if(batch == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&cacheLock);
+	while(count > 0)
+	{
+		if(cache_find(blockNum) != NULL)
+		{
+			blockNum++;
+			count--;
+			continue;
+		}
+		for(n = 1; n < count && n < cache_batch() && cache_find(blockNum + n) == NULL; n++)
+		{
+		}
+		pthread_mutex_unlock(&cacheLock);
+		res = disk_read_blocks(blockNum, n, batch);
+		pthread_mutex_lock(&cacheLock);
+		if(res != 0)
+		{
+			break;
+		}
+		for(i = 0; i < n; i++)
+		{
+			if(cache_find(blockNum + i) != NULL)
+			{
+				continue;
+			}
+			cb = cache_insert(blockNum + i);
+			if(cb == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			memcpy(cb->data, batch + i*blockSize, blockSize);
+			cacheReadahead++;
+		}
+		if(res != 0)
+		{
+			break;
+		}
+		blockNum += n;
+		count -= n;
+	}
+	pthread_mutex_unlock(&cacheLock);
+	free(batch);
+	return res;
+}
+
+//function to order cached blocks by block number
+static int cache_block_cmp(const void *a, const void *b){
+
+	long x = (*(struct cs1550_cache_block *const *)a)->blockNum;
+	long y = (*(struct cs1550_cache_block *const *)b)->blockNum;
+
+	return (x > y) - (x < y);
+}
+
+//function to write every dirty cached block back to the image
+//they're sorted first so runs of consecutive blocks go out in one write
+static int cache_flush(){
+
+	char *batch;
+	struct cs1550_cache_block **dirty, *cb;
+	long nDirty = 0, i, j, k;
+	int res = 0;
+
+	pthread_mutex_lock(&cacheLock);
+	if(cacheDirty == 0)
+	{
+		pthread_mutex_unlock(&cacheLock);
+		return 0;
+	}
+	dirty = malloc(cacheDirty * sizeof(struct cs1550_cache_block *));
+	batch = malloc(cache_batch()*blockSize);
+	if(dirty == NULL || batch == NULL)
+	{
+		pthread_mutex_unlock(&cacheLock);
+		free(dirty);
+		free(batch);
+		return -ENOMEM;
+	}
+	for(cb = cacheLruHead; cb != NULL; cb = cb->lruNext)
+	{
+		if(cb->dirty)
+		{
+			dirty[nDirty++] = cb;
+		}
+	}
+	qsort(dirty, nDirty, sizeof(struct cs1550_cache_block *), cache_block_cmp);
+
+	for(i = 0; i < nDirty; i = j)
+	{
+		//gather the run starting at dirty[i]
+		for(j = i + 1; j < nDirty && j - i < cache_batch() && dirty[j]->blockNum == dirty[j-1]->blockNum + 1; j++)
+		{
+		}
+		for(k = i; k < j; k++)
+		{
+			memcpy(batch + (k - i)*blockSize, dirty[k]->data, blockSize);
+		}
+		if(disk_write_blocks(dirty[i]->blockNum, j - i, batch) != 0)
+		{
+			res = -EIO;
+			continue;
+		}
+		for(k = i; k < j; k++)
+		{
+			dirty[k]->dirty = 0;
+			cacheDirty--;
+		}
+	}
+	pthread_mutex_unlock(&cacheLock);
+	free(dirty);
+	free(batch);
+	return res;
+}
+
+//function to forget a cached block without writing it, for when it's freed
+static void cache_drop(long blockNum){
+
+	struct cs1550_cache_block *cb;
+
+	pthread_mutex_lock(&cacheLock);
+	cb = cache_find(blockNum);
+	if(cb != NULL)
+	{
+		cache_free(cb);
+	}
+	pthread_mutex_unlock(&cacheLock);
+}
+
+//function to tell whether the cache has a block with changes the image
+//doesn't have yet, so it can't be read from the image directly
+static int cache_dirty(long blockNum){
+
+	struct cs1550_cache_block *cb;
+	int dirty;
+
+	if(!cache_enabled())
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&cacheLock);
+	cb = cache_find(blockNum);
+	dirty = cb != NULL && cb->dirty;
+	pthread_mutex_unlock(&cacheLock);
+	return dirty;
+}
+
+//function to empty the cache (at unmount, after a flush)
+static void cache_drop_all(){
+
+	while(cacheLruHead != NULL)
+	{
+		cache_free(cacheLruHead);
+	}
+}
+
+//function to get the root (block 0)
+//This returns the resident root struct, which handlers may change in place
+static cs1550_root_directory *load_root(){
+	return meta_get(0, 1);
+}
+
+//function to record a change to the root (block 0)
+static void write_root(struct cs1550_root_directory *root){
+
+	meta_put(0, 1, root);
+}
+//function to get the file allocation table of a version 1 image (block 1-4)
+static cs1550_allocation_table *load_allTable(){
+	return meta_get(1, 4);
+}
+//function to record a change to the file allocation table (block 1-4)
+static void write_allTable(struct cs1550_allocation_table *allTable){
+
+	meta_put(1, 4, allTable);
+}
+//the resident allocation bitmap (one bit per block, 1 is allocated) and
+//header, set up by alloc_init at mount
+static uint64_t *allocBits = NULL;
+static cs1550_header *header = NULL;
+//the block the header is in, which is the root's when blocks are big enough
+static long headerBlock = HEADER_BLOCK;
+//free blocks promised to delayed allocations, which nothing else may take
+static long allocReserved = 0;
+//guards the bitmap, the header and the reservations
+static pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+
+//function to record a change to the header
+static void header_put(){
+
+	meta_put(headerBlock, 1, (char *)header - HEADER_OFFSET % blockSize);
+}
+
+//function to record a change to the bits of count blocks from blockNum, so
+//only the bitmap blocks holding them are written back
+static void bitmap_put(long blockNum, long count){
+
+	long first = blockNum / 8 / blockSize;
+	long last = (blockNum + count - 1) / 8 / blockSize;
+
+	meta_put_range(header->nBitmapStart, first, last - first + 1);
+}
+
+//Metadata reaches an image with a journal in transactions. Each write back
+//is one: the dirty metadata blocks of every operation since the last one go
+//to the journal in a single sequential write, and only once that (and the
+//file data written before it) is on stable storage do they go to their home
+//blocks. A crash then leaves either the old metadata or a committed
+//transaction, which journal_replay puts in place at the next mount. The next
+//transaction's first flush is what makes the last one's home blocks stable,
+//so every transaction can start at the front of the journal.
+static long journalCommits = 0, journalBlocks = 0;
+
+//function to add whole blocks to a transaction checksum (64 bit FNV-1a, a
+//word at a time)
+static uint64_t journal_checksum(uint64_t sum, const void *buf, size_t len){
+
+	const uint64_t *word = buf;
+	size_t i;
+
+	for(i = 0; i < len / sizeof(uint64_t); i++)
+	{
+		sum = (sum ^ word[i]) * 0x100000001b3ULL;
+	}
+	return sum;
+}
+#define JOURNAL_SEED 0xcbf29ce484222325ULL
+
+//function to count the journal blocks a transaction of n metadata blocks
+//takes, with its descriptors and commit record
+static long journal_size(long n){
+
+	return (n + MAX_BLOCKS_IN_DESCRIPTOR - 1) / MAX_BLOCKS_IN_DESCRIPTOR + n + 1;
+}
+
+//function to write every dirty metadata block to the journal as one
+//transaction and wait for it to be stable. meta_writeback then puts them
+//in place. Called with the root locked for writing, so nothing changes the
+//metadata in between. Handlers wait in meta_journal_wait while the changes
+//fill half the journal, so a transaction should always fit
+//returns 0 (also when there's no journal), or a negative error, when
+//nothing may go in place
+static int journal_commit(){
+
+	struct cs1550_meta_block *mb;
+	cs1550_journal_record *rec;
+	char *buf;
+	long seq, n, total, k, pos, b;
+	uint64_t sum = JOURNAL_SEED;
+	int i, res;
+
+	if(header == NULL || header->nJournalBlocks == 0)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&metaLock);
+	n = metaDirtyCount;
+	//the header may add a block of its own
+	total = journal_size(metaDirtyBlocks + 1);
+	pthread_mutex_unlock(&metaLock);
+	if(n == 0)
+	{
+		return 0;
+	}
+	//written in place, or split, a crash could leave half of an operation
+	//on disk, so the changes stay in memory until the journal can take them
+	if(total > header->nJournalBlocks)
+	{
+		fprintf(stderr, "cs1550: %ld journal blocks can't hold a transaction of %ld\n", header->nJournalBlocks, total);
+		return -ENOSPC;
+	}
+
+	//the header goes in every transaction, saying which one it is
+	pthread_mutex_lock(&allocLock);
+	seq = ++header->nJournalSequence;
+	header_put();
+	pthread_mutex_unlock(&allocLock);
+
+	pthread_mutex_lock(&metaLock);
+	n = metaDirtyBlocks;
+	total = journal_size(n);
+	buf = calloc(total, blockSize);
+	if(buf == NULL)
+	{
+		pthread_mutex_unlock(&metaLock);
+		pthread_mutex_lock(&allocLock);
+		header->nJournalSequence--;
+		pthread_mutex_unlock(&allocLock);
+		return -ENOMEM;
+	}
+
+	//block k goes in group k / MAX_BLOCKS_IN_DESCRIPTOR, after that group's descriptor
+	k = 0;
+	for(i = 0; i < META_BUCKETS; i++)
+	{
+		for(mb = metaCache[i]; mb != NULL; mb = mb->next)
+		{
+			for(b = mb->dirty ? mb->dirtyLo : 0; mb->dirty && b < mb->dirtyHi; b++, k++)
+			{
+				pos = k / MAX_BLOCKS_IN_DESCRIPTOR * (MAX_BLOCKS_IN_DESCRIPTOR + 1);
+				rec = (cs1550_journal_record *)(buf + pos*blockSize);
+				rec->nMagic = JOURNAL_MAGIC;
+				rec->nSequence = seq;
+				rec->nType = JOURNAL_DESCRIPTOR;
+				rec->blocks[rec->nCount++] = mb->blockNum + b;
+				memcpy(buf + (pos + rec->nCount)*blockSize, mb->data + b*blockSize, blockSize);
+			}
+		}
+	}
+	pthread_mutex_unlock(&metaLock);
+
+	sum = journal_checksum(sum, buf, (size_t)(total - 1)*blockSize);
+	rec = (cs1550_journal_record *)(buf + (total - 1)*blockSize);
+	rec->nMagic = JOURNAL_MAGIC;
+	rec->nSequence = seq;
+	rec->nType = JOURNAL_COMMIT;
+	rec->nChecksum = sum;
+
+	//file data and the last transaction's home blocks have to be stable
+	//before the journal is written over
+	res = disk_flush();
+	if(res == 0)
+	{
+		res = disk_write_blocks(header->nJournalStart, total, buf);
+	}
+	if(res == 0)
+	{
+		res = disk_flush();
+	}
+	free(buf);
+	if(res == 0)
+	{
+		journalCommits++;
+		journalBlocks += n;
+	}
+	return res;
+}
+
+//function to put a committed transaction that may not have reached its home
+//blocks in place, at mount before anything else reads the image. hdr is the
+//header as it is on disk
+static int journal_replay(const cs1550_header *hdr){
+
+	cs1550_journal_record *rec;
+	char *block;
+	long *homes, nHomes = 0, pos = 0, i, n, seq = hdr->nJournalSequence + 1;
+	uint64_t sum = JOURNAL_SEED;
+	int res = 0, committed = 0;
+
+	if(hdr->nJournalBlocks == 0)
+	{
+		return 0;
+	}
+	block = malloc(blockSize);
+	homes = malloc(hdr->nJournalBlocks*sizeof(long));
+	if(block == NULL || homes == NULL)
+	{
+		free(block);
+		free(homes);
+		return -ENOMEM;
+	}
+	rec = (cs1550_journal_record *)block;
+
+	//check the whole transaction is there before putting any of it in place
+	while(pos < hdr->nJournalBlocks && disk_read_blocks(hdr->nJournalStart + pos, 1, block) == 0)
+	{
+		if(rec->nMagic != JOURNAL_MAGIC || rec->nSequence != seq)
+		{
+			break;
+		}
+		if(rec->nType == JOURNAL_COMMIT)
+		{
+			committed = rec->nChecksum == (long)sum;
+			break;
+		}
+		if(rec->nType != JOURNAL_DESCRIPTOR || rec->nCount <= 0 || rec->nCount > (int)MAX_BLOCKS_IN_DESCRIPTOR ||
+			pos + 1 + rec->nCount >= hdr->nJournalBlocks)
+		{
+			break;
+		}
+		n = rec->nCount;
+		homes[pos] = -1;
+		for(i = 0; i < n; i++)
+		{
+			if(rec->blocks[i] < 0 || rec->blocks[i] >= hdr->nBlocks)
+			{
+				break;
+			}
+			homes[pos + 1 + i] = rec->blocks[i];
+		}
+		if(i < n)
+		{
+			break;
+		}
+		sum = journal_checksum(sum, block, blockSize);
+		for(i = pos + 1; i <= pos + n && disk_read_blocks(hdr->nJournalStart + i, 1, block) == 0; i++)
+		{
+			sum = journal_checksum(sum, block, blockSize);
+		}
+		if(i <= pos + n)
+		{
+			break;
+		}
+		pos = nHomes = i;
+	}
+
+	for(i = 0; committed && i < nHomes && res == 0; i++)
+	{
+		//descriptors have no home
+		if(homes[i] < 0)
+		{
+			continue;
+		}
+		res = disk_read_blocks(hdr->nJournalStart + i, 1, block);
+		if(res == 0)
+		{
+			res = disk_write_blocks(homes[i], 1, block);
+		}
+	}
+	if(committed && res == 0)
+	{
+		res = disk_flush();
+		fprintf(stderr, "cs1550: replayed journal transaction %ld\n", seq);
+	}
+	free(block);
+	free(homes);
+	return res;
+}
+
+//function to write every dirty metadata block back, through the journal if
+//the image has one
+static int meta_commit(){
+
+	int res = journal_commit();
+
+	if(res != 0)
+	{
+		return res;
+	}
+	return meta_writeback(header != NULL && header->nJournalBlocks > 0 ? headerBlock : -1);
+}
+
+//function to set up the allocator at mount. The header is looked at first
+//for the block size. A version 1 image has its byte-per-block table
+//converted to a bitmap and gets a header, and older images get their
+//(version 1) geometry written into the header, which makes them version 4
+//images from then on
+static int alloc_init(){
+
+	cs1550_header probe;
+	cs1550_allocation_table *fat;
+	char legacy[MAX_BLOCKS];
+	char *block;
+	long i, nBlocks, nFree = 0;
+
+	if(disk_pread(&probe, sizeof(cs1550_header), HEADER_OFFSET) != 0)
+	{
+		return -EIO;
+	}
+	blockSize = BLOCK_SIZE;
+	metaJournaled = 0;
+	if(probe.nMagic == CS1550_MAGIC && probe.nVersion > CS1550_VERSION_SHARED)
+	{
+		fprintf(stderr, "cs1550: image format version %d is newer than this program\n", probe.nVersion);
+		return -EINVAL;
+	}
+	if(probe.nMagic == CS1550_MAGIC && probe.nVersion >= CS1550_VERSION_SUPER)
+	{
+		if(probe.nBlockSize < MIN_BLOCK_SIZE || probe.nBlockSize > MAX_BLOCK_SIZE || (probe.nBlockSize & (probe.nBlockSize - 1)) != 0)
+		{
+			fprintf(stderr, "cs1550: image has a bad block size of %ld\n", probe.nBlockSize);
+			return -EINVAL;
+		}
+		blockSize = probe.nBlockSize;
+		if(journal_replay(&probe) != 0)
+		{
+			return -EIO;
+		}
+		metaJournaled = probe.nJournalBlocks > 0;
+	}
+	headerBlock = HEADER_OFFSET / blockSize;
+	block = meta_get(headerBlock, 1);
+	if(block == NULL)
+	{
+		return -EIO;
+	}
+	header = (cs1550_header *)(block + HEADER_OFFSET % blockSize);
+
+	if(header->nMagic != CS1550_MAGIC)
+	{
+		fat = load_allTable();
+		if(fat == NULL)
+		{
+			return -EIO;
+		}
+		nBlocks = diskSize / BLOCK_SIZE;
+		if(nBlocks > MAX_BLOCKS)
+		{
+			nBlocks = MAX_BLOCKS;
+		}
+
+		memcpy(legacy, fat->blocks, MAX_BLOCKS);
+		memset(fat, 0, sizeof(cs1550_allocation_table));
+		for(i = 0; i < MAX_BLOCKS; i++)
+		{
+			//the root, the table, the header, anything the old table had
+			//handed out and anything past the end of the image are all taken
+			if(i < FIRST_DATA_BLOCK || i >= nBlocks || legacy[i] != 0)
+			{
+				fat->words[i / 64] |= 1ULL << (i % 64);
+			}
+		}
+
+		memset(header, 0, BLOCK_SIZE);
+		header->nMagic = CS1550_MAGIC;
+		header->nVersion = CS1550_VERSION_EXTENTS;
+		header->nBlocks = nBlocks;
+		header->nNextFit = FIRST_DATA_BLOCK;
+		write_allTable(fat);
+	}
+	if(header->nVersion < CS1550_VERSION_SUPER)
+	{
+		//nothing to move: the bitmap is where the version 1 table was, and
+		//files are moved onto inodes one at a time as they're written
+		header->nVersion = CS1550_VERSION_SUPER;
+		header->nBlockSize = BLOCK_SIZE;
+		header->nBitmapStart = 1;
+		header->nBitmapBlocks = 4;
+		header->nFirstDataBlock = FIRST_DATA_BLOCK;
+	}
+	if(header->nBitmapStart <= 0 || header->nBitmapBlocks*blockSize*8 < header->nBlocks ||
+		header->nFirstDataBlock < header->nBitmapStart + header->nBitmapBlocks || header->nFirstDataBlock >= header->nBlocks ||
+		(header->nJournalBlocks > 0 && (header->nJournalStart < header->nBitmapStart + header->nBitmapBlocks ||
+		header->nJournalStart + header->nJournalBlocks > header->nFirstDataBlock)))
+	{
+		fprintf(stderr, "cs1550: image header describes an impossible layout\n");
+		return -EINVAL;
+	}
+	allocBits = meta_get(header->nBitmapStart, header->nBitmapBlocks);
+	if(allocBits == NULL)
+	{
+		return -EIO;
+	}
+
+	//recount rather than trust the stored counter, which may be stale after a crash
+	for(i = 0; i < (header->nBlocks + 63) / 64; i++)
+	{
+		nFree += 64 - __builtin_popcountll(allocBits[i]);
+	}
+	header->nFreeBlocks = nFree;
+	if(header->nNextFit < header->nFirstDataBlock || header->nNextFit >= header->nBlocks)
+	{
+		header->nNextFit = header->nFirstDataBlock;
+	}
+	header_put();
+	return meta_commit();
+}
+
+//function to find and claim a free block
+//the search picks up where the last one left off (next fit) and skips 64
+//taken blocks at a time. Returns the block number, or -ENOSPC when full
+static long alloc_block(){
+
+	long nWords, w, i, blockNum = -ENOSPC;
+	uint64_t word;
+
+	if(allocBits == NULL)
+	{
+		return -EIO;
+	}
+
+	pthread_mutex_lock(&allocLock);
+	nWords = (header->nBlocks + 63) / 64;
+	w = header->nNextFit / 64;
+	//one extra word so the bits before the hint in the first word get a look too
+	for(i = 0; i <= nWords && header->nFreeBlocks - allocReserved > 0; i++, w = (w + 1) % nWords)
+	{
+		word = allocBits[w];
+		if(i == 0)
+		{
+			word |= (1ULL << (header->nNextFit % 64)) - 1;
+		}
+		if(word == ~0ULL)
+		{
+			continue;
+		}
+
+		blockNum = w*64 + __builtin_ctzll(~word);
+		allocBits[w] |= 1ULL << (blockNum % 64);
+		header->nFreeBlocks--;
+		header->nNextFit = (blockNum + 1) % header->nBlocks;
+		bitmap_put(blockNum, 1);
+		header_put();
+		STAT_ADD(statBlocksAllocated, 1);
+		break;
+	}
+	pthread_mutex_unlock(&allocLock);
+	return blockNum;
+}
+
+//function to find and claim up to want blocks that sit next to each other
+//on disk. Takes the first free run of want blocks from the next fit hint on,
+//or failing that the longest run there is. Returns the first block and sets
+//*got to how many were claimed, or returns -ENOSPC when full. The blocks may
+//come out of *reserved, a reservation made with alloc_reserve (NULL if the
+//caller has none), which goes down by as many as it covers
+static long alloc_run(long want, long *got, long *reserved){
+
+	long b, end, start = 0, len, bestStart = -1, bestLen = 0, i, own = reserved != NULL ? *reserved : 0;
+	int pass;
+	uint64_t word;
+
+	if(allocBits == NULL)
+	{
+		return -EIO;
+	}
+	pthread_mutex_lock(&allocLock);
+	if(want > header->nFreeBlocks - allocReserved + own)
+	{
+		want = header->nFreeBlocks - allocReserved + own;
+	}
+
+	//from the hint to the end of the disk, then from the start up to the hint
+	for(pass = 0; pass < 2 && bestLen < want; pass++)
+	{
+		b = pass == 0 ? header->nNextFit : 0;
+		end = pass == 0 ? header->nBlocks : header->nNextFit;
+		len = 0;
+		while(b < end && bestLen < want)
+		{
+			word = allocBits[b / 64];
+			if(b % 64 == 0 && word == ~0ULL)
+			{
+				//64 taken blocks at once
+				len = 0;
+				b += 64;
+				continue;
+			}
+			if(b % 64 == 0 && word == 0 && b + 64 <= end)
+			{
+				//64 free blocks at once
+				if(len == 0)
+				{
+					start = b;
+				}
+				len += 64;
+				b += 64;
+			}
+			else if(word & (1ULL << (b % 64)))
+			{
+				len = 0;
+				b++;
+				continue;
+			}
+			else
+			{
+				if(len == 0)
+				{
+					start = b;
+				}
+				len++;
+				b++;
+			}
+			if(len > bestLen)
+			{
+				bestStart = start;
+				bestLen = len;
+			}
+		}
+	}
+	if(bestLen > want)
+	{
+		bestLen = want;
+	}
+	if(bestLen <= 0)
+	{
+		pthread_mutex_unlock(&allocLock);
+		return -ENOSPC;
+	}
+
+	for(i = bestStart; i < bestStart + bestLen; i++)
+	{
+		allocBits[i / 64] |= 1ULL << (i % 64);
+	}
+	header->nFreeBlocks -= bestLen;
+	header->nNextFit = (bestStart + bestLen) % header->nBlocks;
+	if(own > 0)
+	{
+		own = own < bestLen ? own : bestLen;
+		*reserved -= own;
+		allocReserved -= own;
+	}
+	bitmap_put(bestStart, bestLen);
+	header_put();
+	pthread_mutex_unlock(&allocLock);
+	STAT_ADD(statBlocksAllocated, bestLen);
+	*got = bestLen;
+	return bestStart;
+}
+
+//function to set aside n free blocks for a later alloc_run
+//returns -ENOSPC if there aren't that many left
+static int alloc_reserve(long n){
+
+	int res = 0;
+
+	if(header == NULL)
+	{
+		return -EIO;
+	}
+	pthread_mutex_lock(&allocLock);
+	if(header->nFreeBlocks - allocReserved < n)
+	{
+		res = -ENOSPC;
+	}
+	else
+	{
+		allocReserved += n;
+	}
+	pthread_mutex_unlock(&allocLock);
+	return res;
+}
+
+//function to hand back blocks set aside by alloc_reserve
+static void alloc_unreserve(long n){
+
+	pthread_mutex_lock(&allocLock);
+	allocReserved -= n;
+	if(allocReserved < 0)
+	{
+		allocReserved = 0;
+	}
+	pthread_mutex_unlock(&allocLock);
+}
+
+//With -o dedup, a block of file data that holds the same bytes as one that's
+//stored already isn't written again: the file's extent points at the block
+//that's there, and the files share it. That makes the allocation table a
+//table of reference counts. A block with its bit set and no entry here has
+//one extent pointing at it, and one with an entry has nRefs, and it only
+//goes back to the allocator when the last of them lets go. A shared block is
+//never written in place; a file about to write to one gets a copy of its own
+//first (dedup_copy). Blocks are found by their contents through a hash of
+//the blocks written since the mount with -o dedup, and a block that matches
+//is compared byte for byte before it's shared. A block leaves the hash as
+//soon as it's going to be written in place, so it never promises contents a
+//block doesn't hold. The counts aren't on disk: dedup_init works them out
+//from the extents at mount, for images that have shared blocks (version 5)
+struct cs1550_dedup
+{
+	long nBlock;		//the block
+	long nRefs;			//how many extents point at it
+	int hashed;			//findable by its contents, which hash to nHash
+	uint64_t nHash;
+	struct cs1550_dedup *blockNext;	//next in the same bucket by block
+	struct cs1550_dedup *hashNext;	//next in the same bucket by contents
+};
+
+//both hashes start with this many buckets, and double whenever they hold
+//more entries than buckets
+#define DEDUP_MIN_BUCKETS 1024
+static struct cs1550_dedup **dedupByBlock = NULL, **dedupByHash = NULL;
+static long dedupBuckets = 0, dedupEntries = 0, dedupShared = 0;
+//guards everything above. It's taken before the allocator's lock
+static pthread_mutex_t dedupLock = PTHREAD_MUTEX_INITIALIZER;
+//most blocks with a matching hash dedup_find compares before it gives up
+#define DEDUP_TRIES 4
+
+//function to hash the contents of a block of data
+static uint64_t dedup_hash(const char *data){
+	return journal_checksum(JOURNAL_SEED, data, blockSize);
+}
+
+//function to find a block's entry, if it has one
+static struct cs1550_dedup *dedup_lookup(long blockNum){
+
+	struct cs1550_dedup *e;
+
+	if(dedupBuckets == 0)
+	{
+		return NULL;
+	}
+	for(e = dedupByBlock[blockNum % dedupBuckets]; e != NULL; e = e->blockNext)
+	{
+		if(e->nBlock == blockNum)
+		{
+			break;
+		}
+	}
+	return e;
+}
+
+//function to double the buckets of both hashes
+//returns -ENOMEM if they can't grow, which leaves them as they were
+static int dedup_grow(){
+
+	struct cs1550_dedup **byBlock, **byHash, *e, *next;
+	long n = dedupBuckets ? dedupBuckets*2 : DEDUP_MIN_BUCKETS, i;
+
+	byBlock = calloc(n, sizeof(struct cs1550_dedup *));
+	byHash = calloc(n, sizeof(struct cs1550_dedup *));
+	if(byBlock == NULL || byHash == NULL)
+	{
+		free(byBlock);
+		free(byHash);
+		return -ENOMEM;
+	}
+	for(i = 0; i < dedupBuckets; i++)
+	{
+		for(e = dedupByBlock[i]; e != NULL; e = next)
+		{
+			next = e->blockNext;
+			e->blockNext = byBlock[e->nBlock % n];
+			byBlock[e->nBlock % n] = e;
+		}
+		for(e = dedupByHash[i]; e != NULL; e = next)
+		{
+			next = e->hashNext;
+			e->hashNext = byHash[e->nHash % n];
+			byHash[e->nHash % n] = e;
+		}
+	}
+	free(dedupByBlock);
+	free(dedupByHash);
+	dedupByBlock = byBlock;
+	dedupByHash = byHash;
+	dedupBuckets = n;
+	return 0;
+}
+
+//function to get a block's entry, giving it one (with the one reference its
+//bit stands for) if it has none
+//returns NULL if there's no memory for it
+static struct cs1550_dedup *dedup_entry(long blockNum){
+
+	struct cs1550_dedup *e = dedup_lookup(blockNum);
+
+	if(e != NULL)
+	{
+		return e;
+	}
+	//too few buckets only makes the chains longer
+	if(dedupEntries >= dedupBuckets && dedup_grow() != 0 && dedupBuckets == 0)
+	{
+		return NULL;
+	}
+	e = calloc(1, sizeof(struct cs1550_dedup));
+	if(e == NULL)
+	{
+		return NULL;
+	}
+	e->nBlock = blockNum;
+	e->nRefs = 1;
+	e->blockNext = dedupByBlock[blockNum % dedupBuckets];
+	dedupByBlock[blockNum % dedupBuckets] = e;
+	STAT_ADD(dedupEntries, 1);
+	return e;
+}
+
+//function to take a block out of the hash by contents
+static void dedup_unhash(struct cs1550_dedup *e){
+
+	struct cs1550_dedup **link;
+
+	if(!e->hashed)
+	{
+		return;
+	}
+	link = &dedupByHash[e->nHash % dedupBuckets];
+	while(*link != e)
+	{
+		link = &(*link)->hashNext;
+	}
+	*link = e->hashNext;
+	e->hashed = 0;
+}
+
+//function to throw a block's entry away once it's neither shared nor hashed
+static void dedup_release(struct cs1550_dedup *e){
+
+	struct cs1550_dedup **link;
+
+	if(e->hashed || e->nRefs > 1)
+	{
+		return;
+	}
+	link = &dedupByBlock[e->nBlock % dedupBuckets];
+	while(*link != e)
+	{
+		link = &(*link)->blockNext;
+	}
+	*link = e->blockNext;
+	STAT_ADD(dedupEntries, -1);
+	free(e);
+}
+
+//function to let go of one reference to a block that's being freed
+//returns 1 if other extents still point at it, so it has to stay allocated
+static int dedup_unref(long blockNum){
+
+	struct cs1550_dedup *e;
+	int shared = 0;
+
+	if(STAT_GET(dedupEntries) == 0)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&dedupLock);
+	e = dedup_lookup(blockNum);
+	if(e != NULL && e->nRefs > 1)
+	{
+		if(--e->nRefs == 1)
+		{
+			dedupShared--;
+		}
+		shared = 1;
+	}
+	else if(e != NULL)
+	{
+		dedup_unhash(e);
+	}
+	if(e != NULL)
+	{
+		dedup_release(e);
+	}
+	pthread_mutex_unlock(&dedupLock);
+	return shared;
+}
+
+//function to get how many of count blocks from blockNum, which a file is
+//about to write to in place, are its alone. Those stop being found by their
+//contents, which are about to change
+//returns how many come before the first that's shared
+static long dedup_private(long blockNum, long count){
+
+	struct cs1550_dedup *e;
+	long n;
+
+	if(STAT_GET(dedupEntries) == 0)
+	{
+		return count;
+	}
+	pthread_mutex_lock(&dedupLock);
+	for(n = 0; n < count; n++)
+	{
+		e = dedup_lookup(blockNum + n);
+		if(e == NULL)
+		{
+			continue;
+		}
+		if(e->nRefs > 1)
+		{
+			break;
+		}
+		dedup_unhash(e);
+		dedup_release(e);
+	}
+	pthread_mutex_unlock(&dedupLock);
+	return n;
+}
+
+//function to make a block that was just given the data whose dedup_hash is
+//hash findable by it. A block with no memory for an entry just isn't
+static void dedup_insert(long blockNum, uint64_t hash){
+
+	struct cs1550_dedup *e;
+
+	pthread_mutex_lock(&dedupLock);
+	e = dedup_entry(blockNum);
+	if(e != NULL)
+	{
+		dedup_unhash(e);
+		e->nHash = hash;
+		e->hashed = 1;
+		e->hashNext = dedupByHash[hash % dedupBuckets];
+		dedupByHash[hash % dedupBuckets] = e;
+	}
+	pthread_mutex_unlock(&dedupLock);
+}
+
+//function to throw away every entry, at unmount
+static void dedup_drop_all(){
+
+	struct cs1550_dedup *e, *next;
+	long i;
+
+	pthread_mutex_lock(&dedupLock);
+	for(i = 0; i < dedupBuckets; i++)
+	{
+		for(e = dedupByBlock[i]; e != NULL; e = next)
+		{
+			next = e->blockNext;
+			free(e);
+		}
+	}
+	free(dedupByBlock);
+	free(dedupByHash);
+	dedupByBlock = NULL;
+	dedupByHash = NULL;
+	dedupBuckets = 0;
+	dedupShared = 0;
+	__atomic_store_n(&dedupEntries, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&dedupLock);
+}
+
+//Blocks file_read_buf hands libfuse as pieces of the image are read by
+//libfuse after the handler has let go of the file's lock, so a truncate
+//could free them, and another file be given them, before they're sent. The
+//thread that handed them out pins them until it starts on its next request,
+//since libfuse sends a reply before it takes another, or until the open
+//file they went to is released, when the kernel has had every reply to it.
+//Blocks freed while they're pinned stay allocated, as held frees, until
+//nothing pins them.
+struct cs1550_pin
+{
+	long nStart;		//first block
+	long nBlocks;		//how many follow it
+	const void *owner;	//the open file they were handed to, NULL for a held free
+	pthread_t thread;	//the thread that handed them out
+};
+
+static struct cs1550_pin *pins = NULL;
+static long nPins = 0, nPinsAlloc = 0;
+//set on a thread that may have pins, so the others needn't look
+static __thread int pinsHere = 0;
+//guards the pins, and is taken inside allocLock
+static pthread_mutex_t pinLock = PTHREAD_MUTEX_INITIALIZER;
+
+//function to add nBlocks blocks from nStart to the pins, growing one of the
+//same owner's that they carry on from. Called with pinLock held
+//returns 0 or -ENOMEM
+static int pin_add(const void *owner, long nStart, long nBlocks){
+
+	struct cs1550_pin *grown;
+	pthread_t self = pthread_self();
+	long i;
+
+	for(i = 0; owner != NULL && i < nPins; i++)
+	{
+		if(pins[i].owner == owner && pthread_equal(pins[i].thread, self) &&
+			nStart >= pins[i].nStart && nStart <= pins[i].nStart + pins[i].nBlocks)
+		{
+			if(nStart + nBlocks > pins[i].nStart + pins[i].nBlocks)
+			{
+				pins[i].nBlocks = nStart + nBlocks - pins[i].nStart;
+			}
+			return 0;
+		}
+	}
+	if(nPins == nPinsAlloc)
+	{
+		grown = realloc(pins, (nPinsAlloc ? nPinsAlloc*2 : 16)*sizeof(struct cs1550_pin));
+		if(grown == NULL)
+		{
+			return -ENOMEM;
+		}
+		pins = grown;
+		nPinsAlloc = nPinsAlloc ? nPinsAlloc*2 : 16;
+	}
+	pins[nPins].nStart = nStart;
+	pins[nPins].nBlocks = nBlocks;
+	pins[nPins].owner = owner;
+	pins[nPins].thread = self;
+	nPins++;
+	return 0;
+}
+
+//function to tell whether an open file pins any of count blocks from
+//blockNum. Called with pinLock held
+static int pin_held(long blockNum, long count){
+
+	long i;
+
+	for(i = 0; i < nPins; i++)
+	{
+		if(pins[i].owner != NULL && pins[i].nStart < blockNum + count && blockNum < pins[i].nStart + pins[i].nBlocks)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//function to clear the bits of count blocks from blockNum that nothing
+//points at any more, with one pass over the bitmap and one change recorded
+//for the lot. If reserved isn't NULL, the blocks go back into that
+//reservation too, in the same step, so nothing else can take them
+static void free_bits(long blockNum, long count, long *reserved){
+
+	long i, freed = 0;
+	int held;
+
+	for(i = 0; i < count; i++)
+	{
+		cache_drop(blockNum + i);
+	}
+	pthread_mutex_lock(&allocLock);
+	//libfuse may still be reading some of them for an open file. If there's
+	//no memory to remember them they stay allocated for good, which is
+	//better than handing them to another file
+	pthread_mutex_lock(&pinLock);
+	held = pin_held(blockNum, count);
+	if(held)
+	{
+		pin_add(NULL, blockNum, count);
+	}
+	pthread_mutex_unlock(&pinLock);
+	if(held)
+	{
+		pthread_mutex_unlock(&allocLock);
+		return;
+	}
+	for(i = blockNum; i < blockNum + count; i++)
+	{
+		if(allocBits[i / 64] & (1ULL << (i % 64)))
+		{
+			allocBits[i / 64] &= ~(1ULL << (i % 64));
+			freed++;
+		}
+	}
+	if(freed > 0)
+	{
+		header->nFreeBlocks += freed;
+		bitmap_put(blockNum, count);
+		header_put();
+		STAT_ADD(statBlocksFreed, freed);
+	}
+	if(reserved != NULL)
+	{
+		*reserved += freed;
+		allocReserved += freed;
+	}
+	pthread_mutex_unlock(&allocLock);
+}
+
+//function to give a block back to the allocator
+static void free_block(long blockNum){
+
+	if(allocBits == NULL || blockNum < header->nFirstDataBlock || blockNum >= header->nBlocks)
+	{
+		return;
+	}
+	//a block other extents still point at only loses a reference
+	if(dedup_unref(blockNum))
+	{
+		return;
+	}
+	//whatever was cached for it is garbage now, and mustn't be written back over the next owner
+	free_bits(blockNum, 1, NULL);
+}
+
+//function to give count blocks from blockNum back to the allocator at once
+static void free_run(long blockNum, long count){
+
+	long i, next;
+
+	if(allocBits == NULL || count <= 0)
+	{
+		return;
+	}
+	if(blockNum < header->nFirstDataBlock)
+	{
+		count -= header->nFirstDataBlock - blockNum;
+		blockNum = header->nFirstDataBlock;
+	}
+	if(blockNum + count > header->nBlocks)
+	{
+		count = header->nBlocks - blockNum;
+	}
+	if(STAT_GET(dedupEntries) == 0)
+	{
+		free_bits(blockNum, count, NULL);
+		return;
+	}
+	//blocks other extents still point at only lose a reference, and the
+	//pieces between them are freed
+	for(i = blockNum; i < blockNum + count; i = next + 1)
+	{
+		for(next = i; next < blockNum + count && !dedup_unref(next); next++)
+		{
+		}
+		if(next > i)
+		{
+			free_bits(i, next - i, NULL);
+		}
+	}
+}
+
+//function to give back count fresh blocks from blockNum that alloc_run took
+//out of the reservation *reserved, which gets them back
+static void free_run_reserved(long blockNum, long count, long *reserved){
+
+	if(allocBits == NULL || count <= 0)
+	{
+		return;
+	}
+	free_bits(blockNum, count, reserved);
+}
+
+//function to find a stored block holding the same bytes as the block of
+//data, whose dedup_hash is hash, and take a reference to it for an extent
+//that's going to point at it
+//returns the block, or 0 if there's none
+static long dedup_find(const char *data, uint64_t hash){
+
+	struct cs1550_dedup *e;
+	char *stored;
+	long tried[DEDUP_TRIES], nTried = 0, found = 0, i;
+
+	STAT_ADD(statDedupLookups, 1);
+	if(STAT_GET(dedupEntries) == 0)
+	{
+		return 0;
+	}
+	stored = malloc(blockSize);
+	if(stored == NULL)
+	{
+		return 0;
+	}
+	while(found == 0 && nTried < DEDUP_TRIES)
+	{
+		//take a reference to the next block with the same hash first. A
+		//shared block is never written in place, so it holds still while
+		//it's read with the lock let go
+		pthread_mutex_lock(&dedupLock);
+		for(e = dedupBuckets ? dedupByHash[hash % dedupBuckets] : NULL; e != NULL; e = e->hashNext)
+		{
+			for(i = 0; i < nTried && tried[i] != e->nBlock; i++)
+			{
+			}
+			if(e->nHash == hash && i == nTried)
+			{
+				break;
+			}
+		}
+		if(e != NULL)
+		{
+			if(e->nRefs++ == 1)
+			{
+				dedupShared++;
+			}
+			tried[nTried++] = e->nBlock;
+		}
+		pthread_mutex_unlock(&dedupLock);
+		if(e == NULL)
+		{
+			break;
+		}
+
+		//the hash only narrows it down
+		if(cache_pread(stored, blockSize, (off_t)tried[nTried - 1]*blockSize) == 0 && memcmp(stored, data, blockSize) == 0)
+		{
+			found = tried[nTried - 1];
+		}
+		else
+		{
+			//let go of the reference, which frees the block if everything
+			//else let go of it meanwhile
+			free_block(tried[nTried - 1]);
+		}
+	}
+	free(stored);
+	if(found == 0)
+	{
+		return 0;
+	}
+	STAT_ADD(statDedupHits, 1);
+
+	//from here on the image has shared blocks, which older programs mustn't free
+	pthread_mutex_lock(&allocLock);
+	if(header->nVersion < CS1550_VERSION_SHARED)
+	{
+		header->nVersion = CS1550_VERSION_SHARED;
+		header_put();
+	}
+	pthread_mutex_unlock(&allocLock);
+	return found;
+}
+
+//function to get a directory block
+static cs1550_directory_entry *load_dirEntry(long blockNum){
+	return meta_get(blockNum, 1);
+}
+//function to record a change to a directory block, or place a new one
+static void write_dirEntry(struct cs1550_directory_entry *dirEntry, long blockNum){
+
+	meta_put(blockNum, 1, dirEntry);
+}
+//function to read from a block on disk
+static cs1550_disk_block read_block(long blockNum){
+
+	cs1550_disk_block block;
+
+	if(cache_pread(&block, BLOCK_SIZE, (off_t)blockNum*blockSize) != 0)
+	{
+		memset(&block, 0, BLOCK_SIZE);
+	}
+	return block;
+}
+//function to look at a data block without copying it when the image is mapped
+static const cs1550_disk_block *block_view(long blockNum, cs1550_disk_block *copy){
+
+	const cs1550_disk_block *block = disk_block_ptr(blockNum);
+
+	if(block == NULL)
+	{
+		*copy = read_block(blockNum);
+		block = copy;
+	}
+	return block;
+}
+
+//function to get an inode, which stays resident like the other metadata
+static cs1550_inode *load_inode(long blockNum){
+	return meta_get(blockNum, 1);
+}
+
+//function to record a change to an inode, or place a new one
+static void write_inode(struct cs1550_inode *inode, long blockNum){
+
+	meta_put(blockNum, 1, inode);
+}
+
+//function to tell whether a file's start block is an inode or the first
+//block of a version 1 chain
+static int is_inode(long blockNum){
+
+	struct cs1550_meta_block *mb;
+	long magic;
+
+	pthread_mutex_lock(&metaLock);
+	mb = meta_lookup(blockNum);
+	pthread_mutex_unlock(&metaLock);
+	//only inodes (never chain blocks) are held in the metadata cache
+	if(mb != NULL)
+	{
+		return 1;
+	}
+	if(disk_pread(&magic, sizeof(long), (off_t)blockNum*blockSize) != 0)
+	{
+		return -EIO;
+	}
+	return magic == INODE_MAGIC;
+}
+
+//function to make an empty inode with nFlags for a new file
+//returns the inode's block number or a negative error
+static long inode_create(int nFlags){
+
+	struct cs1550_inode *inode;
+	long blockNum = alloc_block();
+
+	if(blockNum < 0)
+	{
+		return blockNum;
+	}
+	inode = meta_new(blockNum);
+	if(inode == NULL)
+	{
+		free_block(blockNum);
+		return -ENOMEM;
+	}
+	inode->nMagic = INODE_MAGIC;
+	inode->nFlags = nFlags;
+	write_inode(inode, blockNum);
+	return blockNum;
+}
+
+//function to get how many blocks a compressed extent's data takes on disk
+//returns 0 for one that isn't compressed
+static long extent_stored(const struct cs1550_extent *ext){
+	return (ext->nFlags & EXTENT_COMPRESSED) ? ext->nFlags >> EXTENT_STORED_SHIFT : 0;
+}
+
+//function to add nBlocks disk blocks from blockNum to a file as blocks
+//`logical` on, which must come after every block the file already has. Grows
+//the last extent when they are next to it on disk, and chains on another
+//inode when full. nFlags is for the new extent: a compressed one is never
+//merged with another
+static int inode_append(long inodeBlock, long logical, long blockNum, long nBlocks, int nFlags){
+
+	struct cs1550_inode *inode;
+	struct cs1550_extent *ext;
+	long next;
+
+	inode = load_inode(inodeBlock);
+	while(inode != NULL && inode->nNextInode != 0)
+	{
+		inodeBlock = inode->nNextInode;
+		inode = load_inode(inodeBlock);
+	}
+	if(inode == NULL)
+	{
+		return -EIO;
+	}
+
+	if(inode->nExtents > 0 && nFlags == 0)
+	{
+		ext = &inode->extents[inode->nExtents - 1];
+		if(ext->nFlags == 0 && ext->nLogical + ext->nBlocks == logical && ext->nStartBlock + ext->nBlocks == blockNum)
+		{
+			ext->nBlocks += nBlocks;
+			write_inode(inode, inodeBlock);
+			return 0;
+		}
+	}
+
+	if(inode->nExtents == (int)MAX_EXTENTS_IN_INODE)
+	{
+		//this inode is full, chain on another one
+		next = inode_create(0);
+		if(next < 0)
+		{
+			return next;
+		}
+		inode->nNextInode = next;
+		write_inode(inode, inodeBlock);
+		inodeBlock = next;
+		inode = load_inode(inodeBlock);
+		if(inode == NULL)
+		{
+			return -EIO;
+		}
+	}
+
+	ext = &inode->extents[inode->nExtents];
+	ext->nLogical = logical;
+	ext->nStartBlock = blockNum;
+	ext->nBlocks = nBlocks;
+	ext->nFlags = nFlags;
+	inode->nExtents++;
+	write_inode(inode, inodeBlock);
+	return 0;
+}
+
+//function to add nBlocks disk blocks from blockNum to a file as blocks
+//`logical` on, where the file has none. Blocks past every one the file has go
+//through inode_append. Ones filling a hole go in order into the inode whose
+//extents they fall among, which is split in two first if it's full
+static int inode_insert(long inodeBlock, long logical, long blockNum, long nBlocks){
+
+	struct cs1550_inode *inode, *next;
+	struct cs1550_extent *ext;
+	long split;
+	int k, half;
+
+	//find the last inode whose extents start at or before logical
+	inode = load_inode(inodeBlock);
+	while(inode != NULL && inode->nNextInode != 0)
+	{
+		next = load_inode(inode->nNextInode);
+		if(next == NULL)
+		{
+			return -EIO;
+		}
+		if(next->nExtents == 0 || next->extents[0].nLogical > logical)
+		{
+			break;
+		}
+		inodeBlock = inode->nNextInode;
+		inode = next;
+	}
+	if(inode == NULL)
+	{
+		return -EIO;
+	}
+	if(inode->nNextInode == 0 && (inode->nExtents == 0 ||
+		inode->extents[inode->nExtents - 1].nLogical + inode->extents[inode->nExtents - 1].nBlocks <= logical))
+	{
+		return inode_append(inodeBlock, logical, blockNum, nBlocks, 0);
+	}
+
+	for(k = inode->nExtents; k > 0 && inode->extents[k - 1].nLogical > logical; k--)
+	{
+	}
+	if(k > 0)
+	{
+		ext = &inode->extents[k - 1];
+		if(ext->nFlags == 0 && ext->nLogical + ext->nBlocks == logical && ext->nStartBlock + ext->nBlocks == blockNum)
+		{
+			ext->nBlocks += nBlocks;
+			write_inode(inode, inodeBlock);
+			return 0;
+		}
+	}
+
+	if(inode->nExtents == (int)MAX_EXTENTS_IN_INODE)
+	{
+		//full: the top half moves to a new inode chained in after this one
+		split = inode_create(0);
+		if(split < 0)
+		{
+			return split;
+		}
+		next = load_inode(split);
+		if(next == NULL)
+		{
+			return -EIO;
+		}
+		half = inode->nExtents / 2;
+		memcpy(next->extents, &inode->extents[half], (inode->nExtents - half)*sizeof(struct cs1550_extent));
+		next->nExtents = inode->nExtents - half;
+		next->nNextInode = inode->nNextInode;
+		inode->nExtents = half;
+		inode->nNextInode = split;
+		write_inode(next, split);
+		write_inode(inode, inodeBlock);
+		if(k > half)
+		{
+			k -= half;
+			inode = next;
+			inodeBlock = split;
+		}
+	}
+
+	memmove(&inode->extents[k + 1], &inode->extents[k], (inode->nExtents - k)*sizeof(struct cs1550_extent));
+	ext = &inode->extents[k];
+	ext->nLogical = logical;
+	ext->nStartBlock = blockNum;
+	ext->nBlocks = nBlocks;
+	ext->nFlags = 0;
+	inode->nExtents++;
+	write_inode(inode, inodeBlock);
+	return 0;
+}
+
+//The first time a file is read or written, where each of its blocks lives is
+//worked out once (by following a version 1 chain or reading every inode in
+//the chain) and kept in memory as a sorted list of runs, so later calls can
+//find any block with a binary search and no disk reads. Writes that grow a
+//file add to its list. The lists sit on an LRU list and the least recently
+//used are thrown away whenever they hold more than -o index_runs in total.
+struct cs1550_run
+{
+	long nLogical;		//first file block in the run
+	long nStartBlock;	//where it is on disk
+	long nBlocks;		//how many blocks are consecutive on disk
+	long nStored;		//compressed: how many blocks the data takes from nStartBlock, 0 if it isn't
+};
+
+struct cs1550_block_index
+{
+	long nStartBlock;	//the file's start block (its inode, or the head of its chain)
+	int legacy;			//version 1 chain: data starts after the nNextBlock link
+	int inlined;		//INODE_INLINE: data is in the inode, and there are no runs
+	long nRuns;			//runs in use
+	long nAlloc;		//runs allocated
+	struct cs1550_run *runs;
+	off_t nNextRead;	//where a sequential reader would read next
+	long nWindow;		//blocks to read ahead, grows while the file is read in order
+	long nReadAhead;	//first file block not yet read ahead
+	int nUsers;			//handlers using it right now, which keeps it from being thrown away
+	int dead;			//dropped while in use: freed when the last user is done
+	int building;		//being read in by index_get, which others wait for
+	struct cs1550_block_index *hashNext;
+	struct cs1550_block_index *lruPrev, *lruNext;
+};
+
+#define INDEX_BUCKETS 128
+static struct cs1550_block_index *indexHash[INDEX_BUCKETS];
+static struct cs1550_block_index *indexLruHead = NULL, *indexLruTail = NULL;
+static long indexRuns = 0;
+//guards the hash and LRU lists, the run count and the read ahead state. The
+//runs themselves change only under the file's write lock
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+//signalled whenever an index has been read in, or failed to be
+static pthread_cond_t indexBuilt = PTHREAD_COND_INITIALIZER;
+
+//function to add a run to an index in order of file block, merging it into
+//the run before it when it continues that one. Runs nearly always go on the
+//end; one that fills a hole in a sparse file goes in among the others.
+//nStored is how many blocks a compressed run takes, 0 for one that isn't
+static int index_add_run(struct cs1550_block_index *idx, long logical, long blockNum, long nBlocks, long nStored){
+
+	struct cs1550_run *prev, *grown;
+	long at = idx->nRuns;
+
+	while(at > 0 && idx->runs[at - 1].nLogical > logical)
+	{
+		at--;
+	}
+	prev = at > 0 ? &idx->runs[at - 1] : NULL;
+	if(prev != NULL && prev->nStored == 0 && nStored == 0 &&
+		prev->nLogical + prev->nBlocks == logical && prev->nStartBlock + prev->nBlocks == blockNum)
+	{
+		prev->nBlocks += nBlocks;
+		return 0;
+	}
+	if(idx->nRuns == idx->nAlloc)
+	{
+		grown = realloc(idx->runs, (idx->nAlloc ? idx->nAlloc*2 : 8) * sizeof(struct cs1550_run));
+		if(grown == NULL)
+		{
+			return -ENOMEM;
+		}
+		idx->runs = grown;
+		idx->nAlloc = idx->nAlloc ? idx->nAlloc*2 : 8;
+	}
+	memmove(&idx->runs[at + 1], &idx->runs[at], (idx->nRuns - at)*sizeof(struct cs1550_run));
+	idx->runs[at].nLogical = logical;
+	idx->runs[at].nStartBlock = blockNum;
+	idx->runs[at].nBlocks = nBlocks;
+	idx->runs[at].nStored = nStored;
+	idx->nRuns++;
+	//one being built is counted all at once when it's done
+	if(!idx->dead && !idx->building)
+	{
+		indexRuns++;
+	}
+	return 0;
+}
+
+//function to fill in a new index from the file's chain or inodes
+static int index_build(struct cs1550_block_index *idx){
+
+	struct cs1550_inode *inode;
+	long inodeBlock, currBlock, logical = 0;
+	int k, res;
+
+	res = is_inode(idx->nStartBlock);
+	if(res < 0)
+	{
+		return res;
+	}
+	idx->legacy = !res;
+
+	if(idx->legacy)
+	{
+		//one small read per link, once. The chain can't be longer than the disk
+		currBlock = idx->nStartBlock;
+		while(currBlock != 0 && logical < MAX_BLOCKS)
+		{
+			res = index_add_run(idx, logical++, currBlock, 1, 0);
+			if(res == 0)
+			{
+				res = disk_pread(&currBlock, sizeof(long), (off_t)currBlock*blockSize);
+			}
+			if(res != 0)
+			{
+				return res;
+			}
+		}
+		return 0;
+	}
+
+	for(inodeBlock = idx->nStartBlock; inodeBlock != 0; inodeBlock = inode->nNextInode)
+	{
+		inode = load_inode(inodeBlock);
+		if(inode == NULL)
+		{
+			return -EIO;
+		}
+		//an inline file's bytes are where its extents would be
+		if(inode->nFlags & INODE_INLINE)
+		{
+			idx->inlined = 1;
+			return 0;
+		}
+		for(k = 0; k < inode->nExtents; k++)
+		{
+			res = index_add_run(idx, inode->extents[k].nLogical, inode->extents[k].nStartBlock, inode->extents[k].nBlocks,
+				extent_stored(&inode->extents[k]));
+			if(res != 0)
+			{
+				return res;
+			}
+		}
+	}
+	return 0;
+}
+
+//function to take an index off the hash and LRU lists
+static void index_unlink(struct cs1550_block_index *idx){
+
+	struct cs1550_block_index **link = &indexHash[idx->nStartBlock % INDEX_BUCKETS];
+
+	while(*link != idx)
+	{
+		link = &(*link)->hashNext;
+	}
+	*link = idx->hashNext;
+
+	if(idx->lruPrev != NULL)
+	{
+		idx->lruPrev->lruNext = idx->lruNext;
+	}
+	else
+	{
+		indexLruHead = idx->lruNext;
+	}
+	if(idx->lruNext != NULL)
+	{
+		idx->lruNext->lruPrev = idx->lruPrev;
+	}
+	else
+	{
+		indexLruTail = idx->lruPrev;
+	}
+	if(!idx->building)
+	{
+		indexRuns -= idx->nRuns;
+	}
+}
+
+//function to take an index off the lists and free it
+static void index_free(struct cs1550_block_index *idx){
+
+	index_unlink(idx);
+	free(idx->runs);
+	free(idx);
+}
+
+//function to find a file's index if it's in memory, without building it
+static struct cs1550_block_index *index_find(long nStartBlock){
+
+	struct cs1550_block_index *idx;
+
+	for(idx = indexHash[nStartBlock % INDEX_BUCKETS]; idx != NULL; idx = idx->hashNext)
+	{
+		if(idx->nStartBlock == nStartBlock)
+		{
+			break;
+		}
+	}
+	return idx;
+}
+
+//function to get the index for a file, building it on first use
+//returns NULL if it can't be built. Hand it back with index_put when done
+static struct cs1550_block_index *index_get(long nStartBlock){
+
+	struct cs1550_block_index *idx, *victim, *prev;
+	int res;
+
+	pthread_mutex_lock(&indexLock);
+	for(;;)
+	{
+		idx = index_find(nStartBlock);
+		if(idx != NULL && idx->building)
+		{
+			//another handler is reading it in, so wait for that and look again
+			pthread_cond_wait(&indexBuilt, &indexLock);
+			continue;
+		}
+		if(idx != NULL)
+		{
+			break;
+		}
+
+		//put a placeholder in first, so the file is only read in once
+		idx = calloc(1, sizeof(struct cs1550_block_index));
+		if(idx == NULL)
+		{
+			pthread_mutex_unlock(&indexLock);
+			return NULL;
+		}
+		idx->nStartBlock = nStartBlock;
+		idx->building = 1;
+		idx->nUsers = 1;
+		idx->hashNext = indexHash[nStartBlock % INDEX_BUCKETS];
+		indexHash[nStartBlock % INDEX_BUCKETS] = idx;
+		idx->lruNext = indexLruHead;
+		if(indexLruHead != NULL)
+		{
+			indexLruHead->lruPrev = idx;
+		}
+		indexLruHead = idx;
+		if(indexLruTail == NULL)
+		{
+			indexLruTail = idx;
+		}
+
+		//the reads go to disk, so they're done without the lock, which
+		//would hold up every other file's index
+		pthread_mutex_unlock(&indexLock);
+		res = index_build(idx);
+		pthread_mutex_lock(&indexLock);
+
+		idx->building = 0;
+		pthread_cond_broadcast(&indexBuilt);
+		idx->nUsers--;
+		if(!idx->dead)
+		{
+			indexRuns += idx->nRuns;
+			if(res == 0)
+			{
+				break;
+			}
+			index_free(idx);
+		}
+		else
+		{
+			free(idx->runs);
+			free(idx);
+		}
+		if(res != 0)
+		{
+			pthread_mutex_unlock(&indexLock);
+			return NULL;
+		}
+		//dropped while it was read, so the file changed under it: start over
+	}
+
+	if(idx != indexLruHead)
+	{
+		//move it to the front of the LRU list
+		idx->lruPrev->lruNext = idx->lruNext;
+		if(idx->lruNext != NULL)
+		{
+			idx->lruNext->lruPrev = idx->lruPrev;
+		}
+		else
+		{
+			indexLruTail = idx->lruPrev;
+		}
+		idx->lruPrev = NULL;
+		idx->lruNext = indexLruHead;
+		indexLruHead->lruPrev = idx;
+		indexLruHead = idx;
+	}
+
+	idx->nUsers++;
+
+	//over budget: drop the least recently used, but none that are in use
+	for(victim = indexLruTail; victim != NULL && indexRuns > options.indexRuns; victim = prev)
+	{
+		prev = victim->lruPrev;
+		if(victim->nUsers == 0)
+		{
+			index_free(victim);
+		}
+	}
+	pthread_mutex_unlock(&indexLock);
+	return idx;
+}
+
+//function to hand back an index from index_get
+static void index_put(struct cs1550_block_index *idx){
+
+	pthread_mutex_lock(&indexLock);
+	idx->nUsers--;
+	if(idx->dead && idx->nUsers == 0)
+	{
+		free(idx->runs);
+		free(idx);
+	}
+	pthread_mutex_unlock(&indexLock);
+}
+
+//function to forget a file's index, for when its blocks change under it
+static void index_drop(long nStartBlock){
+
+	struct cs1550_block_index *idx;
+
+	pthread_mutex_lock(&indexLock);
+	idx = index_find(nStartBlock);
+	if(idx != NULL && idx->nUsers > 0)
+	{
+		//the next index_get builds a new one, and this goes when its users are done
+		index_unlink(idx);
+		idx->dead = 1;
+	}
+	else if(idx != NULL)
+	{
+		index_free(idx);
+	}
+	pthread_mutex_unlock(&indexLock);
+}
+
+//function to drop every index (at unmount)
+static void index_drop_all(){
+
+	while(indexLruHead != NULL)
+	{
+		index_free(indexLruHead);
+	}
+}
+
+//function to find the run holding block `logical` of a file
+//returns NULL if the file has no such block
+static struct cs1550_run *index_run(struct cs1550_block_index *idx, long logical){
+
+	long lo = 0, hi = idx->nRuns - 1, mid;
+	struct cs1550_run *r;
+
+	if(idx->nRuns == 0)
+	{
+		return NULL;
+	}
+	//binary search for the last run starting at or before logical
+	while(lo < hi)
+	{
+		mid = (lo + hi + 1) / 2;
+		if(idx->runs[mid].nLogical <= logical)
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+	r = &idx->runs[lo];
+	if(logical < r->nLogical || logical >= r->nLogical + r->nBlocks)
+	{
+		return NULL;
+	}
+	return r;
+}
+
+//function to find where block `logical` of a file lives on disk
+//returns the disk block (0 if the file has no such block) and sets *run to
+//how many blocks from there on are consecutive on disk, so callers can move
+//a whole run with one read or write. A compressed run's blocks aren't where
+//this says, so callers that go on to the data check index_compressed first
+static long index_map(struct cs1550_block_index *idx, long logical, long *run){
+
+	struct cs1550_run *r = index_run(idx, logical);
+
+	if(r == NULL)
+	{
+		return 0;
+	}
+	*run = r->nLogical + r->nBlocks - logical;
+	return r->nStartBlock + (logical - r->nLogical);
+}
+
+//function to tell whether block `logical` of a file is in a compressed run,
+//copying the run to *r if it is
+static int index_compressed(struct cs1550_block_index *idx, long logical, struct cs1550_run *r){
+
+	struct cs1550_run *found = index_run(idx, logical);
+
+	if(found == NULL || found->nStored == 0)
+	{
+		return 0;
+	}
+	*r = *found;
+	return 1;
+}
+
+//function to find the first block at or after `logical` that a file has on
+//disk, for skipping over a hole
+//returns the block, or -1 if the file has none past logical
+static long index_next(struct cs1550_block_index *idx, long logical){
+
+	long lo = 0, hi = idx->nRuns;
+	long mid;
+
+	//binary search for the first run that ends past logical
+	while(lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if(idx->runs[mid].nLogical + idx->runs[mid].nBlocks <= logical)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if(lo == idx->nRuns)
+	{
+		return -1;
+	}
+	return idx->runs[lo].nLogical > logical ? idx->runs[lo].nLogical : logical;
+}
+
+//function to get the block after the last one a file has on disk
+static long index_end(struct cs1550_block_index *idx){
+	return idx->nRuns > 0 ? idx->runs[idx->nRuns - 1].nLogical + idx->runs[idx->nRuns - 1].nBlocks : 0;
+}
+
+//With -o compress, appended data is given its blocks COMPRESS_CLUSTER blocks
+//at a time, and each such cluster is stored compressed when that saves at
+//least a block (see cs1550.h). The codec is LZ4's block format: a run of
+//sequences, each a token byte whose top four bits are how many literal bytes
+//follow it and bottom four how much longer than LZ_MIN_MATCH the match after
+//them is, either going on in extra bytes when it's 15 (adding up each byte up
+//to the first that isn't 255), then the literals, then the match's distance
+//back into what's been output so far as two little endian bytes. The last
+//sequence has only literals, and the end of the block keeps to LZ4's rules
+//below, so any LZ4 decoder can read it. Reading a compressed run
+//decompresses all of it and keeps its blocks in the block cache, under
+//numbers past the end of the image, so the rest of it is found there.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_DISTANCE 65535
+//LZ4's end of block rules: the last bytes are always literals, and the
+//last match starts at least LZ_MATCH_LIMIT bytes before the end, so
+//nothing shorter than that has a match at all
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+//function to read four bytes from anywhere
+static uint32_t lz_read32(const unsigned char *p){
+
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+//function to hash the four bytes at p into the compressor's table
+static uint32_t lz_hash(const unsigned char *p){
+	return (lz_read32(p) * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+//function to write what's left of a length after the token's four bits
+static unsigned char *lz_put_length(unsigned char *op, size_t n){
+
+	while(n >= 255)
+	{
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = n;
+	return op;
+}
+
+//function to read what's left of a length after the token's four bits,
+//adding it to *n
+//returns 0, or -EIO if it runs off the end of the input
+static int lz_get_length(const unsigned char **ip, const unsigned char *end, size_t *n){
+
+	unsigned char b;
+
+	do
+	{
+		if(*ip >= end)
+		{
+			return -EIO;
+		}
+		b = *(*ip)++;
+		*n += b;
+	} while(b == 255);
+	return 0;
+}
+
+//function to write a sequence of nLit literals from lit followed by a match
+//of mlen bytes dist back (no match if mlen is 0) at op
+//returns where the sequence ends, or NULL if it doesn't fit before end
+static unsigned char *lz_sequence(unsigned char *op, unsigned char *end, const unsigned char *lit, size_t nLit, size_t dist, size_t mlen){
+
+	unsigned char *token;
+
+	//the most it can take: the token, the lengths, the literals and the distance
+	if((size_t)(end - op) < 1 + nLit/255 + 1 + nLit + 2 + mlen/255 + 1)
+	{
+		return NULL;
+	}
+	token = op++;
+	*token = (nLit < 15 ? nLit : 15) << 4;
+	if(nLit >= 15)
+	{
+		op = lz_put_length(op, nLit - 15);
+	}
+	memcpy(op, lit, nLit);
+	op += nLit;
+	if(mlen > 0)
+	{
+		*op++ = dist & 0xff;
+		*op++ = dist >> 8;
+		mlen -= LZ_MIN_MATCH;
+		*token |= mlen < 15 ? mlen : 15;
+		if(mlen >= 15)
+		{
+			op = lz_put_length(op, mlen - 15);
+		}
+	}
+	return op;
+}
+
+//function to compress len bytes of src into dst, which has room for cap bytes
+//returns the compressed size, or 0 if it doesn't fit
+static size_t lz_compress(const char *src, size_t len, char *dst, size_t cap){
+
+	const unsigned char *in = (const unsigned char *)src, *ip = in, *anchor = in, *match;
+	const unsigned char *limit = in + (len > LZ_LAST_LITERALS ? len - LZ_LAST_LITERALS : 0);
+	const unsigned char *lastMatch = in + (len > LZ_MATCH_LIMIT ? len - LZ_MATCH_LIMIT : 0);
+	unsigned char *op = (unsigned char *)dst, *end = op + cap;
+	uint32_t table[1 << LZ_HASH_BITS];
+	uint32_t h;
+	size_t mlen;
+
+	//every slot starts out pointing at the first byte, which is always
+	//checked before it's used
+	memset(table, 0, sizeof(table));
+	while(len > LZ_MATCH_LIMIT && ip <= lastMatch)
+	{
+		h = lz_hash(ip);
+		match = in + table[h];
+		table[h] = ip - in;
+		if(match >= ip || ip - match > LZ_MAX_DISTANCE || lz_read32(match) != lz_read32(ip))
+		{
+			//the longer it goes without a match the faster it skips ahead
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+		mlen = LZ_MIN_MATCH;
+		while(ip + mlen < limit && match[mlen] == ip[mlen])
+		{
+			mlen++;
+		}
+		op = lz_sequence(op, end, anchor, ip - anchor, ip - match, mlen);
+		if(op == NULL)
+		{
+			return 0;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+	op = lz_sequence(op, end, anchor, in + len - anchor, 0, 0);
+	if(op == NULL)
+	{
+		return 0;
+	}
+	return op - (unsigned char *)dst;
+}
+
+//function to decompress src (srcLen bytes, which may be followed by
+//padding) into dst, stopping once it has dstLen bytes
+//returns 0, or -EIO if src isn't something lz_compress could have made
+static int lz_decompress(const char *src, size_t srcLen, char *dst, size_t dstLen){
+
+	const unsigned char *ip = (const unsigned char *)src, *end = ip + srcLen;
+	unsigned char *op = (unsigned char *)dst, *oend = op + dstLen;
+	unsigned char token;
+	size_t n, dist, i;
+
+	while(op < oend)
+	{
+		if(ip >= end)
+		{
+			return -EIO;
+		}
+		token = *ip++;
+		n = token >> 4;
+		if(n == 15 && lz_get_length(&ip, end, &n) != 0)
+		{
+			return -EIO;
+		}
+		if(n > (size_t)(end - ip))
+		{
+			return -EIO;
+		}
+		if(n > (size_t)(oend - op))
+		{
+			n = oend - op;
+		}
+		memcpy(op, ip, n);
+		op += n;
+		ip += n;
+		if(op == oend)
+		{
+			break;
+		}
+
+		if(end - ip < 2)
+		{
+			return -EIO;
+		}
+		dist = ip[0] | ip[1] << 8;
+		ip += 2;
+		if(dist == 0 || dist > (size_t)(op - (unsigned char *)dst))
+		{
+			return -EIO;
+		}
+		n = token & 15;
+		if(n == 15 && lz_get_length(&ip, end, &n) != 0)
+		{
+			return -EIO;
+		}
+		n += LZ_MIN_MATCH;
+		if(n > (size_t)(oend - op))
+		{
+			n = oend - op;
+		}
+		//a match that runs on into what it's making goes a byte at a time
+		if(dist >= n)
+		{
+			memcpy(op, op - dist, n);
+		}
+		else
+		{
+			for(i = 0; i < n; i++)
+			{
+				op[i] = op[i - dist];
+			}
+		}
+		op += n;
+	}
+	return 0;
+}
+
+//function to get the number block b of the compressed run stored at
+//nStartBlock is cached under
+static long compress_key(long nStartBlock, long b){
+	return header->nBlocks + nStartBlock*COMPRESS_CLUSTER + b;
+}
+
+//function to throw away the cached blocks of the compressed run stored at
+//nStartBlock, for when its blocks are freed
+static void compress_forget(long nStartBlock){
+
+	long b;
+
+	for(b = 0; b < COMPRESS_CLUSTER; b++)
+	{
+		cache_drop(compress_key(nStartBlock, b));
+	}
+}
+
+//function to give back the blocks an extent holds
+static void extent_free(const struct cs1550_extent *ext){
+
+	long stored = extent_stored(ext);
+
+	if(stored > 0)
+	{
+		compress_forget(ext->nStartBlock);
+		free_run(ext->nStartBlock, stored);
+		return;
+	}
+	free_run(ext->nStartBlock, ext->nBlocks);
+}
+
+//function to store nBlocks blocks of data appended to a file (as its blocks
+//`logical` on) compressed, if that takes fewer blocks. *start and *stored
+//are set to where it went and how many blocks it took, which come out of the
+//reservation *reserved first
+//returns 0 (with *stored still 0 if it should go out as it is), or -errno
+static int compress_append(long inodeBlock, long logical, const char *data, long nBlocks, long *start, long *stored, long *reserved){
+
+	size_t len = (size_t)nBlocks*blockSize, packedLen;
+	unsigned long begin;
+	char *packed;
+	long need, got;
+	int res;
+
+	*stored = 0;
+	if(nBlocks < 2 || nBlocks > COMPRESS_CLUSTER)
+	{
+		return 0;
+	}
+	//it's only worth it if it saves a block
+	packed = malloc(len - blockSize);
+	if(packed == NULL)
+	{
+		return -ENOMEM;
+	}
+	begin = stats_clock();
+	packedLen = lz_compress(data, len, packed, len - blockSize);
+	STAT_ADD(statCompressUs, stats_clock() - begin);
+	STAT_ADD(statCompressIn, len);
+	if(packedLen == 0)
+	{
+		STAT_ADD(statCompressOut, len);
+		free(packed);
+		return 0;
+	}
+	need = (packedLen + blockSize - 1) / blockSize;
+	memset(packed + packedLen, 0, need*blockSize - packedLen);
+
+	//the compressed data has to be in one run, or it goes out as it is
+	*start = alloc_run(need, &got, reserved);
+	if(*start < 0)
+	{
+		free(packed);
+		return *start;
+	}
+	if(got < need)
+	{
+		free_run_reserved(*start, got, reserved);
+		STAT_ADD(statCompressOut, len);
+		free(packed);
+		return 0;
+	}
+	res = disk_pwrite(packed, got*blockSize, (off_t)*start*blockSize);
+	if(res == 0)
+	{
+		res = inode_append(inodeBlock, logical, *start, nBlocks, EXTENT_COMPRESSED | got << EXTENT_STORED_SHIFT);
+	}
+	free(packed);
+	if(res != 0)
+	{
+		free_run_reserved(*start, got, reserved);
+		return res;
+	}
+	STAT_ADD(statCompressOut, packedLen);
+	*stored = got;
+	return 0;
+}
+
+//function to read len bytes from `at` bytes into the data of the compressed
+//run r. The blocks come from the cache if they're all there; otherwise the
+//whole run is read and decompressed, and every block of it cached
+static int compress_read(const struct cs1550_run *r, char *buf, size_t len, size_t at){
+
+	struct cs1550_cache_block *cb;
+	size_t done = 0, within, n;
+	unsigned long begin;
+	char *packed, *plain;
+	long b;
+	int res;
+
+	if(r->nBlocks > COMPRESS_CLUSTER)
+	{
+		return -EIO;
+	}
+	if(cache_enabled())
+	{
+		pthread_mutex_lock(&cacheLock);
+		while(done < len)
+		{
+			b = (at + done) / blockSize;
+			within = (at + done) % blockSize;
+			n = blockSize - within;
+			if(n > len - done)
+			{
+				n = len - done;
+			}
+			cb = cache_find(compress_key(r->nStartBlock, b));
+			if(cb == NULL)
+			{
+				break;
+			}
+			cacheHits++;
+			cache_lru_unlink(cb);
+			cache_lru_push(cb);
+			memcpy(buf + done, cb->data + within, n);
+			done += n;
+		}
+		pthread_mutex_unlock(&cacheLock);
+		if(done == len)
+		{
+			return 0;
+		}
+	}
+
+	packed = malloc((size_t)r->nStored*blockSize);
+	plain = malloc((size_t)r->nBlocks*blockSize);
+	res = packed != NULL && plain != NULL ? disk_read_blocks(r->nStartBlock, r->nStored, packed) : -ENOMEM;
+	if(res == 0)
+	{
+		begin = stats_clock();
+		res = lz_decompress(packed, (size_t)r->nStored*blockSize, plain, (size_t)r->nBlocks*blockSize);
+		STAT_ADD(statDecompressUs, stats_clock() - begin);
+		STAT_ADD(statDecompressBytes, (size_t)r->nBlocks*blockSize);
+	}
+	if(res == 0)
+	{
+		memcpy(buf + done, plain + at + done, len - done);
+		if(cache_enabled())
+		{
+			pthread_mutex_lock(&cacheLock);
+			for(b = 0; b < r->nBlocks; b++)
+			{
+				//another reader may have brought it in meanwhile
+				if(cache_find(compress_key(r->nStartBlock, b)) != NULL)
+				{
+					continue;
+				}
+				cacheMisses++;
+				cb = cache_insert(compress_key(r->nStartBlock, b));
+				if(cb != NULL)
+				{
+					memcpy(cb->data, plain + b*blockSize, blockSize);
+				}
+			}
+			pthread_mutex_unlock(&cacheLock);
+		}
+	}
+	free(packed);
+	free(plain);
+	return res;
+}
+
+//function to store the compressed run block `logical` of a file is in as
+//plain blocks, for when it's about to be written to. The extent and the
+//index take the new blocks in its place before its own are given back
+//returns 0 (also if the block isn't compressed), or -errno
+static int compress_expand(struct cs1550_block_index *idx, long logical){
+
+	struct cs1550_run r, *found;
+	struct cs1550_inode *inode = NULL;
+	struct cs1550_extent *ext = NULL;
+	long starts[COMPRESS_CLUSTER], gots[COMPRESS_CLUSTER];
+	long inodeBlock, done = 0;
+	int k, n = 0, res;
+	char *plain;
+
+	if(!index_compressed(idx, logical, &r))
+	{
+		return 0;
+	}
+	plain = malloc((size_t)r.nBlocks*blockSize);
+	if(plain == NULL)
+	{
+		return -ENOMEM;
+	}
+	res = compress_read(&r, plain, (size_t)r.nBlocks*blockSize, 0);
+
+	//the extent it came from
+	for(inodeBlock = idx->nStartBlock; res == 0 && inodeBlock != 0; inodeBlock = inode->nNextInode)
+	{
+		inode = load_inode(inodeBlock);
+		if(inode == NULL)
+		{
+			res = -EIO;
+			break;
+		}
+		for(k = 0; k < inode->nExtents && inode->extents[k].nLogical != r.nLogical; k++)
+		{
+		}
+		if(k < inode->nExtents)
+		{
+			ext = &inode->extents[k];
+			break;
+		}
+	}
+	if(res == 0 && ext == NULL)
+	{
+		res = -EIO;
+	}
+
+	//all the new blocks are found and written before anything points at them
+	while(res == 0 && done < r.nBlocks)
+	{
+		starts[n] = alloc_run(r.nBlocks - done, &gots[n], NULL);
+		if(starts[n] < 0)
+		{
+			res = starts[n];
+			break;
+		}
+		res = disk_pwrite(plain + done*blockSize, (size_t)gots[n]*blockSize, (off_t)starts[n]*blockSize);
+		done += gots[n++];
+	}
+	free(plain);
+	if(res == 0 && n == 0)
+	{
+		//an empty run, which no compressed extent is
+		res = -EIO;
+	}
+	if(res != 0)
+	{
+		while(n-- > 0)
+		{
+			free_run(starts[n], gots[n]);
+		}
+		return res;
+	}
+
+	//the first run takes over the extent, the rest go in after it
+	ext->nStartBlock = starts[0];
+	ext->nBlocks = gots[0];
+	ext->nFlags = 0;
+	write_inode(inode, inodeBlock);
+	for(k = 1, done = gots[0]; k < n; done += gots[k++])
+	{
+		res = inode_insert(idx->nStartBlock, r.nLogical + done, starts[k], gots[k]);
+		if(res != 0)
+		{
+			//the file is left with a hole where these were to go
+			while(k < n)
+			{
+				free_run(starts[k], gots[k]);
+				k++;
+			}
+			break;
+		}
+	}
+	compress_forget(r.nStartBlock);
+	free_run(r.nStartBlock, r.nStored);
+
+	pthread_mutex_lock(&indexLock);
+	found = index_run(idx, logical);
+	if(found == NULL)
+	{
+		//the run went while indexLock was let go, so start the index over
+		pthread_mutex_unlock(&indexLock);
+		index_drop(idx->nStartBlock);
+		return res;
+	}
+	found->nStartBlock = starts[0];
+	found->nBlocks = gots[0];
+	found->nStored = 0;
+	for(k = 1, done = gots[0]; k < n && res == 0; done += gots[k++])
+	{
+		res = index_add_run(idx, r.nLogical + done, starts[k], gots[k], 0);
+	}
+	pthread_mutex_unlock(&indexLock);
+	if(res != 0)
+	{
+		//the index can't be trusted now, and the next index_get starts it over
+		index_drop(idx->nStartBlock);
+	}
+	return res;
+}
+
+//function to give block `logical` of a file, which it shares with other
+//files, a copy of its own to be written. The extent and the index run it's
+//in are split around it, and the file lets go of the shared block
+//returns 0, or -errno
+static int dedup_copy(struct cs1550_block_index *idx, long logical){
+
+	struct cs1550_inode *inode = NULL;
+	struct cs1550_extent *ext = NULL, old;
+	struct cs1550_run *found, r;
+	long inodeBlock, phys, copy, run, at;
+	char *data;
+	int k, res;
+
+	phys = index_map(idx, logical, &run);
+	if(phys <= 0)
+	{
+		return -EIO;
+	}
+	//the extent it's in
+	for(inodeBlock = idx->nStartBlock; inodeBlock != 0; inodeBlock = inode->nNextInode)
+	{
+		inode = load_inode(inodeBlock);
+		if(inode == NULL)
+		{
+			return -EIO;
+		}
+		for(k = 0; k < inode->nExtents && (logical < inode->extents[k].nLogical ||
+			logical >= inode->extents[k].nLogical + inode->extents[k].nBlocks); k++)
+		{
+		}
+		if(k < inode->nExtents)
+		{
+			ext = &inode->extents[k];
+			break;
+		}
+	}
+	if(ext == NULL || ext->nFlags != 0)
+	{
+		return -EIO;
+	}
+
+	data = malloc(blockSize);
+	if(data == NULL)
+	{
+		return -ENOMEM;
+	}
+	copy = alloc_block();
+	res = copy < 0 ? copy : cache_pread(data, blockSize, (off_t)phys*blockSize);
+	if(res == 0)
+	{
+		res = disk_pwrite(data, blockSize, (off_t)copy*blockSize);
+	}
+	free(data);
+	if(res != 0)
+	{
+		if(copy >= 0)
+		{
+			free_block(copy);
+		}
+		return res;
+	}
+
+	//the extent keeps the blocks before this one (or after, if there are
+	//none before), and the copy and whatever's left go in next to it
+	old = *ext;
+	at = logical - old.nLogical;
+	if(old.nBlocks == 1)
+	{
+		ext->nStartBlock = copy;
+	}
+	else if(at == 0)
+	{
+		ext->nLogical++;
+		ext->nStartBlock++;
+		ext->nBlocks--;
+	}
+	else
+	{
+		ext->nBlocks = at;
+	}
+	write_inode(inode, inodeBlock);
+	if(old.nBlocks > 1 && at > 0 && at < old.nBlocks - 1)
+	{
+		res = inode_insert(idx->nStartBlock, logical + 1, old.nStartBlock + at + 1, old.nBlocks - at - 1);
+		if(res != 0)
+		{
+			//the file is left with a hole where these were
+			free_run(old.nStartBlock + at + 1, old.nBlocks - at - 1);
+		}
+	}
+	if(old.nBlocks > 1 && res == 0)
+	{
+		res = inode_insert(idx->nStartBlock, logical, copy, 1);
+	}
+	if(old.nBlocks > 1 && res != 0)
+	{
+		free_block(copy);
+	}
+	free_block(phys);
+	if(res != 0)
+	{
+		//the index can't be trusted now, and the next index_get starts it over
+		index_drop(idx->nStartBlock);
+		return res;
+	}
+
+	//the same goes for the run in the index, which may be longer than the extent
+	pthread_mutex_lock(&indexLock);
+	found = index_run(idx, logical);
+	r = *found;
+	at = logical - r.nLogical;
+	if(r.nBlocks == 1)
+	{
+		found->nStartBlock = copy;
+	}
+	else if(at == 0)
+	{
+		found->nLogical++;
+		found->nStartBlock++;
+		found->nBlocks--;
+	}
+	else
+	{
+		found->nBlocks = at;
+	}
+	if(r.nBlocks > 1 && at > 0 && at < r.nBlocks - 1)
+	{
+		res = index_add_run(idx, logical + 1, r.nStartBlock + at + 1, r.nBlocks - at - 1, 0);
+	}
+	if(r.nBlocks > 1 && res == 0)
+	{
+		res = index_add_run(idx, logical, copy, 1, 0);
+	}
+	pthread_mutex_unlock(&indexLock);
+	if(res != 0)
+	{
+		index_drop(idx->nStartBlock);
+	}
+	return res;
+}
+
+//function to count how many extents point at each block of an image that
+//has shared blocks, at mount. The blocks more than one does get entries
+//saying how many
+//returns 0, or -errno
+static int dedup_init(){
+
+	cs1550_root_directory *root;
+	cs1550_directory_entry *dirEntry;
+	struct cs1550_inode *inode;
+	struct cs1550_extent *ext;
+	struct cs1550_dedup *e;
+	uint64_t *seen;
+	long inodeBlock, b, end;
+	int i, j, k, res = 0;
+
+	if(header == NULL || header->nVersion < CS1550_VERSION_SHARED)
+	{
+		return 0;
+	}
+	seen = calloc((header->nBlocks + 63) / 64, sizeof(uint64_t));
+	root = load_root();
+	if(seen == NULL || root == NULL)
+	{
+		free(seen);
+		return seen == NULL ? -ENOMEM : -EIO;
+	}
+	pthread_mutex_lock(&dedupLock);
+	for(i = 0; i < root->nDirectories && res == 0; i++)
+	{
+		dirEntry = load_dirEntry(root->directories[i].nStartBlock);
+		if(dirEntry == NULL)
+		{
+			res = -EIO;
+			break;
+		}
+		for(j = 0; j < dirEntry->nFiles && res == 0; j++)
+		{
+			//version 1 chains are never shared
+			if(is_inode(dirEntry->files[j].nStartBlock) != 1)
+			{
+				continue;
+			}
+			for(inodeBlock = dirEntry->files[j].nStartBlock; inodeBlock != 0 && res == 0; inodeBlock = inode->nNextInode)
+			{
+				inode = load_inode(inodeBlock);
+				if(inode == NULL)
+				{
+					res = -EIO;
+					break;
+				}
+				//an inline file's bytes are where the extents would be
+				if(inode->nFlags & INODE_INLINE)
+				{
+					break;
+				}
+				for(k = 0; k < inode->nExtents && res == 0; k++)
+				{
+					ext = &inode->extents[k];
+					end = ext->nStartBlock + (extent_stored(ext) > 0 ? extent_stored(ext) : ext->nBlocks);
+					for(b = ext->nStartBlock; b >= 0 && b < end && b < header->nBlocks; b++)
+					{
+						if(!(seen[b / 64] & (1ULL << (b % 64))))
+						{
+							seen[b / 64] |= 1ULL << (b % 64);
+							continue;
+						}
+						//another extent has it too
+						e = dedup_entry(b);
+						if(e == NULL)
+						{
+							res = -ENOMEM;
+							break;
+						}
+						if(e->nRefs++ == 1)
+						{
+							dedupShared++;
+						}
+					}
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&dedupLock);
+	free(seen);
+	return res;
+}
+
+//Data appended to a file isn't given blocks as it's written. It collects in
+//a buffer for the file, and blocks are only picked when the file is flushed
+//(or the buffer reaches -o delalloc KB, or the periodic write back comes
+//round), by which time the allocator can be asked for the whole lot as one
+//contiguous run. Blocks are reserved as the buffer grows so that picking
+//them later can't run out of space.
+struct cs1550_delalloc
+{
+	long nStartBlock;	//the file's inode
+	long nLogical;		//file block the buffer starts at, the first with no disk block
+	size_t nLen;		//bytes buffered
+	size_t nAlloc;		//bytes allocated
+	long nReserved;		//blocks reserved for it
+	char *data;
+	struct cs1550_delalloc *next;
+};
+
+#define DELALLOC_BUCKETS 64
+static struct cs1550_delalloc *delallocHash[DELALLOC_BUCKETS];
+//guards the hash. A buffer's contents belong to its file's lock
+static pthread_mutex_t delallocLock = PTHREAD_MUTEX_INITIALIZER;
+
+//function to find the buffered appends of a file, if it has any
+static struct cs1550_delalloc *delalloc_find(long nStartBlock){
+
+	struct cs1550_delalloc *d;
+
+	pthread_mutex_lock(&delallocLock);
+	for(d = delallocHash[nStartBlock % DELALLOC_BUCKETS]; d != NULL; d = d->next)
+	{
+		if(d->nStartBlock == nStartBlock)
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&delallocLock);
+	return d;
+}
+
+//function to throw away a buffer and give back its reserved blocks
+static void delalloc_free(struct cs1550_delalloc *d){
+
+	struct cs1550_delalloc **link = &delallocHash[d->nStartBlock % DELALLOC_BUCKETS];
+
+	pthread_mutex_lock(&delallocLock);
+	while(*link != d)
+	{
+		link = &(*link)->next;
+	}
+	*link = d->next;
+	pthread_mutex_unlock(&delallocLock);
+	alloc_unreserve(d->nReserved);
+	free(d->data);
+	free(d);
+}
+
+//function to copy buffered appends at offset into buf
+//returns how many bytes it had, 0 if none
+static size_t delalloc_read(long nStartBlock, char *buf, size_t size, off_t offset){
+
+	struct cs1550_delalloc *d = delalloc_find(nStartBlock);
+	size_t at;
+
+	if(d == NULL || offset < (off_t)d->nLogical*blockSize)
+	{
+		return 0;
+	}
+	at = offset - (off_t)d->nLogical*blockSize;
+	if(at >= d->nLen)
+	{
+		return 0;
+	}
+	if(size > d->nLen - at)
+	{
+		size = d->nLen - at;
+	}
+	memcpy(buf, d->data + at, size);
+	return size;
+}
+
+//function to find the bytes a file has buffered: they start at *start and
+//run for *len
+//returns 0 if it has none
+static int delalloc_extent(long nStartBlock, off_t *start, size_t *len){
+
+	struct cs1550_delalloc *d = delalloc_find(nStartBlock);
+
+	if(d == NULL)
+	{
+		return 0;
+	}
+	*start = (off_t)d->nLogical*blockSize;
+	*len = d->nLen;
+	return 1;
+}
+
+//function to throw away whatever a file has buffered from byte size on, for
+//when it's cut short, and the blocks reserved for it
+static void delalloc_trim(long nStartBlock, size_t size){
+
+	struct cs1550_delalloc *d = delalloc_find(nStartBlock);
+	size_t start;
+	long need;
+
+	if(d == NULL)
+	{
+		return;
+	}
+	start = (size_t)d->nLogical*blockSize;
+	if(size <= start)
+	{
+		delalloc_free(d);
+		return;
+	}
+	if(size - start < d->nLen)
+	{
+		d->nLen = size - start;
+		need = (d->nLen + blockSize - 1) / blockSize;
+		if(d->nReserved > need)
+		{
+			alloc_unreserve(d->nReserved - need);
+			d->nReserved = need;
+		}
+	}
+}
+
+//function to give a file's buffered appends their blocks and write them out
+static int delalloc_commit(struct cs1550_delalloc *d){
+
+	struct cs1550_block_index *idx;
+	size_t done = 0, len, total;
+	long start, got, i, left, want, stored, first, shared = 0, sharedAt = 0;
+	uint64_t *hashes = NULL;
+	int res = 0, stale;
+
+	//the last block goes out whole, with zeros past the data, since the file
+	//may grow over them later. The buffer is always a whole number of blocks
+	total = (d->nLen + blockSize - 1) / blockSize * blockSize;
+	memset(d->data + d->nLen, 0, total - d->nLen);
+
+	//with -o dedup, a block that's stored already is shared rather than
+	//written again, and only the blocks before the next such one are given
+	//blocks of their own at a time
+	if(options.dedup)
+	{
+		hashes = malloc(total / blockSize * sizeof(uint64_t));
+	}
+
+	while(done < total)
+	{
+		want = (total - done) / blockSize;
+		first = done / blockSize;
+		stored = 0;
+		if(hashes != NULL && shared == 0)
+		{
+			for(i = 0; i < want; i++)
+			{
+				hashes[first + i] = dedup_hash(d->data + done + i*blockSize);
+				shared = dedup_find(d->data + done + i*blockSize, hashes[first + i]);
+				if(shared > 0)
+				{
+					break;
+				}
+			}
+			sharedAt = first + i;
+		}
+		if(shared > 0 && sharedAt == first)
+		{
+			start = shared;
+			shared = 0;
+			got = 1;
+			len = blockSize;
+			res = inode_append(d->nStartBlock, d->nLogical, start, got, 0);
+			if(res != 0)
+			{
+				free_block(start);
+				break;
+			}
+		}
+		else
+		{
+			if(shared > 0)
+			{
+				want = sharedAt - first;
+			}
+			//with -o compress it goes a cluster at a time, each compressed if
+			//that saves a block
+			if(options.compress)
+			{
+				if(want > COMPRESS_CLUSTER)
+				{
+					want = COMPRESS_CLUSTER;
+				}
+				res = compress_append(d->nStartBlock, d->nLogical, d->data + done, want, &start, &stored, &d->nReserved);
+				if(res != 0)
+				{
+					break;
+				}
+				got = want;
+				len = got*blockSize;
+			}
+			if(stored == 0)
+			{
+				//the blocks come out of the buffer's reservation, which
+				//nothing else can have taken
+				start = alloc_run(want, &got, &d->nReserved);
+				if(start < 0)
+				{
+					res = start;
+					break;
+				}
+				len = got*blockSize;
+				if(len > total - done)
+				{
+					len = total - done;
+				}
+				//the run is fresh, so nothing of it is cached and it can go straight out in one write
+				res = disk_pwrite(d->data + done, len, (off_t)start*blockSize);
+				if(res == 0)
+				{
+					res = inode_append(d->nStartBlock, d->nLogical, start, got, 0);
+				}
+				if(res != 0)
+				{
+					free_run_reserved(start, got, &d->nReserved);
+					break;
+				}
+				//and the blocks can be found by what's in them from now on
+				for(i = 0; hashes != NULL && i < got; i++)
+				{
+					dedup_insert(start + i, hashes[first + i]);
+				}
+			}
+		}
+
+		//an index that's in memory gets the run too, one that isn't will read
+		//it from the inode. One still being read in may have missed it
+		pthread_mutex_lock(&indexLock);
+		idx = index_find(d->nStartBlock);
+		stale = idx != NULL && (idx->building || index_add_run(idx, d->nLogical, start, got, stored) != 0);
+		pthread_mutex_unlock(&indexLock);
+		if(stale)
+		{
+			index_drop(d->nStartBlock);
+		}
+		d->nLogical += got;
+		done += len;
+	}
+	//a block found to share that never got to be
+	if(shared > 0)
+	{
+		free_block(shared);
+	}
+	free(hashes);
+
+	if(done == total)
+	{
+		delalloc_free(d);
+		return 0;
+	}
+
+	//keep what didn't make it for another try, along with its reservation.
+	//Blocks that were shared or compressed leave some of that over
+	memmove(d->data, d->data + done, d->nLen - done);
+	d->nLen -= done;
+	left = (d->nLen + blockSize - 1) / blockSize;
+	if(d->nReserved > left)
+	{
+		alloc_unreserve(d->nReserved - left);
+		d->nReserved = left;
+	}
+	else if(d->nReserved < left)
+	{
+		if(alloc_reserve(left - d->nReserved) != 0)
+		{
+			return -ENOSPC;
+		}
+		d->nReserved = left;
+	}
+	return res;
+}
+
+//function to buffer size bytes written at offset past a file's last block
+//returns how many bytes were taken
+static int delalloc_write(struct cs1550_block_index *idx, const char *buf, size_t size, off_t offset){
+
+	struct cs1550_delalloc *d = delalloc_find(idx->nStartBlock);
+	size_t at, end, grow;
+	long blocks;
+	char *grown;
+
+	//a write that leaves whole blocks untouched past the buffer would have to
+	//fill them with zeros. Instead the buffer gets its blocks now, and a new
+	//one starts after the hole
+	if(d != NULL && offset / blockSize > (off_t)((d->nLogical*blockSize + d->nLen + blockSize - 1) / blockSize) &&
+		delalloc_commit(d) == 0)
+	{
+		d = NULL;
+	}
+	if(d == NULL)
+	{
+		d = calloc(1, sizeof(struct cs1550_delalloc));
+		if(d == NULL)
+		{
+			return -ENOMEM;
+		}
+		d->nStartBlock = idx->nStartBlock;
+		d->nLogical = offset / blockSize;
+		pthread_mutex_lock(&delallocLock);
+		d->next = delallocHash[d->nStartBlock % DELALLOC_BUCKETS];
+		delallocHash[d->nStartBlock % DELALLOC_BUCKETS] = d;
+		pthread_mutex_unlock(&delallocLock);
+	}
+	if(offset < (off_t)d->nLogical*blockSize)
+	{
+		return -EIO;
+	}
+	at = offset - (off_t)d->nLogical*blockSize;
+	end = at + size;
+
+	if(end > d->nLen)
+	{
+		//reserve the blocks this takes the buffer onto
+		blocks = (end + blockSize - 1) / blockSize - d->nReserved;
+		if(blocks > 0)
+		{
+			if(alloc_reserve(blocks) != 0)
+			{
+				return -ENOSPC;
+			}
+			d->nReserved += blocks;
+		}
+		if(end > d->nAlloc)
+		{
+			grow = d->nAlloc ? d->nAlloc*2 : 16*blockSize;
+			while(grow < end)
+			{
+				grow *= 2;
+			}
+			grown = realloc(d->data, grow);
+			if(grown == NULL)
+			{
+				return -ENOMEM;
+			}
+			d->data = grown;
+			d->nAlloc = grow;
+		}
+		if(at > d->nLen)
+		{
+			memset(d->data + d->nLen, 0, at - d->nLen);
+		}
+		d->nLen = end;
+	}
+	memcpy(d->data + at, buf, size);
+
+	if(d->nLen >= (size_t)options.delalloc*1024)
+	{
+		delalloc_commit(d);
+	}
+	return size;
+}
+
+//function to give every buffered append its blocks
+static int delalloc_commit_all(){
+
+	struct cs1550_delalloc *d, *next;
+	int i, res = 0;
+
+	for(i = 0; i < DELALLOC_BUCKETS; i++)
+	{
+		for(d = delallocHash[i]; d != NULL; d = next)
+		{
+			next = d->next;
+			if(delalloc_commit(d) != 0)
+			{
+				res = -EIO;
+			}
+		}
+	}
+	return res;
+}
+
+//function to throw away a file's buffered appends, for when the file goes away
+static void delalloc_discard(long nStartBlock){
+
+	struct cs1550_delalloc *d = delalloc_find(nStartBlock);
+
+	if(d != NULL)
+	{
+		delalloc_free(d);
+	}
+}
+
+//function to free an inode along with every block its extents point at
+static void inode_free(long inodeBlock){
+
+	struct cs1550_inode *inode;
+	long next;
+	int k;
+
+	index_drop(inodeBlock);
+	delalloc_discard(inodeBlock);
+	while(inodeBlock != 0)
+	{
+		inode = load_inode(inodeBlock);
+		if(inode == NULL)
+		{
+			return;
+		}
+		for(k = 0; k < inode->nExtents; k++)
+		{
+			extent_free(&inode->extents[k]);
+		}
+		next = inode->nNextInode;
+		meta_remove(inodeBlock);
+		free_block(inodeBlock);
+		inodeBlock = next;
+	}
+}
+
+//function to give back every block of a file from block `keep` on. An inode
+//after the first that's left with no extents is freed, along with the rest
+//of the chain, since everything in those is past keep too
+static void inode_truncate(long inodeBlock, long keep){
+
+	struct cs1550_inode *inode, *prev = NULL;
+	struct cs1550_extent *ext;
+	long prevBlock = 0, next, end;
+	int k, n;
+
+	while(inodeBlock != 0)
+	{
+		inode = load_inode(inodeBlock);
+		if(inode == NULL)
+		{
+			return;
+		}
+		for(k = 0, n = 0; k < inode->nExtents; k++)
+		{
+			ext = &inode->extents[k];
+			end = ext->nLogical + ext->nBlocks;
+			if(ext->nLogical >= keep)
+			{
+				extent_free(ext);
+				continue;
+			}
+			if(end > keep)
+			{
+				//a compressed extent keeps all its blocks, and only
+				//decompresses as many as it's left with
+				if(extent_stored(ext) == 0)
+				{
+					free_run(ext->nStartBlock + (keep - ext->nLogical), end - keep);
+				}
+				ext->nBlocks = keep - ext->nLogical;
+			}
+			inode->extents[n++] = *ext;
+		}
+		inode->nExtents = n;
+		next = inode->nNextInode;
+		if(n == 0 && prev != NULL)
+		{
+			prev->nNextInode = 0;
+			write_inode(prev, prevBlock);
+			inode_free(inodeBlock);
+			return;
+		}
+		write_inode(inode, inodeBlock);
+		prev = inode;
+		prevBlock = inodeBlock;
+		inodeBlock = next;
+	}
+}
+
+//function to read size bytes at offset from a file that has an inode
+//returns how many bytes were read, which stops at the end of the file
+static int extent_read(struct cs1550_block_index *idx, size_t fsize, char *buf, size_t size, off_t offset){
+
+	struct cs1550_run r;
+	size_t done = 0, len, within, bufLen;
+	long logical, phys, run, next;
+	off_t bufStart;
+	int res;
+
+	if((size_t)offset >= fsize)
+	{
+		return 0;
+	}
+	if(size > fsize - offset)
+	{
+		size = fsize - offset;
+	}
+
+	while(done < size)
+	{
+		logical = (offset + done) / blockSize;
+		within = (offset + done) % blockSize;
+
+		phys = index_map(idx, logical, &run);
+		if(phys < 0)
+		{
+			return phys;
+		}
+		if(phys == 0)
+		{
+			//no block yet: it may be appended data still waiting for one
+			len = delalloc_read(idx->nStartBlock, buf + done, size - done, offset + done);
+			if(len == 0)
+			{
+				//or a hole, which reads as zeros up to whatever data comes next
+				len = size - done;
+				next = index_next(idx, logical);
+				if(next >= 0 && (size_t)((off_t)next*blockSize - (offset + done)) < len)
+				{
+					len = (off_t)next*blockSize - (offset + done);
+				}
+				if(delalloc_extent(idx->nStartBlock, &bufStart, &bufLen) && bufStart > offset + (off_t)done &&
+					(size_t)(bufStart - (offset + done)) < len)
+				{
+					len = bufStart - (offset + done);
+				}
+				memset(buf + done, 0, len);
+			}
+			done += len;
+			continue;
+		}
+
+		//read the rest of this run in one go
+		len = run*blockSize - within;
+		if(len > size - done)
+		{
+			len = size - done;
+		}
+		if(index_compressed(idx, logical, &r))
+		{
+			res = compress_read(&r, buf + done, len, (size_t)(logical - r.nLogical)*blockSize + within);
+		}
+		else
+		{
+			res = cache_pread(buf + done, len, (off_t)phys*blockSize + within);
+		}
+		if(res != 0)
+		{
+			return res;
+		}
+		done += len;
+	}
+	return done;
+}
+
+//function to read size bytes at offset from a version 1 file
+//the block index finds the first wanted block without following the chain,
+//and only the blocks that are wanted get read
+static int legacy_read(struct cs1550_block_index *idx, size_t fsize, char *buf, size_t size, off_t offset){
+
+	struct cs1550_disk_block blockCopy;
+	const struct cs1550_disk_block *block;
+	size_t done = 0, len, within;
+	long logical, phys, run;
+
+	if((size_t)offset >= fsize)
+	{
+		return 0;
+	}
+	if(size > fsize - offset)
+	{
+		size = fsize - offset;
+	}
+
+	while(done < size)
+	{
+		logical = (offset + done) / MAX_DATA_IN_BLOCK;
+		within = (offset + done) % MAX_DATA_IN_BLOCK;
+
+		phys = index_map(idx, logical, &run);
+		if(phys == 0)
+		{
+			//the chain is shorter than the file size says
+			break;
+		}
+		block = block_view(phys, &blockCopy);
+
+		len = MAX_DATA_IN_BLOCK - within;
+		if(len > size - done)
+		{
+			len = size - done;
+		}
+		memcpy(buf + done, block->data + within, len);
+		done += len;
+	}
+	return done;
+}
+
+//function to read ahead of a file being read straight through. Called after
+//each read of len bytes at offset, with dataInBlock the bytes of file data
+//each block holds. A read that carries on from the last one doubles the
+//window (up to -o readahead blocks) and the blocks past it that haven't been
+//read ahead yet are pulled into the cache now, in runs, so the reads that
+//follow find them there. Any other read closes the window
+static void readahead(struct cs1550_block_index *idx, off_t offset, size_t len, size_t fsize, size_t dataInBlock){
+
+	struct cs1550_run r;
+	long next, end, last, phys, run;
+	char one;
+
+	//several readers of one file may get here at once
+	pthread_mutex_lock(&indexLock);
+	if(offset != idx->nNextRead || options.readahead <= 0)
+	{
+		idx->nWindow = 0;
+		idx->nReadAhead = 0;
+		idx->nNextRead = offset + len;
+		pthread_mutex_unlock(&indexLock);
+		return;
+	}
+	idx->nNextRead = offset + len;
+	idx->nWindow = idx->nWindow ? idx->nWindow*2 : 4;
+	if(idx->nWindow > options.readahead)
+	{
+		idx->nWindow = options.readahead;
+	}
+
+	//from the block after this read up to the window, but not past the end of the file
+	next = (offset + len + dataInBlock - 1) / dataInBlock;
+	if(next < idx->nReadAhead)
+	{
+		next = idx->nReadAhead;
+	}
+	end = (offset + len) / dataInBlock + 1 + idx->nWindow;
+	last = (fsize + dataInBlock - 1) / dataInBlock;
+	if(end > last)
+	{
+		end = last;
+	}
+	pthread_mutex_unlock(&indexLock);
+
+	while(next < end)
+	{
+		phys = index_map(idx, next, &run);
+		if(phys < 0)
+		{
+			break;
+		}
+		if(phys == 0)
+		{
+			//a hole, or not on disk yet: nothing to read
+			next++;
+			continue;
+		}
+		if(run > end - next)
+		{
+			run = end - next;
+		}
+		//a compressed run is read by decompressing it into the cache
+		if(index_compressed(idx, next, &r))
+		{
+			if(cache_enabled() && compress_read(&r, &one, 1, (size_t)(next - r.nLogical)*blockSize) != 0)
+			{
+				break;
+			}
+		}
+		else if(cache_prefetch(phys, run) != 0)
+		{
+			break;
+		}
+		next += run;
+	}
+	pthread_mutex_lock(&indexLock);
+	if(next > idx->nReadAhead)
+	{
+		idx->nReadAhead = next;
+	}
+	pthread_mutex_unlock(&indexLock);
+}
+
+//a block of zeros, for the parts of blocks that hold no data
+static const char zeroBlock[MAX_BLOCK_SIZE];
+
+//function to zero the rest of the block a file ends in, up to byte upto, as
+//the file grows past its end. What's there may be left from a longer
+//version of the file, or from whatever had the block before
+static int extent_zero_tail(struct cs1550_block_index *idx, size_t fsize, size_t upto){
+
+	size_t within = fsize % blockSize, len;
+	long phys, run;
+	int res;
+
+	if(within == 0 || upto <= fsize)
+	{
+		return 0;
+	}
+	//a compressed block is made plain first, so it can be written
+	res = compress_expand(idx, fsize / blockSize);
+	if(res != 0)
+	{
+		return res;
+	}
+	//a hole needs nothing, and a buffer is zeroed as it grows
+	phys = index_map(idx, fsize / blockSize, &run);
+	if(phys <= 0)
+	{
+		return 0;
+	}
+	//and a block shared with another file is copied first
+	if(dedup_private(phys, 1) == 0)
+	{
+		res = dedup_copy(idx, fsize / blockSize);
+		if(res != 0)
+		{
+			return res;
+		}
+		phys = index_map(idx, fsize / blockSize, &run);
+	}
+	len = blockSize - within;
+	if(len > upto - fsize)
+	{
+		len = upto - fsize;
+	}
+	return cache_pwrite(zeroBlock, len, (off_t)phys*blockSize + within);
+}
+
+//function to write size bytes at offset into a file that has an inode,
+//adding blocks as the file grows. *fsize is updated to the new file size
+//returns how many bytes were written
+static int extent_write(long inodeBlock, size_t *fsize, const char *buf, size_t size, off_t offset){
+
+	struct cs1550_block_index *idx;
+	struct cs1550_run r;
+	size_t done = 0, len, within, bufLen;
+	long logical, phys = 0, run, shared, n;
+	uint64_t hash = 0;
+	off_t bufStart;
+	int res, hashed;
+
+	idx = index_get(inodeBlock);
+	if(idx == NULL)
+	{
+		return -EIO;
+	}
+	//writing past the end leaves a hole in between, which takes no blocks
+	if((size_t)offset > *fsize)
+	{
+		res = extent_zero_tail(idx, *fsize, offset);
+		if(res != 0)
+		{
+			index_put(idx);
+			return res;
+		}
+	}
+
+	while(done < size)
+	{
+		logical = (offset + done) / blockSize;
+		within = (offset + done) % blockSize;
+		shared = 0;
+		hashed = 0;
+
+		phys = index_map(idx, logical, &run);
+		if(phys > 0 && index_compressed(idx, logical, &r))
+		{
+			//compressed blocks can't be written in place
+			res = compress_expand(idx, logical);
+			if(res != 0)
+			{
+				phys = res;
+				break;
+			}
+			continue;
+		}
+		if(phys == 0 && options.delalloc > 0 && logical >= index_end(idx) &&
+			(!delalloc_extent(inodeBlock, &bufStart, &bufLen) || offset + (off_t)done >= bufStart))
+		{
+			//the rest is appended data, which waits in memory for its blocks
+			res = delalloc_write(idx, buf + done, size - done, offset + done);
+			if(res < 0)
+			{
+				phys = res;
+				break;
+			}
+			done += res;
+			break;
+		}
+		if(phys == 0 && options.dedup && within == 0 && size - done >= (size_t)blockSize)
+		{
+			//with -o dedup, a whole block that's stored already is shared
+			//rather than written again. One this only starts is left alone,
+			//since the next write most likely carries on into it
+			hashed = 1;
+			hash = dedup_hash(buf + done);
+			shared = dedup_find(buf + done, hash);
+		}
+		if(phys == 0)
+		{
+			//the file needs another block, at its end or in a hole. A fresh
+			//block may hold anything, so what this doesn't write starts as zeros
+			phys = shared > 0 ? shared : alloc_block();
+			if(phys >= 0 && shared == 0 && (within != 0 || size - done < (size_t)blockSize))
+			{
+				res = cache_pwrite(zeroBlock, blockSize, (off_t)phys*blockSize);
+				if(res != 0)
+				{
+					free_block(phys);
+					phys = res;
+				}
+			}
+			if(phys >= 0)
+			{
+				res = inode_insert(inodeBlock, logical, phys, 1);
+				if(res != 0)
+				{
+					free_block(phys);
+					phys = res;
+				}
+				else
+				{
+					pthread_mutex_lock(&indexLock);
+					res = index_add_run(idx, logical, phys, 1, 0);
+					pthread_mutex_unlock(&indexLock);
+				}
+				if(phys >= 0 && res != 0)
+				{
+					//the inode has the block but the index couldn't take it, so start the index over
+					index_drop(inodeBlock);
+					index_put(idx);
+					idx = index_get(inodeBlock);
+					if(idx == NULL)
+					{
+						phys = -ENOMEM;
+					}
+				}
+			}
+			run = 1;
+		}
+		if(phys < 0)
+		{
+			break;
+		}
+		if(shared > 0)
+		{
+			done += blockSize;
+			continue;
+		}
+
+		len = run*blockSize - within;
+		if(len > size - done)
+		{
+			len = size - done;
+		}
+		//blocks shared with another file aren't written in place; the file
+		//gets a copy of its own of the first, and stops before any other
+		n = dedup_private(phys, (within + len + blockSize - 1) / blockSize);
+		if(n == 0)
+		{
+			res = dedup_copy(idx, logical);
+			if(res != 0)
+			{
+				phys = res;
+				break;
+			}
+			continue;
+		}
+		if(len > n*blockSize - within)
+		{
+			len = n*blockSize - within;
+		}
+		res = cache_pwrite(buf + done, len, (off_t)phys*blockSize + within);
+		if(res != 0)
+		{
+			phys = res;
+			break;
+		}
+		if(hashed)
+		{
+			dedup_insert(phys, hash);
+		}
+		done += len;
+	}
+	if(idx != NULL)
+	{
+		index_put(idx);
+	}
+
+	if(offset + done > *fsize)
+	{
+		*fsize = offset + done;
+	}
+	if(done == 0 && size > 0)
+	{
+		return phys;
+	}
+	return done;
+}
+
+//Files made while mounted with -o inline start out with their bytes in their
+//inode (see INODE_INLINE), so a small one takes a single block, and reading
+//it is a copy out of the resident inode. The first write or truncate that
+//takes one past what the inode holds moves the bytes out into data blocks,
+//and from then on it's an ordinary file.
+
+//function to get how many bytes an inode can hold itself
+static size_t inline_max(){
+	return blockSize - offsetof(struct cs1550_inode, extents);
+}
+
+//function to get where an inline file's bytes start in its inode, which
+//runs on past the record to the end of the block
+static char *inline_data(struct cs1550_inode *inode){
+	return (char *)inode + offsetof(struct cs1550_inode, extents);
+}
+
+//function to read size bytes at offset from a file of fsize bytes whose
+//bytes are in its inode
+//returns how many bytes were read, which stops at the end of the file
+static int inline_read(long inodeBlock, size_t fsize, char *buf, size_t size, off_t offset){
+
+	struct cs1550_inode *inode;
+
+	if((size_t)offset >= fsize)
+	{
+		return 0;
+	}
+	if(size > fsize - offset)
+	{
+		size = fsize - offset;
+	}
+	inode = load_inode(inodeBlock);
+	if(inode == NULL)
+	{
+		return -EIO;
+	}
+	memcpy(buf, inline_data(inode) + offset, size);
+	return size;
+}
+
+//function to move the fsize bytes of a file out of its inode into data
+//blocks, which leaves it an ordinary file. If they can't be, it's left inline
+static int inline_spill(long inodeBlock, size_t fsize){
+
+	struct cs1550_inode *inode;
+	size_t newSize = 0;
+	char *copy;
+	int res;
+
+	inode = load_inode(inodeBlock);
+	if(inode == NULL)
+	{
+		return -EIO;
+	}
+	copy = malloc(inline_max());
+	if(copy == NULL)
+	{
+		return -ENOMEM;
+	}
+	memcpy(copy, inline_data(inode), inline_max());
+	memset(inline_data(inode), 0, inline_max());
+	inode->nFlags &= ~INODE_INLINE;
+	write_inode(inode, inodeBlock);
+	index_drop(inodeBlock);
+
+	res = extent_write(inodeBlock, &newSize, copy, fsize, 0);
+	if(res >= 0 && (size_t)res < fsize)
+	{
+		res = -ENOSPC;
+	}
+	if(res < 0)
+	{
+		//give back whatever the bytes got and put them back where they were
+		delalloc_discard(inodeBlock);
+		inode_truncate(inodeBlock, 0);
+		inode = load_inode(inodeBlock);
+		if(inode == NULL)
+		{
+			free(copy);
+			return -EIO;
+		}
+		memcpy(inline_data(inode), copy, inline_max());
+		inode->nFlags |= INODE_INLINE;
+		write_inode(inode, inodeBlock);
+		index_drop(inodeBlock);
+		free(copy);
+		return res;
+	}
+	free(copy);
+	return 0;
+}
+
+//function to write size bytes at offset into a file that has an inode,
+//into the inode itself if the file is inline and they fit
+//returns how many bytes were written
+static int inline_write(long inodeBlock, size_t *fsize, const char *buf, size_t size, off_t offset){
+
+	struct cs1550_inode *inode;
+	int res;
+
+	inode = load_inode(inodeBlock);
+	if(inode == NULL)
+	{
+		return -EIO;
+	}
+	if(!(inode->nFlags & INODE_INLINE))
+	{
+		return extent_write(inodeBlock, fsize, buf, size, offset);
+	}
+	if(offset + size > inline_max())
+	{
+		res = inline_spill(inodeBlock, *fsize);
+		if(res != 0)
+		{
+			return res;
+		}
+		return extent_write(inodeBlock, fsize, buf, size, offset);
+	}
+
+	//what's between the old end and offset is already zero
+	memcpy(inline_data(inode) + offset, buf, size);
+	write_inode(inode, inodeBlock);
+	if(offset + size > *fsize)
+	{
+		*fsize = offset + size;
+	}
+	return size;
+}
+
+//function to move a version 1 file onto an inode, called the first time the
+//file is written. Copies the chain into extents and frees the chain
+static int migrate_file(struct cs1550_file_directory *file){
+
+	struct cs1550_disk_block block;
+	size_t newSize = 0, len;
+	long inodeBlock, currBlock, next;
+	int res, hops = 0;
+
+	inodeBlock = inode_create(0);
+	if(inodeBlock < 0)
+	{
+		return inodeBlock;
+	}
+
+	//copy the data over first, so a failure leaves the old file untouched
+	currBlock = file->nStartBlock;
+	while(currBlock != 0 && newSize < file->fsize && hops++ < MAX_BLOCKS)
+	{
+		block = read_block(currBlock);
+		len = file->fsize - newSize;
+		if(len > MAX_DATA_IN_BLOCK)
+		{
+			len = MAX_DATA_IN_BLOCK;
+		}
+		res = extent_write(inodeBlock, &newSize, block.data, len, newSize);
+		if(res < 0)
+		{
+			inode_free(inodeBlock);
+			return res;
+		}
+		currBlock = block.nNextBlock;
+	}
+
+	//then give the chain back. It can't be longer than the disk, whatever its links say
+	currBlock = file->nStartBlock;
+	hops = 0;
+	while(currBlock != 0 && hops++ < MAX_BLOCKS)
+	{
+		block = read_block(currBlock);
+		next = block.nNextBlock;
+		free_block(currBlock);
+		currBlock = next;
+	}
+	index_drop(file->nStartBlock);
+
+	file->nStartBlock = inodeBlock;
+	file->fsize = newSize;
+	return 0;
+}
+
+
+
+//Handlers can run on several threads at once. The root has a reader-writer
+//lock, taken for writing only by mkdir, rmdir and the periodic write back
+//(which needs the metadata to hold still while it goes out). Each directory
+//and each file has a reader-writer lock too, picked out of a fixed set by a
+//hash of its name, so they can be found from the path before any lookup
+//(cs1550_lowlevel, which gets no paths, picks them by block and inode number).
+//Locks are always taken root, directory, file, and the inner ones (index,
+//delayed allocation, shared blocks, allocator, pins, metadata, cache, disk) only
+//after those.
+//A file's entry in its directory block is only changed under the file's
+//write lock, so writers to different files can share a directory's read lock.
+//unlink, which moves another file's entry into the hole it leaves, holds the
+//directory's write lock as well.
+#define DIR_LOCKS 32
+#define FILE_LOCKS 128
+static pthread_rwlock_t rootLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t dirLocks[DIR_LOCKS];
+static pthread_rwlock_t fileLocks[FILE_LOCKS];
+
+enum { LOCK_NONE, LOCK_READ, LOCK_WRITE };
+
+//the locks one handler holds, in the order they were taken
+struct cs1550_held
+{
+	pthread_rwlock_t *locks[3];
+	int nLocks;
+};
+
+//function to set up the directory and file locks (at mount)
+static void locks_init(){
+
+	int i;
+
+	for(i = 0; i < DIR_LOCKS; i++)
+	{
+		pthread_rwlock_init(&dirLocks[i], NULL);
+	}
+	for(i = 0; i < FILE_LOCKS; i++)
+	{
+		pthread_rwlock_init(&fileLocks[i], NULL);
+	}
+}
+
+//function to hash the first len characters of a name
+static unsigned long name_hash(const char *name, size_t len){
+
+	unsigned long hash = 5381;
+	size_t i;
+
+	for(i = 0; i < len; i++)
+	{
+		hash = hash*33 + (unsigned char)name[i];
+	}
+	return hash;
+}
+
+//function to take one lock in the given mode and remember it
+static void held_take(struct cs1550_held *held, pthread_rwlock_t *lock, int mode){
+
+	if(mode == LOCK_NONE)
+	{
+		return;
+	}
+	if(mode == LOCK_WRITE)
+	{
+		pthread_rwlock_wrlock(lock);
+	}
+	else
+	{
+		pthread_rwlock_rdlock(lock);
+	}
+	held->locks[held->nLocks++] = lock;
+}
+
+//function to unpin the blocks handed to the open file owner, or if that's
+//NULL the ones this thread handed out, and free those that were only held
+//for them. Called with no locks held
+static void pin_release(const void *owner){
+
+	pthread_t self = pthread_self();
+	long i, j, nStart, nBlocks;
+
+	pthread_mutex_lock(&pinLock);
+	for(i = j = 0; i < nPins; i++)
+	{
+		if(pins[i].owner == NULL || (owner != NULL ? pins[i].owner != owner : !pthread_equal(pins[i].thread, self)))
+		{
+			pins[j++] = pins[i];
+		}
+	}
+	nPins = j;
+	for(i = 0; i < nPins && allocBits != NULL; )
+	{
+		if(pins[i].owner != NULL || pin_held(pins[i].nStart, pins[i].nBlocks))
+		{
+			i++;
+			continue;
+		}
+		nStart = pins[i].nStart;
+		nBlocks = pins[i].nBlocks;
+		pins[i] = pins[--nPins];
+		pthread_mutex_unlock(&pinLock);
+		//the root lock keeps a write back from catching the bitmap half changed
+		pthread_rwlock_rdlock(&rootLock);
+		free_bits(nStart, nBlocks, NULL);
+		pthread_rwlock_unlock(&rootLock);
+		pthread_mutex_lock(&pinLock);
+		i = 0;
+	}
+	pthread_mutex_unlock(&pinLock);
+}
+
+//function called as a thread starts on a request, before it takes any lock.
+//It has sent the reply to the last one, so what it handed out then is done with
+static void pin_done(){
+
+	if(pinsHere)
+	{
+		pinsHere = 0;
+		pin_release(NULL);
+	}
+}
+
+//function to forget every pin (at unmount, once every file is released)
+static void pin_drop_all(){
+
+	free(pins);
+	pins = NULL;
+	nPins = 0;
+	nPinsAlloc = 0;
+}
+
+//function to lock the root, the directory and the file a path names, each
+//in the mode asked for. A path with no directory (or no file) part skips it
+static void path_lock(struct cs1550_held *held, const char *path, int rootMode, int dirMode, int fileMode){
+
+	const char *name = path + 1;
+	size_t dirLen = strcspn(name, "/");
+
+	pin_done();
+	held->nLocks = 0;
+	held_take(held, &rootLock, rootMode);
+	if(dirLen == 0)
+	{
+		return;
+	}
+	held_take(held, &dirLocks[name_hash(name, dirLen) % DIR_LOCKS], dirMode);
+	if(name[dirLen] == '/' && name[dirLen + 1] != '\0')
+	{
+		held_take(held, &fileLocks[name_hash(name, strlen(name)) % FILE_LOCKS], fileMode);
+	}
+}
+
+//function to let go of everything path_lock took, last taken first
+static void path_unlock(struct cs1550_held *held){
+
+	while(held->nLocks > 0)
+	{
+		pthread_rwlock_unlock(held->locks[--held->nLocks]);
+	}
+}
+
+//Names are found through a hash table per directory, and one for the root,
+//mapping a name to its slot so a lookup doesn't strcmp its way through every
+//entry. A table is built the first time its directory is looked in and kept
+//up to date as names are added. Changes that move entries around throw the
+//table away to be built again on next use. A table is read under its
+//directory's lock (the root lock for the root) and only changed under that
+//lock held for writing; nameLock guards the list of tables.
+struct cs1550_name_index
+{
+	long nBlock;		//the directory block it covers, 0 for the root
+	int nNames;			//names in the table
+	int nSlots;			//size of the table, a power of two
+	int *table;			//entry slot + 1 for each name, 0 where empty
+	struct cs1550_name_index *next;
+};
+
+#define NAME_BUCKETS 64
+static struct cs1550_name_index *nameIndexes[NAME_BUCKETS];
+static pthread_mutex_t nameLock = PTHREAD_MUTEX_INITIALIZER;
+
+//function to hash a file name and extension as if they were written name.ext
+static unsigned long file_hash(const char *fname, const char *fext){
+
+	return name_hash(fext, strlen(fext)) ^ name_hash(fname, strlen(fname))*31;
+}
+
+//function to hash the name in slot i of the root (nBlock 0) or a directory block
+static unsigned long slot_hash(long nBlock, const void *block, int i){
+
+	const struct cs1550_root_directory *root = block;
+	const struct cs1550_directory_entry *dirEntry = block;
+
+	if(nBlock == 0)
+	{
+		return name_hash(root->directories[i].dname, strlen(root->directories[i].dname));
+	}
+	return file_hash(dirEntry->files[i].fname, dirEntry->files[i].fext);
+}
+
+//function to put slot i into a table, which must have room for it
+static void name_index_put(struct cs1550_name_index *ni, unsigned long hash, int i){
+
+	unsigned long k = hash & (ni->nSlots - 1);
+
+	while(ni->table[k] != 0)
+	{
+		k = (k + 1) & (ni->nSlots - 1);
+	}
+	ni->table[k] = i + 1;
+	ni->nNames++;
+}
+
+//function to fill a table from the nEntries names of a directory block, making
+//it at least twice as big as it needs to be
+static int name_index_fill(struct cs1550_name_index *ni, const void *block, int nEntries){
+
+	int nSlots = 16, i;
+	int *table;
+
+	while(nSlots < nEntries*2 + 2)
+	{
+		nSlots *= 2;
+	}
+	table = calloc(nSlots, sizeof(int));
+	if(table == NULL)
+	{
+		return -ENOMEM;
+	}
+	free(ni->table);
+	ni->table = table;
+	ni->nSlots = nSlots;
+	ni->nNames = 0;
+	for(i = 0; i < nEntries; i++)
+	{
+		name_index_put(ni, slot_hash(ni->nBlock, block, i), i);
+	}
+	return 0;
+}
+
+//function to get the table for a directory block, building it on first use
+//returns NULL if there's no memory for it, and callers fall back to scanning
+static struct cs1550_name_index *name_index_get(long nBlock, const void *block, int nEntries){
+
+	struct cs1550_name_index *ni;
+
+	pthread_mutex_lock(&nameLock);
+	for(ni = nameIndexes[nBlock % NAME_BUCKETS]; ni != NULL; ni = ni->next)
+	{
+		if(ni->nBlock == nBlock)
+		{
+			break;
+		}
+	}
+	if(ni == NULL)
+	{
+		ni = calloc(1, sizeof(struct cs1550_name_index));
+		if(ni != NULL)
+		{
+			ni->nBlock = nBlock;
+			if(name_index_fill(ni, block, nEntries) != 0)
+			{
+				free(ni);
+				ni = NULL;
+			}
+			else
+			{
+				ni->next = nameIndexes[nBlock % NAME_BUCKETS];
+				nameIndexes[nBlock % NAME_BUCKETS] = ni;
+			}
+		}
+	}
+	pthread_mutex_unlock(&nameLock);
+	return ni;
+}
+
+//function to throw away the table for a directory block
+static void name_index_drop(long nBlock){
+
+	struct cs1550_name_index **link = &nameIndexes[nBlock % NAME_BUCKETS];
+	struct cs1550_name_index *ni;
+
+	pthread_mutex_lock(&nameLock);
+	while((ni = *link) != NULL)
+	{
+		if(ni->nBlock == nBlock)
+		{
+			*link = ni->next;
+			free(ni->table);
+			free(ni);
+			break;
+		}
+		link = &ni->next;
+	}
+	pthread_mutex_unlock(&nameLock);
+}
+
+//function to throw away every table (at unmount)
+static void name_index_drop_all(){
+
+	struct cs1550_name_index *ni;
+	int i;
+
+	for(i = 0; i < NAME_BUCKETS; i++)
+	{
+		while((ni = nameIndexes[i]) != NULL)
+		{
+			nameIndexes[i] = ni->next;
+			free(ni->table);
+			free(ni);
+		}
+	}
+}
+
+//function to find a directory in the root
+//returns its slot in root->directories, or -1 if there's no such directory
+static int root_lookup(const struct cs1550_root_directory *root, const char *dname){
+
+	struct cs1550_name_index *ni = name_index_get(0, root, root->nDirectories);
+	unsigned long k;
+	int i;
+
+	if(ni == NULL)
+	{
+		for(i = 0; i < root->nDirectories; i++)
+		{
+			if(strcmp(root->directories[i].dname, dname) == 0)
+			{
+				return i;
+			}
+		}
+		return -1;
+	}
+	for(k = name_hash(dname, strlen(dname)) & (ni->nSlots - 1); ni->table[k] != 0; k = (k + 1) & (ni->nSlots - 1))
+	{
+		i = ni->table[k] - 1;
+		if(i < root->nDirectories && strcmp(root->directories[i].dname, dname) == 0)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+//function to find a file in the directory stored at dirBlock
+//returns its slot in dirEntry->files, or -1 if there's no such file
+static int dir_lookup(long dirBlock, const struct cs1550_directory_entry *dirEntry, const char *fname, const char *fext){
+
+	struct cs1550_name_index *ni = name_index_get(dirBlock, dirEntry, dirEntry->nFiles);
+	unsigned long k;
+	int j;
+
+	if(ni == NULL)
+	{
+		for(j = 0; j < dirEntry->nFiles; j++)
+		{
+			if(strcmp(dirEntry->files[j].fname, fname) == 0 && strcmp(dirEntry->files[j].fext, fext) == 0)
+			{
+				return j;
+			}
+		}
+		return -1;
+	}
+	for(k = file_hash(fname, fext) & (ni->nSlots - 1); ni->table[k] != 0; k = (k + 1) & (ni->nSlots - 1))
+	{
+		j = ni->table[k] - 1;
+		if(j < dirEntry->nFiles && strcmp(dirEntry->files[j].fname, fname) == 0 && strcmp(dirEntry->files[j].fext, fext) == 0)
+		{
+			return j;
+		}
+	}
+	return -1;
+}
+
+//function to add the name just put in slot i of the root (nBlock 0) or a
+//directory block to its table, growing the table if it's getting full
+static void name_added(long nBlock, const void *block, int nEntries, int i){
+
+	struct cs1550_name_index *ni = name_index_get(nBlock, block, nEntries);
+
+	if(ni == NULL)
+	{
+		return;
+	}
+	if(ni->nNames == nEntries)
+	{
+		//built after the name went in, so it's already there
+		return;
+	}
+	if((ni->nNames + 1)*2 > ni->nSlots)
+	{
+		if(name_index_fill(ni, block, nEntries) != 0)
+		{
+			name_index_drop(nBlock);
+		}
+		return;
+	}
+	name_index_put(ni, slot_hash(nBlock, block, i), i);
+}
+
+//function to split a path into its directory, file name and extension, the
+//way "/%[^/]/%[^.].%s" would, but never writing past the end of the fields.
+//Parts that aren't there are left empty
+//returns 0, or -ENAMETOOLONG if a part is too long for its field
+static int parse_path(const char *path, char *directory, char *filename, char *extension){
+
+	size_t len;
+
+	directory[0] = filename[0] = extension[0] = '\0';
+	if(path[0] != '/')
+	{
+		return 0;
+	}
+	path++;
+
+	len = strcspn(path, "/");
+	if(len > MAX_FILENAME)
+	{
+		return -ENAMETOOLONG;
+	}
+	memcpy(directory, path, len);
+	directory[len] = '\0';
+	if(len == 0 || path[len] != '/')
+	{
+		return 0;
+	}
+	path += len + 1;
+
+	len = strcspn(path, ".");
+	if(len > MAX_FILENAME)
+	{
+		return -ENAMETOOLONG;
+	}
+	memcpy(filename, path, len);
+	filename[len] = '\0';
+	if(len == 0 || path[len] != '.')
+	{
+		return 0;
+	}
+	path += len + 1;
+
+	len = strlen(path);
+	if(len > MAX_EXTENSION)
+	{
+		return -ENAMETOOLONG;
+	}
+	memcpy(extension, path, len + 1);
+	return 0;
+}
+
+//Whole paths that have been looked up are remembered, so the getattr calls
+//the kernel keeps making for the same names (and for names that don't exist,
+//like editor swap files) are answered without walking each part. The cache
+//is direct mapped on a hash of the path. An entry holds what the path turned
+//out to be and where: the directory's slot in the root and the file's slot in
+//its directory. Sizes and start blocks are read through those slots, so
+//writes never leave an entry stale. Only namespace changes do, and they
+//forget the entries they affect. Entries are filled in under the namespace
+//locks for their path held for reading, and forgotten under them held for
+//writing, so a lookup can never put back an entry a change just forgot
+#define DENTRY_SLOTS 1024
+//the longest valid path, /dirname/filename.ext, and its terminator
+#define DENTRY_PATH (1 + MAX_FILENAME + 1 + MAX_FILENAME + 1 + MAX_EXTENSION + 1)
+
+enum { DENTRY_EMPTY, DENTRY_NONE, DENTRY_DIR, DENTRY_FILE };
+
+struct cs1550_dentry
+{
+	char path[DENTRY_PATH];
+	int kind;
+	int dirSlot;		//the directory's slot in the root
+	int slot;			//the file's slot in the directory
+};
+
+static struct cs1550_dentry dentries[DENTRY_SLOTS];
+static pthread_mutex_t dentryLock = PTHREAD_MUTEX_INITIALIZER;
+
+//function to find what a parsed path names, going through the dentry cache
+//returns DENTRY_DIR or DENTRY_FILE with the slots filled in, DENTRY_NONE when
+//there's no such directory or file, or -EIO
+static int resolve_path(const char *path, const char *directory, const char *filename, const char *extension, int *dirSlot, int *slot){
+
+	const struct cs1550_root_directory *root;
+	const struct cs1550_directory_entry *dirEntry;
+	struct cs1550_dentry *e = NULL;
+	size_t len = strlen(path);
+	int kind, i, j = -1;
+
+	if(len < DENTRY_PATH)
+	{
+		e = &dentries[name_hash(path, len) % DENTRY_SLOTS];
+		pthread_mutex_lock(&dentryLock);
+		if(e->kind != DENTRY_EMPTY && strcmp(e->path, path) == 0)
+		{
+			kind = e->kind;
+			*dirSlot = e->dirSlot;
+			*slot = e->slot;
+			pthread_mutex_unlock(&dentryLock);
+			return kind;
+		}
+		pthread_mutex_unlock(&dentryLock);
+	}
+
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	i = root_lookup(root, directory);
+	if(i < 0)
+	{
+		kind = DENTRY_NONE;
+	}
+	else if(filename[0] == '\0')
+	{
+		kind = DENTRY_DIR;
+	}
+	else
+	{
+		dirEntry = load_dirEntry(root->directories[i].nStartBlock);
+		if(dirEntry == NULL)
+		{
+			return -EIO;
+		}
+		j = dir_lookup(root->directories[i].nStartBlock, dirEntry, filename, extension);
+		kind = j >= 0 ? DENTRY_FILE : DENTRY_NONE;
+	}
+
+	if(e != NULL)
+	{
+		pthread_mutex_lock(&dentryLock);
+		memcpy(e->path, path, len + 1);
+		e->kind = kind;
+		e->dirSlot = i;
+		e->slot = j;
+		pthread_mutex_unlock(&dentryLock);
+	}
+	*dirSlot = i;
+	*slot = j;
+	return kind;
+}
+
+//function to forget the cached lookup of a path, and with children set of
+//everything under it too
+static void dentry_forget(const char *path, int children){
+
+	size_t len = strlen(path);
+	int k;
+
+	pthread_mutex_lock(&dentryLock);
+	if(!children && len < DENTRY_PATH)
+	{
+		dentries[name_hash(path, len) % DENTRY_SLOTS].kind = DENTRY_EMPTY;
+	}
+	for(k = 0; children && k < DENTRY_SLOTS; k++)
+	{
+		if(dentries[k].kind != DENTRY_EMPTY && strncmp(dentries[k].path, path, len) == 0 &&
+			(dentries[k].path[len] == '\0' || dentries[k].path[len] == '/'))
+		{
+			dentries[k].kind = DENTRY_EMPTY;
+		}
+	}
+	pthread_mutex_unlock(&dentryLock);
+}
+
+//function to forget the cached lookup of a directory, or with filename set
+//of a file in it, for changes that know it by name rather than by path
+static void dentry_forget_name(const char *directory, const char *filename, const char *extension, int children){
+
+	char path[DENTRY_PATH];
+
+	if(filename == NULL)
+	{
+		snprintf(path, sizeof(path), "/%s", directory);
+	}
+	else
+	{
+		snprintf(path, sizeof(path), "/%s/%s.%s", directory, filename, extension);
+	}
+	dentry_forget(path, children);
+}
+
+//A file that's open. open looks the path up once and keeps where the file's
+//entry is, and its block index, in one of these in fi->fh, so reads and
+//writes through it go straight to them. Directory blocks stay resident for
+//the whole mount, so the entry pointer is good for as long as the file is
+//there. Holding the index keeps it from being thrown away; it's swapped for
+//a new one if it gets dropped (when the file's blocks change under it).
+//Every open file is on a list, so unlink can tell whether a file is open and
+//fix the slot of one whose entry it moves
+struct cs1550_open_file
+{
+	long dirBlock;			//the directory block holding the entry
+	struct cs1550_directory_entry *dirEntry;	//its resident copy
+	int slot;				//the entry's slot in it, only changed under the directory's write lock
+	struct cs1550_block_index *idx;
+	int dirty;				//written through since the last flush
+	pthread_mutex_t lock;	//guards swapping idx, which readers sharing the file's lock may race to do
+	struct cs1550_open_file *prev, *next;
+};
+
+static struct cs1550_open_file *openFiles = NULL;
+//guards the list
+static pthread_mutex_t openLock = PTHREAD_MUTEX_INITIALIZER;
+
+//function to get the open file a handler was passed, if there is one
+static struct cs1550_open_file *open_file_get(struct fuse_file_info *fi){
+	return fi != NULL ? (struct cs1550_open_file *)(uintptr_t)fi->fh : NULL;
+}
+
+//function to get the block index of an open file, getting a new one if the
+//one it had was dropped or the file has moved to another start block
+//returns NULL if it can't be built
+static struct cs1550_block_index *open_file_index(struct cs1550_open_file *of){
+
+	long nStartBlock = of->dirEntry->files[of->slot].nStartBlock;
+	struct cs1550_block_index *idx;
+
+	pthread_mutex_lock(&of->lock);
+	if(of->idx != NULL && (of->idx->dead || of->idx->nStartBlock != nStartBlock))
+	{
+		index_put(of->idx);
+		of->idx = NULL;
+	}
+	if(of->idx == NULL)
+	{
+		of->idx = index_get(nStartBlock);
+	}
+	idx = of->idx;
+	pthread_mutex_unlock(&of->lock);
+	return idx;
+}
+
+//function to read size bytes at offset from a file of fsize bytes whose
+//block index is idx, reading ahead if it's being read straight through
+//returns how many bytes were read
+static int file_read(struct cs1550_block_index *idx, size_t fsize, char *buf, size_t size, off_t offset){
+
+	int res;
+
+	//a file small enough to be in its inode has nothing to read ahead
+	if(idx->inlined)
+	{
+		return inline_read(idx->nStartBlock, fsize, buf, size, offset);
+	}
+	if(idx->legacy)
+	{
+		res = legacy_read(idx, fsize, buf, size, offset);
+	}
+	else
+	{
+		res = extent_read(idx, fsize, buf, size, offset);
+	}
+
+	//get the blocks after these into the cache if the file is being read in order
+	if(res > 0)
+	{
+		readahead(idx, offset, res, fsize, idx->legacy ? MAX_DATA_IN_BLOCK : blockSize);
+	}
+	return res;
+}
+
+//function to write size bytes at offset into the file in slot j of the
+//resident directory block dirEntry (stored at dirBlock). legacy says whether
+//the file is still a version 1 chain, which is moved onto an inode first
+//returns how many bytes were written
+static int file_write(long dirBlock, struct cs1550_directory_entry *dirEntry, int j, int legacy, const char *buf, size_t size, off_t offset){
+
+	struct cs1550_file_directory file = dirEntry->files[j];
+	size_t fsize;
+	int res, changed = 0;
+
+	//a version 1 file is moved onto an inode the first time it's written
+	if(legacy)
+	{
+		res = migrate_file(&file);
+		if(res < 0)
+		{
+			return res;
+		}
+		changed = 1;
+	}
+
+	//write the data. An inline file takes it in its inode. Otherwise
+	//appends collect in the file's delayed allocation buffer and
+	//overwrites in the block cache, so small writes only cost a copy and
+	//go to disk later in whole blocks
+	fsize = file.fsize;
+	res = inline_write(file.nStartBlock, &fsize, buf, size, offset);
+	if(fsize != file.fsize)
+	{
+		file.fsize = fsize;
+		changed = 1;
+	}
+
+	//the directory block only needs writing when the entry changed. The
+	//name is left alone, since readdir may be reading it, and so is the
+	//start block (readdir's inode number) unless the file was moved
+	if(changed)
+	{
+		dirEntry->files[j].fsize = file.fsize;
+		if(dirEntry->files[j].nStartBlock != file.nStartBlock)
+		{
+			dirEntry->files[j].nStartBlock = file.nStartBlock;
+		}
+		write_dirEntry(dirEntry, dirBlock);
+	}
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+//function to free a bufvec made by file_read_buf along with its memory pieces
+static void bufvec_free(struct fuse_bufvec *bufv){
+
+	size_t i;
+
+	for(i = 0; i < bufv->count; i++)
+	{
+		if(!(bufv->buf[i].flags & FUSE_BUF_IS_FD))
+		{
+			free(bufv->buf[i].mem);
+		}
+	}
+	free(bufv);
+}
+
+//function to describe size bytes at offset of a file that has an inode as
+//pieces for libfuse to copy out itself. Blocks whose latest copy is in the
+//image are handed over as ranges of the image, which libfuse can splice
+//straight to the kernel, and are pinned for the open file owner; holes,
+//appends still waiting for blocks and blocks the cache has newer copies of
+//are read into memory pieces
+//returns 0 with the pieces in *bufp (each memory piece malloc'd, as libfuse
+//frees them), or -errno
+static int file_read_buf(const void *owner, struct cs1550_block_index *idx, size_t fsize, struct fuse_bufvec **bufp, size_t size, off_t offset){
+
+	struct fuse_bufvec *bufv, *grown;
+	struct fuse_buf *b;
+	struct cs1550_run r;
+	size_t done = 0, len, within, nAlloc = 4;
+	long logical, phys, run, next, wanted, k;
+	int res = 0;
+
+	if((size_t)offset >= fsize)
+	{
+		size = 0;
+	}
+	else if(size > fsize - offset)
+	{
+		size = fsize - offset;
+	}
+	bufv = calloc(1, sizeof(struct fuse_bufvec) + (nAlloc - 1)*sizeof(struct fuse_buf));
+	if(bufv == NULL)
+	{
+		return -ENOMEM;
+	}
+
+	while(done < size)
+	{
+		if(bufv->count == nAlloc)
+		{
+			grown = realloc(bufv, sizeof(struct fuse_bufvec) + (2*nAlloc - 1)*sizeof(struct fuse_buf));
+			if(grown == NULL)
+			{
+				res = -ENOMEM;
+				break;
+			}
+			bufv = grown;
+			nAlloc *= 2;
+		}
+		b = &bufv->buf[bufv->count];
+		memset(b, 0, sizeof(*b));
+		logical = (offset + done) / blockSize;
+		within = (offset + done) % blockSize;
+
+		phys = index_map(idx, logical, &run);
+		if(phys > 0 && index_compressed(idx, logical, &r))
+		{
+			//a compressed run is decompressed into memory
+			len = run*blockSize - within;
+		}
+		else if(phys > 0)
+		{
+			//as much of this run as is wanted and up to date in the image
+			wanted = (within + (size - done) + blockSize - 1) / blockSize;
+			for(k = 0; k < run && k < wanted && !cache_dirty(phys + k); k++)
+			{
+			}
+			//with nothing to pin them they're read into memory after all
+			if(k > 0)
+			{
+				pthread_mutex_lock(&pinLock);
+				if(pin_add(owner, phys, k) != 0)
+				{
+					k = 0;
+				}
+				pthread_mutex_unlock(&pinLock);
+				pinsHere = 1;
+			}
+			if(k > 0)
+			{
+				len = k*blockSize - within;
+				if(len > size - done)
+				{
+					len = size - done;
+				}
+				b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				b->fd = diskFd;
+				b->pos = (off_t)phys*blockSize + within;
+				b->size = len;
+				STAT_ADD(statDiskReads, 1);
+				STAT_ADD(statDiskBytesRead, len);
+				bufv->count++;
+				done += len;
+				continue;
+			}
+			//the cache has this block's latest copy
+			len = blockSize - within;
+		}
+		else
+		{
+			//a hole or appended data, up to the next block on disk
+			len = size - done;
+			next = index_next(idx, logical);
+			if(next >= 0 && (size_t)((off_t)next*blockSize - (offset + done)) < len)
+			{
+				len = (off_t)next*blockSize - (offset + done);
+			}
+		}
+		if(len > size - done)
+		{
+			len = size - done;
+		}
+		b->mem = malloc(len);
+		if(b->mem == NULL)
+		{
+			res = -ENOMEM;
+			break;
+		}
+		res = extent_read(idx, fsize, b->mem, len, offset + done);
+		if(res < 0)
+		{
+			free(b->mem);
+			break;
+		}
+		res = 0;
+		b->size = len;
+		bufv->count++;
+		done += len;
+	}
+	if(res != 0)
+	{
+		bufvec_free(bufv);
+		return res;
+	}
+
+	//an empty read is still one piece, of nothing
+	if(bufv->count == 0)
+	{
+		bufv->count = 1;
+	}
+	*bufp = bufv;
+	return 0;
+}
+
+//function to write buf (of size bytes) at offset straight into the image,
+//for an overwrite of whole blocks of a file that has an inode that all lie
+//in one run on disk. The cached copies of those blocks are dropped first,
+//since every byte of them is being replaced. Writes ending at the end of
+//the file may end part way into a block, as long as the cache has no
+//changes to the rest of it
+//returns how many bytes were written, 0 if the write isn't one of those, or
+//-errno
+static int file_write_buf(struct cs1550_block_index *idx, size_t fsize, struct fuse_bufvec *buf, size_t size, off_t offset){
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	struct cs1550_run r;
+	long logical, phys, run, nBlocks, k;
+	ssize_t res;
+
+	if(idx->legacy || idx->inlined || size == 0 || offset % blockSize != 0 || offset + size > fsize ||
+		(size % blockSize != 0 && offset + size != fsize))
+	{
+		return 0;
+	}
+	logical = offset / blockSize;
+	nBlocks = (size + blockSize - 1) / blockSize;
+	phys = index_map(idx, logical, &run);
+	if(phys <= 0 || run < nBlocks || index_compressed(idx, logical, &r) || dedup_private(phys, nBlocks) < nBlocks)
+	{
+		return 0;
+	}
+	if(size % blockSize != 0 && cache_dirty(phys + nBlocks - 1))
+	{
+		return 0;
+	}
+	for(k = 0; k < nBlocks; k++)
+	{
+		cache_drop(phys + k);
+	}
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = diskFd;
+	dst.buf[0].pos = (off_t)phys*blockSize;
+	res = fuse_buf_copy(&dst, buf, 0);
+	if(res > 0)
+	{
+		STAT_ADD(statDiskWrites, 1);
+		STAT_ADD(statDiskBytesWritten, res);
+	}
+	return res;
+}
+#endif
+
+//function to make the file in slot j of the resident directory block
+//dirEntry (stored at dirBlock) size bytes long. Growing it leaves a hole
+//past the old end; shrinking it gives back the blocks past the new one
+static int file_truncate(long dirBlock, struct cs1550_directory_entry *dirEntry, int j, int legacy, off_t size){
+
+	struct cs1550_file_directory file = dirEntry->files[j];
+	struct cs1550_block_index *idx;
+	struct cs1550_inode *inode;
+	int res = 0;
+
+	if(size < 0)
+	{
+		return -EINVAL;
+	}
+	if((size_t)size == file.fsize)
+	{
+		return 0;
+	}
+
+	//a version 1 chain has no way to hold a hole, so it's moved onto an inode
+	if(legacy)
+	{
+		res = migrate_file(&file);
+		if(res < 0)
+		{
+			return res;
+		}
+		res = 0;
+	}
+
+	inode = load_inode(file.nStartBlock);
+	if(inode == NULL)
+	{
+		return -EIO;
+	}
+	if((inode->nFlags & INODE_INLINE) && (size_t)size <= inline_max())
+	{
+		//an inline file that still fits only has to keep what's past its end zero
+		if((size_t)size < file.fsize)
+		{
+			memset(inline_data(inode) + size, 0, file.fsize - size);
+			write_inode(inode, file.nStartBlock);
+		}
+	}
+	else if(inode->nFlags & INODE_INLINE)
+	{
+		//growing past the inode: its bytes go out to a block, and the rest is a hole
+		res = inline_spill(file.nStartBlock, file.fsize);
+	}
+	else if((size_t)size > file.fsize)
+	{
+		//what's past the old end in its last block has to read as zeros now
+		idx = index_get(file.nStartBlock);
+		if(idx == NULL)
+		{
+			res = -EIO;
+		}
+		else
+		{
+			res = extent_zero_tail(idx, file.fsize, size);
+			index_put(idx);
+		}
+	}
+	else
+	{
+		//the tail of the new last block is zeroed if the file grows again
+		delalloc_trim(file.nStartBlock, size);
+		inode_truncate(file.nStartBlock, (size + blockSize - 1) / blockSize);
+		index_drop(file.nStartBlock);
+	}
+	if(res == 0)
+	{
+		file.fsize = size;
+	}
+
+	dirEntry->files[j].fsize = file.fsize;
+	if(dirEntry->files[j].nStartBlock != file.nStartBlock)
+	{
+		dirEntry->files[j].nStartBlock = file.nStartBlock;
+	}
+	write_dirEntry(dirEntry, dirBlock);
+	return res;
+}
+
+//function to read size bytes at offset from an open file
+//returns how many bytes were read, or -EIO
+static int open_file_read(struct cs1550_open_file *of, char *buf, size_t size, off_t offset){
+
+	struct cs1550_file_directory file = of->dirEntry->files[of->slot];
+	struct cs1550_block_index *idx;
+
+	if(offset>=file.fsize)
+	{
+		return 0;
+	}
+	idx = open_file_index(of);
+	if(idx == NULL)
+	{
+		return -EIO;
+	}
+	return file_read(idx, file.fsize, buf, size, offset);
+}
+
+//function to write size bytes at offset to an open file
+//returns how many bytes were written, or a negative error
+static int open_file_write(struct cs1550_open_file *of, const char *buf, size_t size, off_t offset){
+
+	struct cs1550_block_index *idx = open_file_index(of);
+	int res;
+
+	if(idx == NULL)
+	{
+		return -EIO;
+	}
+	res = file_write(of->dirBlock, of->dirEntry, of->slot, idx->legacy, buf, size, offset);
+	if(res > 0)
+	{
+		__atomic_store_n(&of->dirty, 1, __ATOMIC_RELAXED);
+	}
+	return res;
+}
+
+#if FUSE_VERSION >= 29
+//function to write what's in buf at offset to an open file, straight from
+//libfuse's buffer where it can be
+//returns how many bytes were written, 0 if none could be written that way,
+//or a negative error
+static int open_file_write_buf(struct cs1550_open_file *of, struct fuse_bufvec *buf, size_t size, off_t offset){
+
+	struct cs1550_block_index *idx = open_file_index(of);
+	int res;
+
+	if(idx == NULL)
+	{
+		return -EIO;
+	}
+	res = file_write_buf(idx, of->dirEntry->files[of->slot].fsize, buf, size, offset);
+	if(res > 0)
+	{
+		__atomic_store_n(&of->dirty, 1, __ATOMIC_RELAXED);
+	}
+	return res;
+}
+#endif
+
+//function to make an open file size bytes long
+static int open_file_truncate(struct cs1550_open_file *of, off_t size){
+
+	struct cs1550_block_index *idx = open_file_index(of);
+	int res;
+
+	if(idx == NULL)
+	{
+		return -EIO;
+	}
+	res = file_truncate(of->dirBlock, of->dirEntry, of->slot, idx->legacy, size);
+	if(res == 0)
+	{
+		__atomic_store_n(&of->dirty, 1, __ATOMIC_RELAXED);
+	}
+	return res;
+}
+
+//function to write everything back: buffered appends and cached data first,
+//so the sizes in the directory blocks never get to disk ahead of the data
+//they cover. Called with the root locked for writing, so no handler is
+//halfway through a change
+static int writeback_locked(){
+
+	int res = delalloc_commit_all();
+
+	if(cache_flush() != 0)
+	{
+		res = -EIO;
+	}
+	if(meta_commit() != 0)
+	{
+		res = -EIO;
+	}
+	return res;
+}
+
+//function to write everything back, taking the root lock for writing.
+//Callers mustn't hold any of the namespace locks
+static int writeback_all(){
+
+	int res;
+
+	pthread_rwlock_wrlock(&rootLock);
+	res = writeback_locked();
+	pthread_rwlock_unlock(&rootLock);
+	return res;
+}
+
+//function to tell whether the metadata changed since the last write back
+//fills half the journal or more
+static int meta_journal_filling(){
+
+	long dirty;
+
+	if(!metaJournaled)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&metaLock);
+	dirty = metaDirtyBlocks;
+	pthread_mutex_unlock(&metaLock);
+	return dirty >= header->nJournalBlocks / 2;
+}
+
+//function called by handlers that change metadata before they take any
+//lock. While the changes so far fill half the journal nothing may add to
+//them, and the first one here writes them back, so those already running
+//have the other half to finish in
+static void meta_journal_wait(){
+
+	if(!meta_journal_filling())
+	{
+		return;
+	}
+	pthread_rwlock_wrlock(&rootLock);
+	//another handler may have written them back while this one waited
+	if(meta_journal_filling())
+	{
+		writeback_locked();
+	}
+	pthread_rwlock_unlock(&rootLock);
+}
+
+//function called by handlers that change metadata, once they've let go of
+//their locks. Writes everything back if it has been a while since the last
+//time, or if the changes are filling up half the journal
+static void meta_maybe_writeback(){
+
+	time_t last;
+
+	pthread_mutex_lock(&metaLock);
+	last = metaLastWriteback;
+	pthread_mutex_unlock(&metaLock);
+	if(time(NULL) - last >= options.writeback || meta_journal_filling())
+	{
+		writeback_all();
+	}
+}
+
+//Deleting a file only takes its entry out of its directory. Its blocks are
+//handed to a reclaimer thread that frees them a batch at a time in the
+//background, so unlinking a huge file (or a long version 1 chain, which has
+//to be read to be followed) takes as little time as unlinking an empty one.
+//Before it frees anything the reclaimer writes everything back, so the
+//entries that pointed at the blocks are gone from the image before the
+//blocks can be handed to anything else. A crash in between leaks them rather
+//than leaving two files sharing them.
+enum { RECLAIM_FILE, RECLAIM_CHAIN, RECLAIM_INODE, RECLAIM_BLOCK };
+
+struct cs1550_reclaim
+{
+	long nBlock;	//the next block to free, along with whatever it leads to
+	int kind;		//RECLAIM_FILE until it's known whether that's an inode or a chain
+	long nHops;		//chain blocks followed, which can't be more than the disk has
+	struct cs1550_reclaim *next;
+};
+
+//most blocks freed before the root lock is let go, so handlers and write backs get a turn
+#define RECLAIM_BATCH 256
+//how long deletes may collect before the reclaimer starts on them, so a burst of them shares one write back
+#define RECLAIM_DELAY_MS 100
+
+static struct cs1550_reclaim *reclaimQueue = NULL;
+static int reclaimStop = 0, reclaimRunning = 0;
+static pthread_t reclaimThread;
+//guards the queue and reclaimStop
+static pthread_mutex_t reclaimLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaimCond = PTHREAD_COND_INITIALIZER;
 
-//size of a disk block
-#define	BLOCK_SIZE 512
+//function to hand the reclaimer a deleted file's start block or a deleted
+//directory's block. Nothing can reach it any more once the caller is done
+//returns 0 or -ENOMEM
+static int reclaim_queue(long nBlock, int kind){
 
-//we'll use 8.3 filenames
-#define	MAX_FILENAME 8
-#define	MAX_EXTENSION 3
+	struct cs1550_reclaim *r = calloc(1, sizeof(struct cs1550_reclaim));
+
+	if(r == NULL)
+	{
+		return -ENOMEM;
+	}
+	r->nBlock = nBlock;
+	r->kind = kind;
+	pthread_mutex_lock(&reclaimLock);
+	r->next = reclaimQueue;
+	reclaimQueue = r;
+	pthread_cond_signal(&reclaimCond);
+	pthread_mutex_unlock(&reclaimLock);
+	return 0;
+}
+
+//function to free the next batch of what r holds, moving r on to the rest.
+//Called with the root lock held for reading
+//returns 1 once there's nothing left of it
+static int reclaim_step(struct cs1550_reclaim *r){
+
+	cs1550_disk_block block;
+	struct cs1550_inode *inode;
+	long next, freed = 0;
+	int k;
+
+	if(r->kind == RECLAIM_FILE)
+	{
+		k = is_inode(r->nBlock);
+		if(k < 0)
+		{
+			return 1;
+		}
+		r->kind = k ? RECLAIM_INODE : RECLAIM_CHAIN;
+	}
+
+	if(r->kind == RECLAIM_BLOCK)
+	{
+		meta_remove(r->nBlock);
+		free_block(r->nBlock);
+		return 1;
+	}
+	if(r->kind == RECLAIM_INODE)
+	{
+		//one inode's worth of extents, each freed as a run
+		inode = load_inode(r->nBlock);
+		if(inode == NULL)
+		{
+			return 1;
+		}
+		for(k = 0; k < inode->nExtents; k++)
+		{
+			extent_free(&inode->extents[k]);
+		}
+		next = inode->nNextInode;
+		meta_remove(r->nBlock);
+		free_block(r->nBlock);
+		r->nBlock = next;
+		return next == 0;
+	}
+	while(r->nBlock != 0 && freed < RECLAIM_BATCH && r->nHops++ < header->nBlocks)
+	{
+		block = read_block(r->nBlock);
+		free_block(r->nBlock);
+		r->nBlock = block.nNextBlock;
+		freed++;
+	}
+	return r->nBlock == 0 || r->nHops >= header->nBlocks;
+}
+
+//function to free everything on a list taken off the queue
+static void reclaim_run(struct cs1550_reclaim *list){
+
+	struct cs1550_reclaim *r;
+	int done;
+
+	//the entries that pointed at these have to be gone from the image first
+	writeback_all();
+	while((r = list) != NULL)
+	{
+		meta_journal_wait();
+		pthread_rwlock_rdlock(&rootLock);
+		done = header == NULL || reclaim_step(r);
+		pthread_rwlock_unlock(&rootLock);
+		if(done)
+		{
+			list = r->next;
+			free(r);
+		}
+	}
+}
 
-//How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+//function run by the reclaimer thread. It empties the queue before it stops
+static void *reclaim_main(void *arg){
 
-//The attribute packed means to not align these things
+	struct cs1550_reclaim *list;
+	struct timespec deadline;
 
-struct cs1550_directory_entry
-{
-	int nFiles;	//How many files are in this directory.
-				//Needs to be less than MAX_FILES_IN_DIR
+	(void) arg;
 
-	struct cs1550_file_directory
+	pthread_mutex_lock(&reclaimLock);
+	for(;;)
 	{
-		char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
-		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
-		size_t fsize;					//file size
-		long nStartBlock;				//where the first block is on disk
-	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
+		if(reclaimQueue == NULL)
+		{
+			if(reclaimStop)
+			{
+				break;
+			}
+			pthread_cond_wait(&reclaimCond, &reclaimLock);
+			continue;
+		}
 
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
-} ;
+		//give any deletes that follow this one a moment to join it
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += RECLAIM_DELAY_MS*1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		while(!reclaimStop && pthread_cond_timedwait(&reclaimCond, &reclaimLock, &deadline) != ETIMEDOUT)
+		{
+		}
 
-typedef struct cs1550_root_directory cs1550_root_directory;
+		list = reclaimQueue;
+		reclaimQueue = NULL;
+		pthread_mutex_unlock(&reclaimLock);
+		reclaim_run(list);
+		pthread_mutex_lock(&reclaimLock);
+	}
+	pthread_mutex_unlock(&reclaimLock);
+	return NULL;
+}
 
-#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+//function to start the reclaimer (at mount)
+static void reclaim_start(){
 
-struct cs1550_root_directory
-{
-	int nDirectories;	//How many subdirectories are in the root
-						//Needs to be less than MAX_DIRS_IN_ROOT
-	struct cs1550_directory
+	reclaimStop = 0;
+	reclaimRunning = pthread_create(&reclaimThread, NULL, reclaim_main, NULL) == 0;
+	if(!reclaimRunning)
 	{
-		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
-		long nStartBlock;				//where the directory block is on disk
-	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
+		fprintf(stderr, "cs1550: cannot start the reclaimer, deleted files are freed at unmount\n");
+	}
+}
 
-	//This is some space to get this to be exactly the size of the disk block.
-	//Don't use it for anything.  
-	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
-} ;
+//function to stop the reclaimer once it has freed everything it was given
+//(at unmount). Callers mustn't hold any of the namespace locks
+static void reclaim_stop(){
 
+	struct cs1550_reclaim *list;
 
-typedef struct cs1550_directory_entry cs1550_directory_entry;
+	if(reclaimRunning)
+	{
+		pthread_mutex_lock(&reclaimLock);
+		reclaimStop = 1;
+		pthread_cond_signal(&reclaimCond);
+		pthread_mutex_unlock(&reclaimLock);
+		pthread_join(reclaimThread, NULL);
+		reclaimRunning = 0;
+	}
 
-//How much data can one block hold?
-#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE - sizeof(long))
+	//whatever there was if the thread never started
+	pthread_mutex_lock(&reclaimLock);
+	list = reclaimQueue;
+	reclaimQueue = NULL;
+	pthread_mutex_unlock(&reclaimLock);
+	if(list != NULL)
+	{
+		reclaim_run(list);
+	}
+}
 
-struct cs1550_disk_block
-{
-	//The next disk block, if needed. This is the next pointer in the linked 
-	//allocation list
-	long nNextBlock;
+//most bytes /.stats can come to
+#define STATS_SIZE 8192
 
-	//And all the rest of the space in the block can be used for actual data
-	//storage.
-	char data[MAX_DATA_IN_BLOCK];
-};
+//function to write the contents of /.stats into buf, one "name value" line
+//per counter. Called with the root lock held, which keeps the journal counts
+//still. Trailing empty histogram buckets are left off
+//returns the length
+static int stats_render(char *buf){
 
-typedef struct cs1550_disk_block cs1550_disk_block;
+	int len = 0, op, k, last;
+	unsigned long hits, misses, evictions, ahead;
+	unsigned long compressIn = STAT_GET(statCompressIn), compressOut = STAT_GET(statCompressOut), compressUs = STAT_GET(statCompressUs);
+	unsigned long decompressBytes = STAT_GET(statDecompressBytes), decompressUs = STAT_GET(statDecompressUs);
+	unsigned long dedupLookups = STAT_GET(statDedupLookups), dedupHits = STAT_GET(statDedupHits);
+	long entries, shared, buckets;
 
-//create a file allocation table that accounts for 1048576(5 mebibytes) / 512(bytes per block) = 2048 blocks of data needed to be accounted for
-//we can account for 2048 blocks of data represented in 512 bytes, by making each entry only 2 bits long (infeaseable) or using 4 blocks with char entries. (1 byte entry that represents each block)
-struct cs1550_allocation_table{
-	//0 is unallocated
-	//1 is allocated
-	char blocks[2048];
-};
-typedef struct cs1550_allocation_table cs1550_allocation_table;
-//function to read from the root on disk (block 0)
-//This returns a copy of the root directory struct for functions to reference
-static cs1550_root_directory read_root(){
-	cs1550_root_directory root;
+	len += sprintf(buf + len, "# <op>.hist: calls under 1, 2, 4, 8 ... microseconds\n");
+	for(op = 0; op < STAT_OPS; op++)
+	{
+		len += sprintf(buf + len, "%s.calls %lu\n", statNames[op], STAT_GET(opStats[op].calls));
+		len += sprintf(buf + len, "%s.errors %lu\n", statNames[op], STAT_GET(opStats[op].errors));
+		len += sprintf(buf + len, "%s.total_us %lu\n", statNames[op], STAT_GET(opStats[op].totalUs));
+		len += sprintf(buf + len, "%s.hist", statNames[op]);
+		for(last = STATS_BUCKETS - 1; last > 0 && STAT_GET(opStats[op].buckets[last]) == 0; last--)
+		{
+		}
+		for(k = 0; k <= last; k++)
+		{
+			len += sprintf(buf + len, " %lu", STAT_GET(opStats[op].buckets[k]));
+		}
+		len += sprintf(buf + len, "\n");
+	}
 
-	FILE* disk = fopen(".disk", "r+b");
-	fseek(disk, 0, SEEK_SET);
+	pthread_mutex_lock(&cacheLock);
+	hits = cacheHits;
+	misses = cacheMisses;
+	evictions = cacheEvictions;
+	ahead = cacheReadahead;
+	pthread_mutex_unlock(&cacheLock);
+
+	pthread_mutex_lock(&dedupLock);
+	entries = dedupEntries;
+	shared = dedupShared;
+	buckets = dedupBuckets;
+	pthread_mutex_unlock(&dedupLock);
+
+	len += sprintf(buf + len, "bytes_read %lu\n", STAT_GET(statBytesRead));
+	len += sprintf(buf + len, "bytes_written %lu\n", STAT_GET(statBytesWritten));
+	len += sprintf(buf + len, "blocks_allocated %lu\n", STAT_GET(statBlocksAllocated));
+	len += sprintf(buf + len, "blocks_freed %lu\n", STAT_GET(statBlocksFreed));
+	len += sprintf(buf + len, "disk.reads %lu\n", STAT_GET(statDiskReads));
+	len += sprintf(buf + len, "disk.writes %lu\n", STAT_GET(statDiskWrites));
+	len += sprintf(buf + len, "disk.bytes_read %lu\n", STAT_GET(statDiskBytesRead));
+	len += sprintf(buf + len, "disk.bytes_written %lu\n", STAT_GET(statDiskBytesWritten));
+	len += sprintf(buf + len, "cache.hits %lu\n", hits);
+	len += sprintf(buf + len, "cache.misses %lu\n", misses);
+	len += sprintf(buf + len, "cache.evictions %lu\n", evictions);
+	len += sprintf(buf + len, "cache.read_ahead %lu\n", ahead);
+	//what -o compress was given against what it stored, and how fast the
+	//codec went each way in MB/s (bytes per microsecond)
+	len += sprintf(buf + len, "compress.bytes_in %lu\n", compressIn);
+	len += sprintf(buf + len, "compress.bytes_out %lu\n", compressOut);
+	len += sprintf(buf + len, "compress.ratio %.2f\n", compressOut > 0 ? (double)compressIn / compressOut : 0.0);
+	len += sprintf(buf + len, "compress.mb_per_s %.1f\n", compressUs > 0 ? (double)compressIn / compressUs : 0.0);
+	len += sprintf(buf + len, "decompress.bytes %lu\n", decompressBytes);
+	len += sprintf(buf + len, "decompress.mb_per_s %.1f\n", decompressUs > 0 ? (double)decompressBytes / decompressUs : 0.0);
+	//blocks -o dedup looked for by their contents and found, how many blocks
+	//are shared now, and what the entries for those and the hashed ones take
+	len += sprintf(buf + len, "dedup.lookups %lu\n", dedupLookups);
+	len += sprintf(buf + len, "dedup.hits %lu\n", dedupHits);
+	len += sprintf(buf + len, "dedup.hit_rate %.3f\n", dedupLookups > 0 ? (double)dedupHits / dedupLookups : 0.0);
+	len += sprintf(buf + len, "dedup.shared_blocks %ld\n", shared);
+	len += sprintf(buf + len, "dedup.index_entries %ld\n", entries);
+	len += sprintf(buf + len, "dedup.index_bytes %lu\n", entries*sizeof(struct cs1550_dedup) + 2*buckets*sizeof(struct cs1550_dedup *));
+	len += sprintf(buf + len, "journal.transactions %ld\n", journalCommits);
+	len += sprintf(buf + len, "journal.blocks %ld\n", journalBlocks);
+	return len;
+}
 
-	fread(&root, BLOCK_SIZE, 1, disk);
+//The namespace changes, and opening a file, work on the slots a lookup found
+//rather than on a path, so the low-level front end can call them with what it
+//knows about an inode. They expect the locks the handlers that call them take
 
-	fclose(disk);
-	return root;
-}
+//function to make a directory called directory in the root
+//returns 0 or a negative error
+static int dir_make(const char *directory){
 
-//function to write a new root struct to the root on disk (block 0)
-static void write_root(struct cs1550_root_directory *root){
+	long j;
+	struct cs1550_directory dir;
+	struct cs1550_directory_entry *dirEntry;
+	struct cs1550_root_directory *root;
 
-	FILE* disk = fopen(".disk", "r+b");
-	fseek(disk, 0, SEEK_SET);
+	//the stats file already has this name
+	if(strcmp(directory, STATS_PATH + 1) == 0)
+	{
+		return -EEXIST;
+	}
 
-	fwrite(root, BLOCK_SIZE, 1, disk);
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
 
-	fclose(disk);
-}
-//function to read from the file allocation table on disk (block 1-4)
-static cs1550_allocation_table read_allTable(){
+	if(root->nDirectories >= MAX_DIRS_IN_ROOT)
+	{
+		//no more directories can be added at this time due to space constraints
+		return -EPERM;
+	}
+	//search through all of the directories to see if one by that name already exists
+	if(root_lookup(root, directory) >= 0)
+	{
+		return -EEXIST;
+	}
 
-	cs1550_allocation_table allTable;
+	//find a block to put the new directory using the FAT
+	j = alloc_block();
+	if(j < 0)
+	{
+		//no room on disk
+		return j;
+	}
+
+	//fill dir struct with info provided by user
+	strcpy(dir.dname, directory);
+	dir.nStartBlock = j;
+
+	//put a new directory struct at j (the offset into disk that we found)
+	dirEntry = meta_new(dir.nStartBlock);
+	if(dirEntry == NULL)
+	{
+		free_block(j);
+		return -ENOMEM;
+	}
+	name_index_drop(dir.nStartBlock);
+	write_dirEntry(dirEntry, dir.nStartBlock);
 
-	FILE* disk = fopen(".disk", "r+b");
-	fseek(disk, BLOCK_SIZE, SEEK_SET);
+	//add the directory to the root array of directories
+	root->directories[root->nDirectories] = dir;
 
-	fread(&allTable, BLOCK_SIZE*4, 1, disk);
+	//update number of directories in root
+	root->nDirectories+=1;
+	name_added(0, root, root->nDirectories, root->nDirectories - 1);
+	//lookups of the new directory, or of anything in it, were cached as missing
+	dentry_forget_name(directory, NULL, NULL, 1);
 
-	fclose(disk);
-	return allTable;
+	//write out the new root to save changes
+	write_root(root);
+	return 0;
 }
-//function to write to the file allocation table on disk (block 1-4)
-static void write_allTable(struct cs1550_allocation_table *allTable){
 
+//function to remove the directory in slot i of the root, which has to be
+//empty. The last directory in the root moves into its slot, and its block
+//goes to the reclaimer
+//returns 0 or a negative error
+static int dir_remove(int i){
 
-	FILE* disk = fopen(".disk", "r+b");
-	fseek(disk, BLOCK_SIZE, SEEK_SET);
+	int last;
+	long dirBlock;
+	struct cs1550_root_directory *root;
+	const struct cs1550_directory_entry *dirEntry;
+
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	dirBlock = root->directories[i].nStartBlock;
+	dirEntry = load_dirEntry(dirBlock);
+	if(dirEntry == NULL)
+	{
+		return -EIO;
+	}
+	if(dirEntry->nFiles > 0)
+	{
+		return -ENOTEMPTY;
+	}
+	if(reclaim_queue(dirBlock, RECLAIM_BLOCK) != 0)
+	{
+		return -ENOMEM;
+	}
+	dentry_forget_name(root->directories[i].dname, NULL, NULL, 1);
 
-	fwrite(allTable, BLOCK_SIZE*4, 1, disk);
+	//keep the root's directories packed. Cached lookups under the one that
+	//moves have its old slot
+	last = root->nDirectories - 1;
+	if(i != last)
+	{
+		root->directories[i] = root->directories[last];
+		dentry_forget_name(root->directories[i].dname, NULL, NULL, 1);
+	}
+	memset(&root->directories[last], 0, sizeof(struct cs1550_directory));
+	root->nDirectories--;
+	name_index_drop(0);
+	name_index_drop(dirBlock);
 
-	fclose(disk);
+	//write out the new root to save changes
+	write_root(root);
+	return 0;
 }
-//function to read from a directory on disk
-static cs1550_directory_entry read_dirEntry(long blockNum){
 
+//function to make a file called filename.extension in the directory in
+//slot i of the root
+//returns 0 or a negative error
+static int file_make(int i, const char *filename, const char *extension){
+
+	long j;
+	struct cs1550_directory dir;
+	struct cs1550_directory_entry *dirEntry;
+	struct cs1550_root_directory *root;
+	struct cs1550_file_directory file;
 
-	cs1550_directory_entry dirEntry;
+	//check if the filename or extension are blank
+	if((strcmp(filename, "") == 0) || (strcmp(extension, "") == 0))
+	{
+		//If either fields are empty, user is trying to make a nameless node
+		return -EINVAL;
+	}
 
-	FILE* disk = fopen(".disk", "r+b");
-	fseek(disk, BLOCK_SIZE*blockNum, SEEK_SET);
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	dir = root->directories[i];
 
-	fread(&dirEntry, BLOCK_SIZE, 1, disk);
+	//do checks on the directory entry
+	dirEntry = load_dirEntry(dir.nStartBlock);
+	if(dirEntry == NULL)
+	{
+		return -EIO;
+	}
+	if(dirEntry->nFiles>=MAX_FILES_IN_DIR)
+	{
+		//no more room in the directory for this file
+		return -EPERM;
+	}
+	//check if the file already exists in the directory
+	if(dir_lookup(dir.nStartBlock, dirEntry, filename, extension) >= 0)
+	{
+		//this file already exists in the directory, cannot add
+		return -EEXIST;
+	}
 
-	fclose(disk);
-	return dirEntry;
-}
-//function to place a new directory in disk
-static void write_dirEntry(struct cs1550_directory_entry *dirEntry, long blockNum){
+	//make an inode for the file, which needs no data blocks until it's
+	//written, and with -o inline none until it outgrows the inode
+	j = inode_create(options.inlineFiles ? INODE_INLINE : 0);
+	if(j < 0)
+	{
+		//no room on disk
+		return j;
+	}
 
+	//fill file information
+	strcpy(file.fname, filename);
+	strcpy(file.fext, extension);
+	file.fsize = 0;
+	file.nStartBlock = j;
 
-	FILE* disk = fopen(".disk", "r+b");
-	fseek(disk, blockNum*BLOCK_SIZE, SEEK_SET);
+	//add file to files array in directory
+	dirEntry->files[dirEntry->nFiles] = file;
 
-	fwrite(dirEntry, BLOCK_SIZE, 1, disk);
+	//change number of files in directory
+	dirEntry->nFiles++;
+	name_added(dir.nStartBlock, dirEntry, dirEntry->nFiles, dirEntry->nFiles - 1);
+	dentry_forget_name(dir.dname, filename, extension, 0);
 
-	fclose(disk);
+	//write changes to the dirEntry to make changes permanent
+	write_dirEntry(dirEntry, dir.nStartBlock);
+	return 0;
 }
-//function to read from a block on disk
-static cs1550_disk_block read_block(long blockNum){
 
+//function to remove the file in slot j of the directory in slot i of the
+//root. Its entry goes right away, with the directory's last entry moving
+//into its slot, and its blocks go to the reclaimer
+//returns 0 or a negative error
+static int file_remove(int i, int j){
 
-	cs1550_disk_block block;
+	int last, res;
+	long dirBlock, nStartBlock;
+	const struct cs1550_root_directory *root;
+	struct cs1550_directory_entry *dirEntry;
+	struct cs1550_open_file *of;
 
-	FILE* disk = fopen(".disk", "r+b");
-	fseek(disk, BLOCK_SIZE*blockNum, SEEK_SET);
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	dirBlock = root->directories[i].nStartBlock;
+	dirEntry = load_dirEntry(dirBlock);
+	if(dirEntry == NULL)
+	{
+		return -EIO;
+	}
 
-	fread(&block, BLOCK_SIZE, 1, disk);
+	//fuse hides a file that's still open instead of unlinking it, unless it's
+	//mounted with hard_remove. Then the file stays until it's closed
+	pthread_mutex_lock(&openLock);
+	for(of = openFiles; of != NULL && !(of->dirBlock == dirBlock && of->slot == j); of = of->next)
+	{
+	}
+	pthread_mutex_unlock(&openLock);
+	if(of != NULL)
+	{
+		return -EBUSY;
+	}
 
-	fclose(disk);
-	return block;
-}
-//function to write to a directory in disk
-static void write_block(struct cs1550_disk_block *block, long blockNum){
+	//appends still waiting for blocks have none to give back, and the rest
+	//are left to the reclaimer
+	nStartBlock = dirEntry->files[j].nStartBlock;
+	res = reclaim_queue(nStartBlock, RECLAIM_FILE);
+	if(res != 0)
+	{
+		return res;
+	}
+	delalloc_discard(nStartBlock);
+	index_drop(nStartBlock);
+	dentry_forget_name(root->directories[i].dname, dirEntry->files[j].fname, dirEntry->files[j].fext, 0);
+
+	//keep the directory's entries packed. Cached lookups and open files of
+	//the one that moves have its old slot
+	last = dirEntry->nFiles - 1;
+	if(j != last)
+	{
+		dirEntry->files[j] = dirEntry->files[last];
+		dentry_forget_name(root->directories[i].dname, NULL, NULL, 1);
+		pthread_mutex_lock(&openLock);
+		for(of = openFiles; of != NULL; of = of->next)
+		{
+			if(of->dirBlock == dirBlock && of->slot == last)
+			{
+				of->slot = j;
+			}
+		}
+		pthread_mutex_unlock(&openLock);
+	}
+	memset(&dirEntry->files[last], 0, sizeof(struct cs1550_file_directory));
+	dirEntry->nFiles--;
+	name_index_drop(dirBlock);
 
+	//write changes to the dirEntry to make changes permanent
+	write_dirEntry(dirEntry, dirBlock);
+	return 0;
+}
 
-	FILE* disk = fopen(".disk", "r+b");
-	fseek(disk, blockNum*BLOCK_SIZE, SEEK_SET);
+//function to open the file in slot j of the directory block dirBlock,
+//keeping what reads and writes need to find it in fi->fh
+//returns 0 or a negative error
+static int open_file_new(long dirBlock, int j, struct fuse_file_info *fi){
 
-	fwrite(block, BLOCK_SIZE, 1, disk);
+	struct cs1550_open_file *of = calloc(1, sizeof(struct cs1550_open_file));
 
-	fclose(disk);
+	if(of == NULL)
+	{
+		return -ENOMEM;
+	}
+	of->dirBlock = dirBlock;
+	of->dirEntry = load_dirEntry(of->dirBlock);
+	if(of->dirEntry == NULL)
+	{
+		free(of);
+		return -EIO;
+	}
+	of->slot = j;
+	pthread_mutex_init(&of->lock, NULL);
+	//the index is built now if it isn't in memory already; if it can't be,
+	//the first read or write tries again
+	of->idx = index_get(of->dirEntry->files[j].nStartBlock);
+	pthread_mutex_lock(&openLock);
+	of->next = openFiles;
+	if(openFiles != NULL)
+	{
+		openFiles->prev = of;
+	}
+	openFiles = of;
+	pthread_mutex_unlock(&openLock);
+	fi->fh = (uintptr_t)of;
+	return 0;
 }
 
+//function to make the file in slot j of the directory block dirBlock, which
+//isn't open, size bytes long
+static int file_resize(long dirBlock, int j, off_t size){
 
+	struct cs1550_directory_entry *dirEntry = load_dirEntry(dirBlock);
+	struct cs1550_block_index *idx;
+	int legacy;
+
+	if(dirEntry == NULL)
+	{
+		return -EIO;
+	}
+	idx = index_get(dirEntry->files[j].nStartBlock);
+	if(idx == NULL)
+	{
+		return -EIO;
+	}
+	legacy = idx->legacy;
+	index_put(idx);
+	return file_truncate(dirBlock, dirEntry, j, legacy, size);
+}
 
 /*
  * Called whenever the system wants to know the file attributes, including
@@ -202,9 +6610,9 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 
 
 	int res = 0;
-	int i, j, dirFound = 0, fileFound = 0;
+	int i, j, kind, dirFound = 0, fileFound = 0;
 	struct cs1550_directory dir;
-	struct cs1550_directory_entry dirEntry;
+	const struct cs1550_directory_entry *dirEntry;
 	struct cs1550_file_directory file;
 	memset(stbuf, 0, sizeof(struct stat));
 
@@ -217,40 +6625,58 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 	memset(filename, 0, sizeof(char)*(MAX_FILENAME+1));
 	memset(extension, 0, sizeof(char)*(MAX_EXTENSION+1));
 
-	struct cs1550_root_directory root;
+	const struct cs1550_root_directory *root;
 
-	//save path into variables
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-
-	
-   	if(strlen(directory) > MAX_FILENAME || strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION){
+	//save path into variables, refusing parts too long for them
+	if(parse_path(path, directory, filename, extension) != 0)
+	{
 		return -ENAMETOOLONG;
 	}
+
+	
 	//is path the root dir?
 	if (strcmp(path, "/") == 0) 
 	{
 		stbuf->st_mode = S_IFDIR | 0755;
 		stbuf->st_nlink = 2;
+		stbuf->st_ino = CS1550_INO(0);
 		res = 0;
 		return res;
 	} 
+	else if(strcmp(path, STATS_PATH) == 0)
+	{
+		//the stats file is read only, and as long as its contents are now
+		char stats[STATS_SIZE];
+
+		if(header == NULL)
+		{
+			return -EIO;
+		}
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_ino = CS1550_INO(header->nBlocks);
+		stbuf->st_size = stats_render(stats);
+		return 0;
+	}
 	else 
 	{
 		//**Check if name is subdirectory**
 		
-		//read from the directories array in the root block and scan for a directory with the same name
-		root = read_root();
-	
-		for(i=0;i<root.nDirectories;i++)
+		//find what the path names, usually straight from the dentry cache
+		kind = resolve_path(path, directory, filename, extension, &i, &j);
+		if(kind < 0)
 		{
-			//look in the array of directories to find the directory given in the path
-			if(strcmp(root.directories[i].dname,directory) == 0)
-			{
-				
-				dir = root.directories[i];
-				dirFound = 1;
-				break;
-			}
+			return kind;
+		}
+		root = load_root();
+		if(root == NULL)
+		{
+			return -EIO;
+		}
+		if(kind != DENTRY_NONE)
+		{
+			dir = root->directories[i];
+			dirFound = 1;
 		}
 		if(dirFound)
 		{
@@ -262,6 +6688,7 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 				//Might want to return a structure with these fields
 				stbuf->st_mode = S_IFDIR | 0755;
 				stbuf->st_nlink = 2;
+				stbuf->st_ino = CS1550_INO(dir.nStartBlock);
 				res = 0; //no error
 				
 
@@ -269,20 +6696,17 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 			else
 			{
 				//If filename is not blank, scan through the given directory and try to find the regular file
-				dirEntry = read_dirEntry(dir.nStartBlock);
+				dirEntry = load_dirEntry(dir.nStartBlock);
+				if(dirEntry == NULL)
+				{
+					return -EIO;
+				}
 			
 				
-				for(j=0;j<dirEntry.nFiles;j++)
+				if(kind == DENTRY_FILE)
 				{
-					//look in the array of files to see if this file exists
-						
-					if(strcmp(dirEntry.files[j].fname,filename) == 0 && strcmp(dirEntry.files[j].fext, extension) == 0)
-					{
-						
-						file = dirEntry.files[j];
-						fileFound = 1;
-						break;
-					}
+					file = dirEntry->files[j];
+					fileFound = 1;
 				}
 				if(fileFound)
 				{
@@ -292,6 +6716,7 @@ static int cs1550_getattr(const char *path, struct stat *stbuf)
 					//regular file, probably want to be read and write
 					stbuf->st_mode = S_IFREG | 0666; 
 					stbuf->st_nlink = 1; //file links
+					stbuf->st_ino = CS1550_INO(file.nStartBlock);
 					stbuf->st_size = file.fsize; //file size - make sure you replace with real size!
 					res = 0; // no error
 					
@@ -335,8 +6760,9 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 	int i, j, dirFound = 0;
 	struct cs1550_directory dir;
-	struct cs1550_directory_entry dirEntry;
-	struct cs1550_root_directory root;
+	const struct cs1550_directory_entry *dirEntry;
+	const struct cs1550_root_directory *root;
+	struct stat st;
 
 	char directory[MAX_FILENAME+1];
 	char filename[MAX_FILENAME+1];
@@ -347,14 +6773,13 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	memset(extension, 0, sizeof(char)*(MAX_EXTENSION+1));
 
 
-	//save path into variables
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-
-	//check if any of the path paremeters are malformed
-	if(strlen(directory) > MAX_FILENAME || strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION){
+	//save path into variables, refusing parts too long for them
+	if(parse_path(path, directory, filename, extension) != 0)
+	{
 		return -ENAMETOOLONG;
 	}
 
+
 	//check if the filename or extension are blank
 	if((!strcmp(filename, "") == 0) || (!strcmp(extension, "") == 0))
 	{
@@ -369,14 +6794,21 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	if (strcmp(path, "/") == 0)
 	{
 		//fill from the root
-		root = read_root();
-		for(i=0;i<root.nDirectories;i++)
+		root = load_root();
+		if(root == NULL)
+		{
+			return -EIO;
+		}
+		for(i=0;i<root->nDirectories;i++)
 		{
-			dir=root.directories[i];
+			dir=root->directories[i];
 			
 			if(strcmp(dir.dname, "") != 0)
 			{
-				filler(buf, dir.dname, NULL, 0);
+				memset(&st, 0, sizeof(struct stat));
+				st.st_ino = CS1550_INO(dir.nStartBlock);
+				st.st_mode = S_IFDIR;
+				filler(buf, dir.dname, &st, 0);
 			}
 			
 		}
@@ -384,18 +6816,17 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	else
 	{
 		//search the root for a directory matching the given directory name
-		root = read_root();
-		for(i=0;i<root.nDirectories;i++)
+		root = load_root();
+		if(root == NULL)
 		{
-			dir=root.directories[i];
-			
-			if(strcmp(dir.dname, directory) == 0)
-			{
-				//found the sub directory
-				dirFound = 1;
-				break;
-			}
-			
+			return -EIO;
+		}
+		//look the directory up in the root's name table
+		i = root_lookup(root, directory);
+		if(i >= 0)
+		{
+			dir = root->directories[i];
+			dirFound = 1;
 		}
 		//directory wasn't found
 		if(!dirFound)
@@ -405,16 +6836,23 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		//directory was found
 		else
 		{
-			dirEntry = read_dirEntry(dir.nStartBlock);
-			for(j=0;j<dirEntry.nFiles;j++)
+			dirEntry = load_dirEntry(dir.nStartBlock);
+			if(dirEntry == NULL)
+			{
+				return -EIO;
+			}
+			for(j=0;j<dirEntry->nFiles;j++)
 			{
 				//print the file name and concatenated extension for each file
 				char fileAndExt[(MAX_FILENAME+1)+(MAX_EXTENSION+1)];
-				strcpy(fileAndExt, dirEntry.files[j].fname);
+				strcpy(fileAndExt, dirEntry->files[j].fname);
 				strcat(fileAndExt, ".");
-				strcat(fileAndExt, dirEntry.files[j].fext); 
+				strcat(fileAndExt, dirEntry->files[j].fext); 
 				//print the concatenated file name and extension to filler
-				filler(buf, fileAndExt, NULL, 0);
+				memset(&st, 0, sizeof(struct stat));
+				st.st_ino = CS1550_INO(dirEntry->files[j].nStartBlock);
+				st.st_mode = S_IFREG;
+				filler(buf, fileAndExt, &st, 0);
 			}
 		}
 	}
@@ -438,12 +6876,6 @@ static int cs1550_mkdir(const char *path, mode_t mode)
 	(void) path;
 	(void) mode;
 
-	int i, j, blockFound = 0;
-	struct cs1550_directory dir;
-	struct cs1550_directory_entry dirEntry;
-	struct cs1550_root_directory root;
-	struct cs1550_allocation_table fat;
-
 	char directory[MAX_FILENAME+1];
 	char filename[MAX_FILENAME+1];
 	char extension[MAX_EXTENSION+1];
@@ -453,14 +6885,13 @@ static int cs1550_mkdir(const char *path, mode_t mode)
 	memset(extension, 0, sizeof(char)*(MAX_EXTENSION+1));
 
 
-	//save path into variables
-	sscanf(path, "/%[^/]", directory);
-	
-
-	//check length
-	if(strlen(directory) > MAX_FILENAME){
+	//save path into variables, refusing parts too long for them
+	if(parse_path(path, directory, filename, extension) != 0)
+	{
 		return -ENAMETOOLONG;
 	}
+	
+
 
 
 	//make sure user gave a name for the directory
@@ -470,98 +6901,168 @@ static int cs1550_mkdir(const char *path, mode_t mode)
 		return -EINVAL;
 	}
 
-	root = read_root();
-	
-	
-	fat = read_allTable();
+	return dir_make(directory);
+}
+
+/* 
+ * Removes a directory, which has to be empty. The last directory in the root
+ * moves into its slot, and its block goes to the reclaimer.
+ */
+static int cs1550_rmdir(const char *path)
+{
+	int i, j, kind;
+
+	char directory[MAX_FILENAME+1];
+	char filename[MAX_FILENAME+1];
+	char extension[MAX_EXTENSION+1];
 
-	if(root.nDirectories >= MAX_DIRS_IN_ROOT)
+	//save path into variables, refusing parts too long for them
+	if(parse_path(path, directory, filename, extension) != 0)
 	{
-		//no more directories can be added at this time due to space constraints
-		return -EPERM;
+		return -ENAMETOOLONG;
 	}
-	//search through all of the directories to see if one by that name already exists
-	for(i = 0; i < root.nDirectories; i++)
-	{ 
-		if(strcmp(root.directories[i].dname, directory) == 0)
-		{
-			return -EEXIST;
-		}
+	if(strcmp(path, "/") == 0)
+	{
+		return -EBUSY;
+	}
+	if(strcmp(path, STATS_PATH) == 0)
+	{
+		return -ENOTDIR;
 	}
-	//If no directory exists at the passed path, create one using the file allocation table for reference
 
-	
-	//find a block to put the new directory using the FAT
-	for(j = 6; j<=2048; j++)//iterate through every block in the FAT(not including the root and fat itself which accounts for 5 blocks)
+	kind = resolve_path(path, directory, filename, extension, &i, &j);
+	if(kind < 0)
 	{
-		if(fat.blocks[j] == 0)
-		{
-			//an empty block has been found to put the directory
-			blockFound = 1;
-			break;
-		}
+		return kind;
+	}
+	if(kind == DENTRY_NONE)
+	{
+		return -ENOENT;
 	}
-	if(blockFound)
+	if(kind == DENTRY_FILE)
 	{
+		return -ENOTDIR;
+	}
+	return dir_remove(i);
+}
 
-		//if a free block is found, fill dir struct with info provided by user
-		strcpy(dir.dname, directory); 
-		dir.nStartBlock = j;
-		
-		//put a new directory struct at j (the offset into disk that we found)
-		memset(&dirEntry, 0, BLOCK_SIZE);
-		write_dirEntry(&dirEntry, dir.nStartBlock);
+/* 
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	//should be very similar to mkdir
+
+	(void) mode;
+	(void) dev;
+	(void) path;
+
+	int i;
+	const struct cs1550_root_directory *root;
+
+	char directory[MAX_FILENAME+1];
+	char filename[MAX_FILENAME+1];
+	char extension[MAX_EXTENSION+1];
+
+	memset(directory, 0, sizeof(char)*(MAX_FILENAME+1));
+	memset(filename, 0, sizeof(char)*(MAX_FILENAME+1));
+	memset(extension, 0, sizeof(char)*(MAX_EXTENSION+1));
+
+
+	//save path into variables, refusing parts too long for them
+	if(parse_path(path, directory, filename, extension) != 0)
+	{
+		return -ENAMETOOLONG;
+	}
+
+	//make sure user gave a name for the directory
+	if(strcmp(directory,"")==0)
+	{
+		//directory is blank, refuse to make a file in a blank directory
+		return -EINVAL;
+	}
+
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
 
-		//update the FAT and say that its now occupied
-		fat.blocks[j]=1;
-		write_allTable(&fat);
+	//look the directory up in the root's name table
+	i = root_lookup(root, directory);
+	if(i < 0)
+	{
+		return -ENOENT;
+	}
+	return file_make(i, filename, extension);
+}
 
-		//add the directory to the root array of directories
-		root.directories[root.nDirectories] = dir;
+/*
+ * Deletes a file. Its entry goes right away, with the directory's last entry
+ * moving into its slot, and its blocks go to the reclaimer.
+ */
+static int cs1550_unlink(const char *path)
+{
+	int i, j, kind;
 
-		//update number of directories in root
-		root.nDirectories+=1;
+	char directory[MAX_FILENAME+1];
+	char filename[MAX_FILENAME+1];
+	char extension[MAX_EXTENSION+1];
 
-		//write out the new root to save changes
-		write_root(&root);
+	//save path into variables, refusing parts too long for them
+	if(parse_path(path, directory, filename, extension) != 0)
+	{
+		return -ENAMETOOLONG;
 	}
-	else
+	if(strcmp(path, STATS_PATH) == 0)
 	{
-		//no room on disk
 		return -EPERM;
 	}
+	if(strcmp(path, "/") == 0)
+	{
+		return -EISDIR;
+	}
 
-	return 0;
-}
-
-/* 
- * Removes a directory.
- */
-static int cs1550_rmdir(const char *path)
-{
-	(void) path;
-    return 0;
+	kind = resolve_path(path, directory, filename, extension, &i, &j);
+	if(kind < 0)
+	{
+		return kind;
+	}
+	if(kind == DENTRY_NONE)
+	{
+		return -ENOENT;
+	}
+	if(kind == DENTRY_DIR)
+	{
+		return -EISDIR;
+	}
+	return file_remove(i, j);
 }
 
 /* 
- * Does the actual creation of a file. Mode and dev can be ignored.
+ * Read size bytes from file into buf starting from offset
  *
  */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
 {
-	//should be very similar to mkdir
 
-	(void) mode;
-	(void) dev;
+	(void) buf;
+	(void) offset;
+	(void) fi;
 	(void) path;
 
-	int i = 0, j = 0, blockFound = 0, dirFound = 0;
+	int res = 0;
+	int i, j, kind, dirFound = 0, fileFound = 0;
 	struct cs1550_directory dir;
-	struct cs1550_directory_entry dirEntry;
-	struct cs1550_root_directory root;
-	struct cs1550_allocation_table fat;
+	const struct cs1550_directory_entry *dirEntry;
 	struct cs1550_file_directory file;
+	struct cs1550_block_index *idx;
+	struct cs1550_open_file *of = open_file_get(fi);
 
+	//set the fields for the path to be parsed into in case the path is not the root directory
 	char directory[MAX_FILENAME+1];
 	char filename[MAX_FILENAME+1];
 	char extension[MAX_EXTENSION+1];
@@ -570,128 +7071,126 @@ static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
 	memset(filename, 0, sizeof(char)*(MAX_FILENAME+1));
 	memset(extension, 0, sizeof(char)*(MAX_EXTENSION+1));
 
+	const struct cs1550_root_directory *root;
 
-	//save path into variables
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-
-	//check lengths
-	if(strlen(directory) > MAX_FILENAME || strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION){
-		return -ENAMETOOLONG;
-	}
-
-	//check if the filename or extension are blank
-	if((strcmp(filename, "") == 0) || (strcmp(extension, "") == 0))
+	//an open file already knows where its entry and block index are, so
+	//the path isn't even looked at
+	if(of != NULL)
 	{
-		//If either fields are empty, user is trying to make a nameless node
-		return -EINVAL;
+		return open_file_read(of, buf, size, offset);
 	}
 
-	//make sure user gave a name for the directory
-	if(strcmp(directory,"")==0)
+	//save path into variables, refusing parts too long for them
+	if(parse_path(path, directory, filename, extension) != 0)
 	{
-		//directory is blank, refuse to make a file in a blank directory
-		return -EINVAL;
+		return -ENAMETOOLONG;
 	}
 
-	root = read_root();
-	fat = read_allTable();
+	//the stats file is made up from the counters for each read
+	if(strcmp(path, STATS_PATH) == 0)
+	{
+		char stats[STATS_SIZE];
+		int len = stats_render(stats);
 
-	
-	//search through all of the directories to see if the supplied directory exists
-	for(i = 0; i < root.nDirectories; i++)
-	{ 
-		if(strcmp(root.directories[i].dname, directory) == 0)
+		if(offset >= len)
 		{
-			dirFound = 1;
-			dir = root.directories[i];
-			break;
+			return 0;
 		}
+		res = (size_t)(len - offset) < size ? len - offset : (int)size;
+		memcpy(buf, stats + offset, res);
+		return res;
 	}
 
+	
+	//check that no fields are blank
+	if(strcmp(directory, "")==0 || strcmp(filename, "")==0 || strcmp(extension, "")==0)
+	{
+		return -EEXIST;
+	}
+	
+	//find the file, usually straight from the dentry cache
+	kind = resolve_path(path, directory, filename, extension, &i, &j);
+	if(kind < 0)
+	{
+		return kind;
+	}
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	if(kind == DENTRY_FILE)
+	{
+		dir = root->directories[i];
+		dirFound = 1;
+	}
 	if(dirFound)
 	{
 
-		//do checks on the directory entry
-		dirEntry = read_dirEntry(dir.nStartBlock);
-		if(dirEntry.nFiles>=MAX_FILES_IN_DIR)
+		dirEntry = load_dirEntry(dir.nStartBlock);
+		if(dirEntry == NULL)
 		{
-			//no more room in the directory for this file
-			return -EPERM;
+			return -EIO;
 		}
-		//check if the file already exists in the directory
 
-		for(j = 0; j<dirEntry.nFiles; j++)//iterate through every file
+		if(kind == DENTRY_FILE)
 		{
-			if(strcmp(dirEntry.files[j].fname,filename) == 0 && strcmp(dirEntry.files[j].fext, extension) == 0)
-			{
-				//this file already exists in the directory, cannot add
-				return -EEXIST;
-			}
+			file = dirEntry->files[j];
+			fileFound = 1;
 		}
-
-		//check for a free block in the FAT to put the file
-		for(j = 6; j<=2048; j++)//iterate through every block in the FAT(not including the root and fat itself which accounts for 5 blocks)
+		if(fileFound)
 		{
-			if(fat.blocks[j] == 0)
+			//regular file matching the filename has been found.
+			//We are ready to start the reading logic
+
+			//reading at or past the end of the file gets nothing
+			if(offset>=file.fsize)
 			{
-				//an empty block has been found to put the start of the file
-				blockFound = 1;
-				break;
+				return 0;
 			}
-		}
-		if(blockFound)
-		{
-
-			//fill file information
-			strcpy(file.fname, filename);
-			strcpy(file.fext, extension); 
-			file.fsize = 0;
-			file.nStartBlock = j;
-
-			//add file to files array in directory
-			dirEntry.files[dirEntry.nFiles] = file;
-
-			//change number of files in directory
-			dirEntry.nFiles++;
-
-			//write changes to the dirEntry to make changes permanent
-			write_dirEntry(&dirEntry, dir.nStartBlock);
-
-			//update the FAT and say that its now occupied
-			fat.blocks[j]=1;
-
-			write_root(&root);
-
-			write_allTable(&fat);
 
+			//the file's block index knows where every block is, and
+			//whether the file has an inode or is a version 1 chain
+			idx = index_get(file.nStartBlock);
+			if(idx == NULL)
+			{
+				return -EIO;
+			}
+			res = file_read(idx, file.fsize, buf, size, offset);
+			index_put(idx);
+			return res;
 		}
 		else
 		{
-			//no room on disk
-			return -EPERM;
+			//The file was not found, 
+			//Else return that path doesn't exist
+			res = -ENOENT;
 		}
-
 	}
-	return 0;
-}
+	else
+	{
+		//The directory was not found, 
+		//Else return that path doesn't exist
+		res = -ENOENT;
+	}
 
-/*
- * Deletes a file
- */
-static int cs1550_unlink(const char *path)
-{
-    (void) path;
 
-    return 0;
+	//check to make sure path exists
+	//check that size is > 0
+	//check that offset is <= to the file size
+	//read in data
+	//set size and return, or error
+
+	return res;
 }
 
 /* 
- * Read size bytes from file into buf starting from offset
+ * Write size bytes from buf into file starting from offset
  *
  */
 
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-			  struct fuse_file_info *fi)
+static int cs1550_write(const char *path, const char *buf, size_t size, 
+			  off_t offset, struct fuse_file_info *fi)
 {
 
 	(void) buf;
@@ -700,458 +7199,696 @@ static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
 	(void) path;
 
 	int res = 0;
-	int i, j, k, dirFound = 0, fileFound = 0;
-	int siz  = 0;
+	int i, j, kind, dirFound = 0, fileFound = 0, legacy;
 	struct cs1550_directory dir;
-	struct cs1550_directory_entry dirEntry;
+	struct cs1550_directory_entry *dirEntry;
 	struct cs1550_file_directory file;
-	struct cs1550_disk_block block;
-
-	long next, currBlock;
+	struct cs1550_block_index *idx;
+	struct cs1550_open_file *of = open_file_get(fi);
 
 	//set the fields for the path to be parsed into in case the path is not the root directory
 	char directory[MAX_FILENAME+1];
 	char filename[MAX_FILENAME+1];
 	char extension[MAX_EXTENSION+1];
-	char stringBuffer[BLOCK_SIZE];
-	
-	FILE* disk;
 
 	memset(directory, 0, sizeof(char)*(MAX_FILENAME+1));
 	memset(filename, 0, sizeof(char)*(MAX_FILENAME+1));
 	memset(extension, 0, sizeof(char)*(MAX_EXTENSION+1));
 
-	struct cs1550_root_directory root;
+	struct cs1550_root_directory *root;
+
+	//an open file already knows where its entry and block index are, so
+	//the path isn't even looked at
+	if(of != NULL)
+	{
+		return open_file_write(of, buf, size, offset);
+	}
+
+	//save path into variables, refusing parts too long for them
+	if(parse_path(path, directory, filename, extension) != 0)
+	{
+		return -ENAMETOOLONG;
+	}
+
+	//the stats file is read only
+	if(strcmp(path, STATS_PATH) == 0)
+	{
+		return -EACCES;
+	}
 
-	//save path into variables
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
 	
 	//check that no fields are blank
 	if(strcmp(directory, "")==0 || strcmp(filename, "")==0 || strcmp(extension, "")==0)
 	{
-		return -EEXIST;
-	}
-	//check lengths
-   	if(strlen(directory) > MAX_FILENAME || strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION)
-   	{
-		return -ENAMETOOLONG;
+		return -EINVAL;
 	}
 	
-	//read from the directories array in the root block and scan for a directory with the same name
-	root = read_root();
 
-	for(i=0;i<root.nDirectories;i++)
+	//find the file, usually straight from the dentry cache
+	kind = resolve_path(path, directory, filename, extension, &i, &j);
+	if(kind < 0)
 	{
-		//look in the array of directories to find the directory given in the path
-
-		if(strcmp(root.directories[i].dname,directory) == 0)
-		{
-			
-			dir = root.directories[i];
-			dirFound = 1;
-			break;
-		}
+		return kind;
+	}
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	if(kind == DENTRY_FILE)
+	{
+		dir = root->directories[i];
+		dirFound = 1;
 	}
 	if(dirFound)
 	{
 
-		dirEntry = read_dirEntry(dir.nStartBlock);
+		dirEntry = load_dirEntry(dir.nStartBlock);
+		if(dirEntry == NULL)
+		{
+			return -EIO;
+		}
 
-		for(j=0;j<dirEntry.nFiles;j++)
+		if(kind == DENTRY_FILE)
 		{
-			//look in the array of files to see if this file exists
-				
-			if(strcmp(dirEntry.files[j].fname,filename) == 0 && strcmp(dirEntry.files[j].fext, extension) == 0)
-			{
-				
-				file = dirEntry.files[j];
-				fileFound = 1;
-				break;
-			}
+			file = dirEntry->files[j];
+			fileFound = 1;
 		}
 		if(fileFound)
 		{
 			//regular file matching the filename has been found.
-			//We are ready to start the reading logic
-
-			//make sure file offset is not larger than the file itself
-			if(offset>file.fsize)
+			//We are ready to start the writing logic
+			idx = index_get(file.nStartBlock);
+			if(idx == NULL)
 			{
-				return -EFBIG;
+				return -EIO;
 			}
+			legacy = idx->legacy;
+			index_put(idx);
+			res = file_write(dir.nStartBlock, dirEntry, j, legacy, buf, size, offset);
+		}
+		else
+		{
+			//The file was not found, 
+			//Else return that path doesn't exist
+			res = -ENOENT;
+		}
+	}
+	else
+	{
+		//The directory was not found, 
+		//Else return that path doesn't exist
+		res = -ENOENT;
+	}
 
-			//find which block the offset is located in
-			int newOffset, blockNum = offset/BLOCK_SIZE;
-			if(blockNum!=0)
-			{
-				newOffset = offset - blockNum*BLOCK_SIZE;
-			}
-			else
-			{
-				newOffset = offset;
-			}
 
-			//go to that block
+	//check to make sure path exists
+	//check that size is > 0
+	//check that offset is <= to the file size
+	//read in data
+	//set size and return, or error
 
-			disk = fopen(".disk", "r+b");
-			fseek(disk, file.nStartBlock*BLOCK_SIZE, SEEK_SET);
-			fread(&block, BLOCK_SIZE, 1, disk);
+	return res;
+}
 
-			currBlock = file.nStartBlock;
+#if FUSE_VERSION >= 29
+/*
+ * Read size bytes from file starting from offset, handing libfuse where the
+ * data is instead of a copy of it, so what's in the image can go to the
+ * kernel without passing through us
+ */
+static int cs1550_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	struct cs1550_open_file *of = open_file_get(fi);
+	struct cs1550_block_index *idx;
+	struct fuse_bufvec *bufv;
+	int res;
 
-			for(k = 0; k<blockNum; k++)
-			{
-				next = block.nNextBlock;
-				currBlock = next;
-				fseek(disk, currBlock*BLOCK_SIZE, SEEK_SET);
-				memset(&block, 0, BLOCK_SIZE);
-				fread(&block, BLOCK_SIZE, 1, disk);
-			}
+	if(of != NULL)
+	{
+		idx = open_file_index(of);
+		if(idx == NULL)
+		{
+			return -EIO;
+		}
+		if(!idx->legacy && !idx->inlined)
+		{
+			return file_read_buf(of, idx, of->dirEntry->files[of->slot].fsize, bufp, size, offset);
+		}
+	}
 
-			//go to the new offset
-			fseek(disk, currBlock*BLOCK_SIZE+sizeof(long)+newOffset, SEEK_SET);
-			
-			memset(stringBuffer, 0, BLOCK_SIZE);
+	//anything else (the stats file, version 1 and inline files) is read
+	//into memory as usual
+	bufv = malloc(sizeof(struct fuse_bufvec));
+	if(bufv == NULL)
+	{
+		return -ENOMEM;
+	}
+	*bufv = FUSE_BUFVEC_INIT(size);
+	bufv->buf[0].mem = malloc(size > 0 ? size : 1);
+	if(bufv->buf[0].mem == NULL)
+	{
+		free(bufv);
+		return -ENOMEM;
+	}
+	res = cs1550_read(path, bufv->buf[0].mem, size, offset, fi);
+	if(res < 0)
+	{
+		bufvec_free(bufv);
+		return res;
+	}
+	bufv->buf[0].size = res;
+	*bufp = bufv;
+	return 0;
+}
 
-			//read until the end of the block
-			fread(stringBuffer, BLOCK_SIZE-(newOffset+sizeof(long)), 1, disk);
-			memcpy(buf, stringBuffer, BLOCK_SIZE-(newOffset+sizeof(long)));
-			siz += BLOCK_SIZE-(newOffset+sizeof(long));
+/*
+ * Write the data in buf to file starting from offset. Overwrites of whole
+ * blocks that are together on disk go from libfuse's buffer (or the pipe the
+ * kernel spliced them into) straight to the image
+ */
+static int cs1550_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	struct cs1550_open_file *of = open_file_get(fi);
+	size_t size = fuse_buf_size(buf);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	int res;
 
-			memset(stringBuffer, 0, BLOCK_SIZE);
+	if(of != NULL)
+	{
+		res = open_file_write_buf(of, buf, size, offset);
+		if(res != 0)
+		{
+			return res;
+		}
+	}
 
-			while(block.nNextBlock!=0)
-			{
-				//while there are more blocks to be read, read them until end of file
+	//anything else is gathered into one piece of memory and written as usual
+	dst.buf[0].mem = malloc(size > 0 ? size : 1);
+	if(dst.buf[0].mem == NULL)
+	{
+		return -ENOMEM;
+	}
+	res = fuse_buf_copy(&dst, buf, 0);
+	if(res >= 0)
+	{
+		res = cs1550_write(path, dst.buf[0].mem, res, offset, fi);
+	}
+	free(dst.buf[0].mem);
+	return res;
+}
+#endif
 
-				//navigate to the next block
-				next = block.nNextBlock;
-				currBlock = next;
-				fseek(disk, currBlock*BLOCK_SIZE, SEEK_SET);
-				memset(&block, 0, BLOCK_SIZE);
-				fread(&block, BLOCK_SIZE, 1, disk);
+/*
+ * Called once when the filesystem is mounted, before any other operation.
+ * Opens the backing image so the handlers never have to.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
 
-				
-				//copy current block's data content to the buffer
+#if FUSE_VERSION >= 29
+	//have the kernel move data through pipes where it can, so cs1550_read_buf
+	//and cs1550_write_buf's pieces of the image are spliced rather than copied
+	//(cs1550_bench has no kernel, and passes no connection)
+	if(conn != NULL)
+	{
+		conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	}
+#endif
+	locks_init();
+	if(disk_open(diskPath) != 0)
+	{
+		fprintf(stderr, "cs1550: cannot open %s: %s\n", diskPath, strerror(errno));
+	}
+	else if(alloc_init() != 0)
+	{
+		fprintf(stderr, "cs1550: cannot read the allocation table of %s\n", diskPath);
+	}
+	else if(dedup_init() != 0)
+	{
+		//freeing a block without knowing what else points at it could lose
+		//another file's data, so nothing is allocated or freed
+		fprintf(stderr, "cs1550: cannot count the shared blocks of %s\n", diskPath);
+		allocBits = NULL;
+	}
+	metaLastWriteback = time(NULL);
+	reclaim_start();
+	return NULL;
+}
 
-				memcpy(stringBuffer, block.data, BLOCK_SIZE-sizeof(long));
-				memcpy(buf+siz, stringBuffer, strlen(stringBuffer));
-				siz+=strlen(stringBuffer);
-				memset(stringBuffer, 0, BLOCK_SIZE);
-			}
+/*
+ * Called once when the filesystem is unmounted. Lets the reclaimer free what
+ * it was given, writes back cached data and the resident metadata, and
+ * closes the backing image. The counters are in /.stats until then.
+ */
+static void cs1550_destroy(void *private_data)
+{
+	(void) private_data;
+
+	reclaim_stop();
+	writeback_all();
+	allocBits = NULL;
+	header = NULL;
+	metaJournaled = 0;
+	cache_drop_all();
+	index_drop_all();
+	dedup_drop_all();
+	pin_drop_all();
+	name_index_drop_all();
+	meta_drop_all();
+	disk_close();
+}
 
-			//all blocks have been read onto the buffer, return the size of the buffer and close the file
-						
-			fclose(disk);
-			//send all changes to disk
-			write_dirEntry(&dirEntry, dir.nStartBlock);
-			write_root(&root);
-			
-		}
-		else
-		{
-			//The file was not found, 
-			//Else return that path doesn't exist
-			res = -ENOENT;
-		}
-	}
-	else
+/*
+ * Called for df. The free block count is kept up to date by the allocator,
+ * so this doesn't have to look at the allocation table at all.
+ */
+static int cs1550_statfs(const char *path, struct statvfs *stbuf)
+{
+	(void) path;
+
+	if(header == NULL)
 	{
-		//The directory was not found, 
-		//Else return that path doesn't exist
-		res = -ENOENT;
+		return -EIO;
 	}
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = blockSize;
+	stbuf->f_frsize = blockSize;
+	pthread_mutex_lock(&allocLock);
+	stbuf->f_blocks = header->nBlocks;
+	stbuf->f_bfree = header->nFreeBlocks - allocReserved;
+	stbuf->f_bavail = header->nFreeBlocks - allocReserved;
+	pthread_mutex_unlock(&allocLock);
+	stbuf->f_namemax = MAX_FILENAME + 1 + MAX_EXTENSION;
+	return 0;
+}
 
+/*
+ * Called when the user wants everything written so far to reach the disk.
+ */
+static int cs1550_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+	(void) path;
+	(void) fi;
 
-	//check to make sure path exists
-	//check that size is > 0
-	//check that offset is <= to the file size
-	//read in data
-	//set size and return, or error
+	int res = writeback_all();
 
-	return siz;
+	if(res == 0 && (isdatasync ? fdatasync(diskFd) : fsync(diskFd)) != 0)
+	{
+		res = -errno;
+	}
+	return res;
 }
 
+
 /* 
- * Write size bytes from buf into file starting from offset
+ * Called when we open a file. The file is looked up here, once, and what
+ * reads and writes need to find it is kept in fi->fh until it's released.
  *
  */
-
-static int cs1550_write(const char *path, const char *buf, size_t size, 
-			  off_t offset, struct fuse_file_info *fi)
+static int cs1550_open(const char *path, struct fuse_file_info *fi)
 {
+	const struct cs1550_root_directory *root;
+	int i, j, kind;
 
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
-
-	int res = 0;
-	int i, j, k, bytesLeft = strlen(buf), dirFound = 0, fileFound = 0, blockFound = 0, siz = 0;
-	struct cs1550_directory dir;
-	struct cs1550_directory_entry dirEntry;
-	struct cs1550_file_directory file;
-	struct cs1550_disk_block block;
-	struct cs1550_allocation_table fat;
-
-	long next, currBlock, l;
-
-	//set the fields for the path to be parsed into in case the path is not the root directory
 	char directory[MAX_FILENAME+1];
 	char filename[MAX_FILENAME+1];
 	char extension[MAX_EXTENSION+1];
 
-	FILE* disk;
-
-	memset(directory, 0, sizeof(char)*(MAX_FILENAME+1));
-	memset(filename, 0, sizeof(char)*(MAX_FILENAME+1));
-	memset(extension, 0, sizeof(char)*(MAX_EXTENSION+1));
+	fi->fh = 0;
 
-	struct cs1550_root_directory root;
+	//the stats file's size changes between getattr and read, so have the
+	//kernel read until it runs out instead of trusting it
+	if(strcmp(path, STATS_PATH) == 0)
+	{
+		if((fi->flags & O_ACCMODE) != O_RDONLY)
+		{
+			return -EACCES;
+		}
+		fi->direct_io = 1;
+		return 0;
+	}
 
-	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+	if(parse_path(path, directory, filename, extension) != 0)
+	{
+		return -ENAMETOOLONG;
+	}
 
-	
-	//check that no fields are blank
-	if(strcmp(directory, "")==0 || strcmp(filename, "")==0 || strcmp(extension, "")==0)
+	//if we can't find the desired file, return an error
+	kind = resolve_path(path, directory, filename, extension, &i, &j);
+	if(kind < 0)
 	{
-		return -EINVAL;
+		return kind;
 	}
-	//check lengths
-   	if(strlen(directory) > MAX_FILENAME || strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION)
-   	{
-		return -ENAMETOOLONG;
+	if(kind != DENTRY_FILE)
+	{
+		return kind == DENTRY_DIR ? -EISDIR : -ENOENT;
 	}
-	
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	return open_file_new(root->directories[i].nStartBlock, j, fi);
+}
 
-	//read from the directories array in the root block and scan for a directory with the same name
-	root = read_root();
+/*
+ * Called for open with O_CREAT when the file isn't there: makes it, then
+ * opens it.
+ */
+static int cs1550_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int res = cs1550_mknod(path, S_IFREG | mode, 0);
 
-	for(i=0;i<root.nDirectories;i++)
+	if(res == 0)
 	{
-		//look in the array of directories to find the directory given in the path
-
-		if(strcmp(root.directories[i].dname,directory) == 0)
-		{
-			
-			dir = root.directories[i];
-			dirFound = 1;
-			break;
-		}
+		res = cs1550_open(path, fi);
 	}
-	if(dirFound)
-	{
+	return res;
+}
+
+/*
+ * Called once the last descriptor for an open file is closed. Lets go of
+ * what open kept.
+ */
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
+{
+	struct cs1550_open_file *of = open_file_get(fi);
 
-		dirEntry = read_dirEntry(dir.nStartBlock);
+	(void) path;
 
-		for(j=0;j<dirEntry.nFiles;j++)
+	if(of != NULL)
+	{
+		pthread_mutex_lock(&openLock);
+		if(of->prev != NULL)
 		{
-			//look in the array of files to see if this file exists
-				
-			if(strcmp(dirEntry.files[j].fname,filename) == 0 && strcmp(dirEntry.files[j].fext, extension) == 0)
-			{
-				
-				file = dirEntry.files[j];
-				fileFound = 1;
-				break;
-			}
+			of->prev->next = of->next;
 		}
-		if(fileFound)
+		else
 		{
-			//regular file matching the filename has been found.
-			//We are ready to start the writing logic
-			//make sure file offset is not larger than the file itself
-			if(offset>file.fsize)
-			{
-				return -EFBIG;
-			}
-
-			//find which block the offset is located in
-			int newOffset;
-			long blockNum = offset/BLOCK_SIZE;
-
-			if(blockNum!=0)
-			{
-				newOffset = offset - blockNum*BLOCK_SIZE;
-			}
-			else
-			{
-				newOffset = offset;
-			}
-
-
-			//go to that block
-
-			disk = fopen(".disk", "r+b");
-			fseek(disk, file.nStartBlock*BLOCK_SIZE, SEEK_SET);
-			fread(&block, BLOCK_SIZE, 1, disk);
-
-			currBlock = file.nStartBlock;
-			next = currBlock;
+			openFiles = of->next;
+		}
+		if(of->next != NULL)
+		{
+			of->next->prev = of->prev;
+		}
+		pthread_mutex_unlock(&openLock);
+		//the kernel has had every reply to it, so libfuse is done reading
+		//the blocks it was handed
+		pin_release(of);
+		if(of->idx != NULL)
+		{
+			index_put(of->idx);
+		}
+		pthread_mutex_destroy(&of->lock);
+		free(of);
+		fi->fh = 0;
+	}
+	return 0;
+}
 
-			for(k = 0; k<blockNum; k++)
-			{
-				next = block.nNextBlock;
-				fseek(disk, next*BLOCK_SIZE, SEEK_SET);
-				memset(&block, 0, BLOCK_SIZE);
-				fread(&block, BLOCK_SIZE, 1, disk);
-				currBlock = next;
-			}
+/*
+ * truncate is called when an existing file is made shorter or longer,
+ * including by open with O_TRUNC. A file made longer reads as zeros past its
+ * old end, and gets no blocks there until something is written.
+ */
+static int cs1550_truncate(const char *path, off_t size)
+{
+	const struct cs1550_root_directory *root;
+	int i, j, kind;
 
-			//go to the new offset
-			
-			fseek(disk, currBlock*BLOCK_SIZE+sizeof(long)+newOffset, SEEK_SET);
-			
+	char directory[MAX_FILENAME+1];
+	char filename[MAX_FILENAME+1];
+	char extension[MAX_EXTENSION+1];
 
-			//write the data. When the end of a block is reached, go to the next block until the end of the file is reached.
-			//if the data can fit in the starting block, write it and move on
-			if(strlen(buf)<=BLOCK_SIZE-(newOffset+sizeof(long)))
-			{
-				fwrite(buf, strlen(buf), 1, disk);
-				bytesLeft-=strlen(buf);
-				file.fsize+=strlen(buf);
-				siz+=strlen(buf);
-			}
-			else
-			{
+	//the stats file is read only
+	if(strcmp(path, STATS_PATH) == 0)
+	{
+		return -EACCES;
+	}
 
-				//write until the end of the block
-				fwrite(buf, BLOCK_SIZE-(newOffset+sizeof(long)), 1, disk);
-				
-				bytesLeft-=BLOCK_SIZE-(newOffset+sizeof(long));
-				
-				file.fsize+=BLOCK_SIZE-(newOffset+sizeof(long));
-				
-				siz+=BLOCK_SIZE-(newOffset+sizeof(long));
+	if(parse_path(path, directory, filename, extension) != 0)
+	{
+		return -ENAMETOOLONG;
+	}
+	kind = resolve_path(path, directory, filename, extension, &i, &j);
+	if(kind < 0)
+	{
+		return kind;
+	}
+	if(kind != DENTRY_FILE)
+	{
+		return kind == DENTRY_DIR ? -EISDIR : -ENOENT;
+	}
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	return file_resize(root->directories[i].nStartBlock, j, size);
+}
 
-				//If we still have more byes to write, we have two situations.
-				while(bytesLeft>0)
-				{
-					//1. There is a link to the next block in the file
-					if(block.nNextBlock!=0)
-					{
+/*
+ * ftruncate on an open file, which already knows where its entry is.
+ */
+static int cs1550_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	struct cs1550_open_file *of = open_file_get(fi);
 
-						next = block.nNextBlock;
-						currBlock = next;
-						fseek(disk, currBlock*BLOCK_SIZE, SEEK_SET);
-						memset(&block, 0, BLOCK_SIZE);
-						fread(&block, BLOCK_SIZE, 1, disk);
-						fseek(disk, currBlock*BLOCK_SIZE+sizeof(long), SEEK_SET);
-						if(bytesLeft>BLOCK_SIZE-sizeof(long))
-						{
-							fwrite(buf+siz, BLOCK_SIZE-sizeof(long), 1, disk);
-							bytesLeft-=(BLOCK_SIZE-sizeof(long));
-							file.fsize+=(BLOCK_SIZE-sizeof(long));
-							siz+=(BLOCK_SIZE-sizeof(long));
-						}
-						else
-						{
-							fwrite(buf+siz, bytesLeft, 1, disk);
-							file.fsize+=(bytesLeft);
-							size+=(bytesLeft);
-							bytesLeft=0;
-							break;
-						}
+	if(of == NULL)
+	{
+		return cs1550_truncate(path, size);
+	}
+	return open_file_truncate(of, size);
+}
 
-					}
-					//2. We need to establish a new one
-					else
-					{
-						//find a block in the FAT to expand the file to 
-						fat = read_allTable();
-						//check for a free block in the FAT to put the file
-						for(l = 6; l<=2048; l++)//iterate through every block in the FAT(not including the root and fat itself which accounts for 5 blocks)
-						{
-							if(fat.blocks[l] == 0)
-							{
-								//an empty block has been found to put the start of the file
-								blockFound = 1;
-								break;
-							}
-						}
-						if(blockFound)
-						{
+/*
+ * The handlers above expect the locks for their path to be held already.
+ * These are what fuse's worker threads call: each takes the root, directory
+ * and file locks its handler needs, calls it, and lets them go. The time all
+ * of that took (waiting for the locks included) goes into /.stats.
+ */
+static int locked_getattr(const char *path, struct stat *stbuf)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_READ);
+	res = cs1550_getattr(path, stbuf);
+	path_unlock(&held);
+	stats_record(STAT_GETATTR, start, res);
+	return res;
+}
 
-							//set the next block pointer to the block found by the fat
+static int locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_NONE);
+	res = cs1550_readdir(path, buf, filler, offset, fi);
+	path_unlock(&held);
+	stats_record(STAT_READDIR, start, res);
+	return res;
+}
 
-							//load current block into block object
-							fseek(disk, currBlock*BLOCK_SIZE, SEEK_SET);
-							memset(&block, 0, BLOCK_SIZE);
-							fread(&block, BLOCK_SIZE, 1, disk);
+static int locked_mkdir(const char *path, mode_t mode)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	meta_journal_wait();
+	path_lock(&held, path, LOCK_WRITE, LOCK_NONE, LOCK_NONE);
+	res = cs1550_mkdir(path, mode);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_MKDIR, start, res);
+	return res;
+}
 
-							//set value of next block to the number found in the fat
-							block.nNextBlock = l;							
+static int locked_rmdir(const char *path)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	meta_journal_wait();
+	path_lock(&held, path, LOCK_WRITE, LOCK_NONE, LOCK_NONE);
+	res = cs1550_rmdir(path);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_RMDIR, start, res);
+	return res;
+}
 
-							//write the changed block back to the disk
-							fseek(disk, currBlock*BLOCK_SIZE, SEEK_SET);
-							fwrite(&block, BLOCK_SIZE, 1, disk);
-							
+static int locked_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	meta_journal_wait();
+	path_lock(&held, path, LOCK_READ, LOCK_WRITE, LOCK_WRITE);
+	res = cs1550_mknod(path, mode, dev);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_MKNOD, start, res);
+	return res;
+}
 
-							//navigate to the new block
-							currBlock = l;
-							fseek(disk, currBlock*BLOCK_SIZE+sizeof(long), SEEK_SET);
+static int locked_unlink(const char *path)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	meta_journal_wait();
+	path_lock(&held, path, LOCK_READ, LOCK_WRITE, LOCK_WRITE);
+	res = cs1550_unlink(path);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_UNLINK, start, res);
+	return res;
+}
 
-							//update the fat
-							fat.blocks[l] = 1;
-							write_allTable(&fat);
+static int locked_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_READ);
+	res = cs1550_read(path, buf, size, offset, fi);
+	path_unlock(&held);
+	stats_record(STAT_READ, start, res);
+	if(res > 0)
+	{
+		STAT_ADD(statBytesRead, res);
+	}
+	return res;
+}
 
-						
-							if(bytesLeft>(BLOCK_SIZE-sizeof(long)))
-							{
-								fwrite(buf+siz, BLOCK_SIZE-sizeof(long), 1, disk);
-								file.fsize+=(BLOCK_SIZE-sizeof(long));
-								siz+=(BLOCK_SIZE-sizeof(long));
-								bytesLeft-=(BLOCK_SIZE-sizeof(long));
-							}
-							else
-							{
-								fwrite(buf+siz, bytesLeft, 1, disk);
-								file.fsize+=(bytesLeft);
-								siz+=(bytesLeft);
-								bytesLeft=0;
-								break;
-							}
-						}
-						else
-						{
-							return -EINVAL;
-						}					
-					}
-				}	
-				
-			}
-			//all blocks have been read onto the buffer, close the file
-			fclose(disk);
+static int locked_write(const char *path, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	meta_journal_wait();
+	//the directory only needs reading: the file's own entry is covered by its lock
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_WRITE);
+	res = cs1550_write(path, buf, size, offset, fi);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_WRITE, start, res);
+	if(res > 0)
+	{
+		STAT_ADD(statBytesWritten, res);
+	}
+	return res;
+}
 
-			//send all changes to disk
-			dirEntry.files[j] = file;
-			write_dirEntry(&dirEntry, dir.nStartBlock);
-			write_root(&root);
-		}
-		else
-		{
-			//The file was not found, 
-			//Else return that path doesn't exist
-			res = -ENOENT;
-		}
+#if FUSE_VERSION >= 29
+static int locked_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_READ);
+	res = cs1550_read_buf(path, bufp, size, offset, fi);
+	path_unlock(&held);
+	stats_record(STAT_READ, start, res);
+	if(res == 0)
+	{
+		STAT_ADD(statBytesRead, fuse_buf_size(*bufp));
 	}
-	else
+	return res;
+}
+
+static int locked_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	meta_journal_wait();
+	//the directory only needs reading: the file's own entry is covered by its lock
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_WRITE);
+	res = cs1550_write_buf(path, buf, offset, fi);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_WRITE, start, res);
+	if(res > 0)
 	{
-		//The directory was not found, 
-		//Else return that path doesn't exist
-		res = -ENOENT;
+		STAT_ADD(statBytesWritten, res);
 	}
+	return res;
+}
+#endif
 
+static int locked_open(const char *path, struct fuse_file_info *fi)
+{
+	struct cs1550_held held;
+	int res;
 
-	//check to make sure path exists
-	//check that size is > 0
-	//check that offset is <= to the file size
-	//read in data
-	//set size and return, or error
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_READ);
+	res = cs1550_open(path, fi);
+	path_unlock(&held);
+	return res;
+}
+
+static int locked_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	meta_journal_wait();
+	path_lock(&held, path, LOCK_READ, LOCK_WRITE, LOCK_WRITE);
+	res = cs1550_create(path, mode, fi);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_MKNOD, start, res);
+	return res;
+}
 
-	return siz;
+static int locked_truncate(const char *path, off_t size)
+{
+	struct cs1550_held held;
+	int res;
+
+	meta_journal_wait();
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_WRITE);
+	res = cs1550_truncate(path, size);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	return res;
 }
 
+static int locked_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	struct cs1550_held held;
+	int res;
+
+	meta_journal_wait();
+	path_lock(&held, path, LOCK_READ, LOCK_READ, LOCK_WRITE);
+	res = cs1550_ftruncate(path, size, fi);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	return res;
+}
 
 /******************************************************************************
  *
@@ -1159,46 +7896,6 @@ static int cs1550_write(const char *path, const char *buf, size_t size,
  *
  *****************************************************************************/
 
-/*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
- */
-static int cs1550_truncate(const char *path, off_t size)
-{
-	(void) path;
-	(void) size;
-
-    return 0;
-}
-
-
-/* 
- * Called when we open a file
- *
- */
-static int cs1550_open(const char *path, struct fuse_file_info *fi)
-{
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
-
-    //It's not really necessary for this project to anything in open
-
-    /* We're not going to worry about permissions for this project, but 
-	   if we were and we don't have them to the file we should return an error
-
-        return -EACCES;
-    */
-
-    return 0; //success!
-}
-
 /*
  * Called when close is called on a file descriptor, but because it might
  * have been dup'ed, this isn't a guarantee we won't ever need the file 
@@ -1207,30 +7904,79 @@ static int cs1550_open(const char *path, struct fuse_file_info *fi)
  */
 static int cs1550_flush (const char *path , struct fuse_file_info *fi)
 {
+	struct cs1550_open_file *of = open_file_get(fi);
+
 	(void) path;
-	(void) fi;
 
-	return 0; //success!
+	//nothing was written through this handle since it was last flushed, so
+	//closing it has nothing to push back
+	if(of != NULL && !__atomic_exchange_n(&of->dirty, 0, __ATOMIC_RELAXED))
+	{
+		return 0;
+	}
+
+	//the file's size is final for now, so give its buffered appends their
+	//blocks, then push the dirty metadata (and in mmap mode the dirty pages)
+	//back to the image
+	return writeback_all();
 }
 
 
 //register our new functions as the implementations of the syscalls
 static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-	.rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-	.mknod	= cs1550_mknod,
-	.unlink = cs1550_unlink,
-	.truncate = cs1550_truncate,
+    .getattr	= locked_getattr,
+    .readdir	= locked_readdir,
+    .mkdir	= locked_mkdir,
+	.rmdir = locked_rmdir,
+    .read	= locked_read,
+    .write	= locked_write,
+#if FUSE_VERSION >= 29
+	.read_buf	= locked_read_buf,
+	.write_buf	= locked_write_buf,
+#endif
+	.mknod	= locked_mknod,
+	.unlink = locked_unlink,
+	.truncate = locked_truncate,
+	.ftruncate = locked_ftruncate,
 	.flush = cs1550_flush,
-	.open	= cs1550_open,
+	.fsync = cs1550_fsync,
+	.statfs = cs1550_statfs,
+	.open	= locked_open,
+	.create	= locked_create,
+	.release = cs1550_release,
+	.init	= cs1550_init,
+	.destroy = cs1550_destroy,
 };
 
+//cs1550_bench builds this file in with its own main
+#ifndef CS1550_NO_MAIN
 //Don't change this.
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	char resolved[PATH_MAX];
+	int ret;
+
+	//pull out our own -o options and leave the rest for fuse
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1)
+	{
+		return 1;
+	}
+#if FUSE_VERSION >= 28 && FUSE_VERSION < 30
+	//let the kernel hand us writes bigger than a page, so a large write()
+	//reaches cs1550_write as a few calls rather than one per 4 KB
+	fuse_opt_add_arg(&args, "-obig_writes");
+#endif
+
+	//pin the backing image to an absolute path while we still know the
+	//directory we were started from
+	if(realpath(diskPath, resolved) != NULL)
+	{
+		strcpy(diskPath, resolved);
+	}
+
+	ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
 }
+#endif
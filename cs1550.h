@@ -0,0 +1,230 @@
+/*
+	On-disk format of a cs1550 image, shared by the filesystem and mkfs_cs1550.
+*/
+
+#ifndef CS1550_H
+#define CS1550_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//size of a disk block in images before version 4, and of the root, directory,
+//header and inode records in all of them. Version 4 images can have bigger
+//blocks (see cs1550_header); a record then sits at the start of its block
+#define	BLOCK_SIZE 512
+
+//we'll use 8.3 filenames
+#define	MAX_FILENAME 8
+#define	MAX_EXTENSION 3
+
+//How many files can there be in one directory?
+#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+
+//The attribute packed means to not align these things
+
+struct cs1550_directory_entry
+{
+	int nFiles;	//How many files are in this directory.
+				//Needs to be less than MAX_FILES_IN_DIR
+
+	struct cs1550_file_directory
+	{
+		char fname[MAX_FILENAME + 1];	//filename (plus space for nul)
+		char fext[MAX_EXTENSION + 1];	//extension (plus space for nul)
+		size_t fsize;					//file size
+		long nStartBlock;				//where the first block is on disk
+	} __attribute__((packed)) files[MAX_FILES_IN_DIR];	//There is an array of these
+
+	//This is some space to get this to be exactly the size of the disk block.
+	//Don't use it for anything.  
+	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+} ;
+
+typedef struct cs1550_root_directory cs1550_root_directory;
+
+#define MAX_DIRS_IN_ROOT (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + sizeof(long))
+
+struct cs1550_root_directory
+{
+	int nDirectories;	//How many subdirectories are in the root
+						//Needs to be less than MAX_DIRS_IN_ROOT
+	struct cs1550_directory
+	{
+		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
+		long nStartBlock;				//where the directory block is on disk
+	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
+
+	//This is some space to get this to be exactly the size of the disk block.
+	//Don't use it for anything.  
+	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+} ;
+
+
+typedef struct cs1550_directory_entry cs1550_directory_entry;
+
+//How much data can one block hold?
+#define	MAX_DATA_IN_BLOCK (BLOCK_SIZE - sizeof(long))
+
+struct cs1550_disk_block
+{
+	//The next disk block, if needed. This is the next pointer in the linked 
+	//allocation list
+	long nNextBlock;
+
+	//And all the rest of the space in the block can be used for actual data
+	//storage.
+	char data[MAX_DATA_IN_BLOCK];
+};
+
+typedef struct cs1550_disk_block cs1550_disk_block;
+
+//how many blocks the allocation table accounts for
+#define MAX_BLOCKS 2048
+
+//create a file allocation table that accounts for 1048576(5 mebibytes) / 512(bytes per block) = 2048 blocks of data needed to be accounted for
+//we can account for 2048 blocks of data represented in 512 bytes, by making each entry only 2 bits long (infeaseable) or using 4 blocks with char entries. (1 byte entry that represents each block)
+//Version 2 images pack the same table into a bitmap (one bit per block, 1 is
+//allocated) at the start of the same four blocks so it can be scanned 64
+//blocks at a time.
+struct cs1550_allocation_table{
+	union
+	{
+		//version 1
+		//0 is unallocated
+		//1 is allocated
+		char blocks[MAX_BLOCKS];
+
+		//version 2
+		uint64_t words[MAX_BLOCKS / 64];
+	};
+};
+typedef struct cs1550_allocation_table cs1550_allocation_table;
+
+//Version 1 images (the original layout) have no header. Later versions keep
+//this one in block 5, which version 1 never hands out, so an image can
+//always be told apart by looking for the magic number there.
+#define CS1550_MAGIC 0x30353531	//"1550"
+#define CS1550_VERSION_BITMAP 2
+#define CS1550_VERSION_EXTENTS 3
+#define CS1550_VERSION_SUPER 4
+#define HEADER_BLOCK 5
+
+//first block that can hold a directory or file data in images before version 4
+#define FIRST_DATA_BLOCK 6
+
+//Version 4 images describe their own geometry, so they can be any size and
+//have blocks of any power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE bytes.
+//The header stays at byte HEADER_OFFSET whatever the block size, so it's
+//found before the block size is known. The root is still block 0, and
+//mkfs_cs1550 puts the bitmap in the blocks after the header's
+#define HEADER_OFFSET (HEADER_BLOCK*BLOCK_SIZE)
+#define MIN_BLOCK_SIZE BLOCK_SIZE
+#define MAX_BLOCK_SIZE 65536
+
+struct cs1550_header
+{
+	int nMagic;			//CS1550_MAGIC
+	int nVersion;		//on-disk format version
+	long nBlocks;		//how many blocks the allocation table accounts for
+	long nFreeBlocks;	//how many of those are free
+	long nNextFit;		//where the next search for a free block starts
+
+	//version 4 on (0 before, filled in when an image is upgraded)
+	long nBlockSize;		//bytes in a block
+	long nBitmapStart;		//first block of the allocation bitmap
+	long nBitmapBlocks;		//how many blocks the bitmap takes
+	long nFirstDataBlock;	//first block that can hold a directory or file data
+	long nJournalStart;		//first block of the journal, 0 if the image has none
+	long nJournalBlocks;	//how many blocks the journal takes
+	long nJournalSequence;	//last journal transaction known to be in place
+
+	//This is some space to get this to be exactly the size of the disk block.
+	char padding[BLOCK_SIZE - 2*sizeof(int) - 10*sizeof(long)];
+};
+typedef struct cs1550_header cs1550_header;
+
+//A version 5 image is a version 4 one where some data blocks may be shared
+//by several extents, from files written while mounted with -o dedup. How
+//many point at each block isn't kept on disk but counted from the extents at
+//mount. The version is there so programs from before, which would give a
+//block back while another file still had it, won't mount the image
+#define CS1550_VERSION_SHARED 5
+
+//Images made by mkfs_cs1550 have a journal (between the bitmap and the
+//first data block) that metadata goes through on its way to its home
+//blocks. A transaction is a run of groups, each a descriptor record and
+//the blocks it lists, ending in a commit record with a checksum of every
+//block before it. Each transaction is written from the start of the
+//journal and has the sequence number after the header's nJournalSequence.
+#define JOURNAL_MAGIC 0x6c6e726a30353531L	//"1550jrnl"
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+
+#define MAX_BLOCKS_IN_DESCRIPTOR ((BLOCK_SIZE - 3*sizeof(long) - 2*sizeof(int)) / sizeof(long))
+
+struct cs1550_journal_record
+{
+	long nMagic;		//JOURNAL_MAGIC
+	long nSequence;		//the transaction this record belongs to
+	int nType;			//JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+	int nCount;			//descriptor: how many blocks follow it
+	long nChecksum;		//commit: checksum of the transaction's blocks before it
+
+	//descriptor: the home of each block that follows
+	long blocks[MAX_BLOCKS_IN_DESCRIPTOR];
+};
+typedef struct cs1550_journal_record cs1550_journal_record;
+
+//Version 3 images give every new file an inode: a block that says where the
+//file's data lives as a list of extents (runs of consecutive blocks), so
+//finding the block at some offset doesn't mean following nNextBlock links
+//and every data block holds a full BLOCK_SIZE bytes. A file whose
+//nStartBlock points at an inode is told apart from a version 1 file, whose
+//nStartBlock points at the first cs1550_disk_block of its chain, by the
+//magic number in the first long (where a chain block keeps nNextBlock).
+#define INODE_MAGIC 0x65646f6e69303531L	//"150inode"
+
+struct cs1550_extent
+{
+	long nLogical;		//first block of the file this run holds
+	long nStartBlock;	//where the run starts on disk
+	int nBlocks;		//how many consecutive blocks are in the run
+	int nFlags;			//EXTENT_COMPRESSED and the blocks it's stored in, or 0
+} __attribute__((packed));
+
+//An extent with EXTENT_COMPRESSED in nFlags holds its nBlocks blocks of data
+//compressed into fewer blocks from nStartBlock, how many being kept in
+//nFlags from bit EXTENT_STORED_SHIFT up. The data is in LZ4's block format
+//(see lz_compress in cs1550.c), zero padded to the end of its last block.
+//Only files written while mounted with -o compress get them, made from
+//COMPRESS_CLUSTER blocks of appended data at a time, and one that's written
+//to goes back to being plain blocks first
+#define EXTENT_COMPRESSED 1
+#define EXTENT_STORED_SHIFT 8
+#define COMPRESS_CLUSTER 16
+
+#define MAX_EXTENTS_IN_INODE ((BLOCK_SIZE - 2*sizeof(long) - 2*sizeof(int)) / sizeof(struct cs1550_extent))
+
+//An inode with INODE_INLINE in nFlags has no extents. It holds the file's
+//bytes itself instead, from where the extents would start to the end of its
+//block (so more of them with bigger blocks), and anything there past the
+//end of the file is zero. Only files made while mounted with -o inline
+//start out like this, and they stop being inline once they outgrow it
+#define INODE_INLINE 1
+
+struct cs1550_inode
+{
+	long nMagic;		//INODE_MAGIC
+	long nNextInode;	//block holding the extents that didn't fit here, 0 if none
+	int nExtents;		//how many of the extents below are in use
+	int nFlags;			//INODE_INLINE, or 0
+
+	//sorted by nLogical, and every extent here comes before any in nNextInode
+	struct cs1550_extent extents[MAX_EXTENTS_IN_INODE];
+
+	//This is some space to get this to be exactly the size of the disk block.
+	char padding[BLOCK_SIZE - 2*sizeof(long) - 2*sizeof(int) - MAX_EXTENTS_IN_INODE*sizeof(struct cs1550_extent)];
+};
+typedef struct cs1550_inode cs1550_inode;
+
+#endif
@@ -0,0 +1,592 @@
+/*
+	cs1550_bench: drives the cs1550 operations directly, without a mount.
+
+	The filesystem is built in (leaving out cs1550.c's main) and the handlers
+	in hello_oper are called on a scratch image, timing every call. It needs
+	libfuse, whose buffer copying read_buf and write_buf use, but not a
+	mount, root or /dev/fuse:
+
+		gcc -O2 -Wall `pkg-config fuse --cflags` cs1550_bench.c -o cs1550_bench `pkg-config fuse --libs`
+
+	usage: cs1550_bench [options] [workload...]
+
+	Workloads (all of them, in this order, if none are given):
+		create		make directories and files until the namespace is full
+		seqwrite	write one big file from start to end
+		seqread		read it back from start to end
+		randread	read pieces of it at random offsets
+		readdir		list the root and every directory over and over
+
+	and, only when asked for:
+		crash		make a directory of files, then cut the image off after
+					the Nth metadata block written home at unmount, for
+					N = 1, 2, ... until the write back gets through; every
+					remount must find them all (needs a journal)
+
+	Options:
+		-d path		scratch image (default cs1550_bench.disk)
+		-k			keep the image afterwards
+		-s size		image size (default 256M)
+		-b size		block size (default 4K)
+		-j size		journal size (default as for mkfs_cs1550)
+		-f size		size of the big file (default 64M)
+		-c size		bytes per sequential read or write (default 128K)
+		-r size		bytes per random read (default 4K)
+		-n count	calls made by randread and readdir (default 10000)
+		-o opts		mount options, as given to cs1550 with -o
+
+	Sizes can end in K, M or G. Every workload runs on a fresh mount of the
+	image and prints one line of JSON with its calls per second, MB per second
+	and call latencies. crash times its remounts, and makes the exit status 1
+	if one of them lost something.
+*/
+
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+#include "mkfs_cs1550.c"
+
+#define BENCH_DIR "/big"
+#define BENCH_FILE "/big/data.bin"
+
+struct bench_config
+{
+	const char *image;
+	int keep;
+	long long size;
+	long blockSize;
+	long long journalSize;
+	long long fileSize;
+	long chunk;
+	long randomChunk;
+	long count;
+};
+
+static struct bench_config config = {
+	.image = "cs1550_bench.disk",
+	.size = 256LL << 20,
+	.blockSize = 4096,
+	.journalSize = -1,
+	.fileSize = 64LL << 20,
+	.chunk = 128 << 10,
+	.randomChunk = 4 << 10,
+	.count = 10000,
+};
+
+//latencies of the calls made by the workload running now, in nanoseconds
+struct bench_times
+{
+	uint64_t *ns;
+	long n, nAlloc;
+	long long bytes;
+	uint64_t start;
+};
+
+//function to get a monotonic time in nanoseconds
+static uint64_t now_ns(){
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+//function to record how long one call took
+static void times_add(struct bench_times *t, uint64_t ns){
+
+	uint64_t *grown;
+
+	if(t->n == t->nAlloc)
+	{
+		t->nAlloc = t->nAlloc ? t->nAlloc*2 : 4096;
+		grown = realloc(t->ns, t->nAlloc*sizeof(uint64_t));
+		if(grown == NULL)
+		{
+			fprintf(stderr, "cs1550_bench: out of memory\n");
+			exit(1);
+		}
+		t->ns = grown;
+	}
+	t->ns[t->n++] = ns;
+}
+
+static int ns_cmp(const void *a, const void *b){
+
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+//function to print a workload's results as a line of JSON and start over
+static void times_report(struct bench_times *t, const char *workload){
+
+	double seconds = (now_ns() - t->start) / 1e9;
+	double p50 = 0, p99 = 0, max = 0;
+
+	if(t->n > 0)
+	{
+		qsort(t->ns, t->n, sizeof(uint64_t), ns_cmp);
+		p50 = t->ns[(t->n - 1)*50/100] / 1e3;
+		p99 = t->ns[(t->n - 1)*99/100] / 1e3;
+		max = t->ns[t->n - 1] / 1e3;
+	}
+	printf("{\"workload\": \"%s\", \"ops\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+		"\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}\n",
+		workload, t->n, seconds, seconds > 0 ? t->n / seconds : 0, seconds > 0 ? t->bytes / seconds / (1 << 20) : 0,
+		p50, p99, max);
+	fflush(stdout);
+	t->n = 0;
+	t->bytes = 0;
+}
+
+//function to set mount options from a string like "cache=0,readahead=16",
+//using the same templates cs1550 hands fuse_opt_parse
+//returns -1 if one of them isn't an option cs1550 knows
+static int bench_options(char *opts){
+
+	const struct fuse_opt *o;
+	char *opt, *save = NULL;
+	size_t len;
+
+	for(opt = strtok_r(opts, ",", &save); opt != NULL; opt = strtok_r(NULL, ",", &save))
+	{
+		for(o = cs1550_opts; o->templ != NULL; o++)
+		{
+			len = strcspn(o->templ, "=");
+			if(o->templ[len] == '\0' && strcmp(opt, o->templ) == 0)
+			{
+				*(int *)((char *)&options + o->offset) = o->value;
+				break;
+			}
+			if(o->templ[len] == '=' && strncmp(opt, o->templ, len + 1) == 0 &&
+				sscanf(opt + len + 1, o->templ + len + 1, (char *)&options + o->offset) == 1)
+			{
+				break;
+			}
+		}
+		if(o->templ == NULL)
+		{
+			fprintf(stderr, "cs1550_bench: unknown option %s\n", opt);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+//function to mount the image, making the big file's directory if it isn't there
+static void bench_mount(){
+
+	struct stat st;
+
+	strcpy(diskPath, config.image);
+	hello_oper.init(NULL);
+	if(header == NULL)
+	{
+		fprintf(stderr, "cs1550_bench: cannot mount %s\n", config.image);
+		exit(1);
+	}
+	if(hello_oper.getattr(BENCH_DIR, &st) != 0 && hello_oper.mkdir(BENCH_DIR, 0755) != 0)
+	{
+		fprintf(stderr, "cs1550_bench: cannot make %s\n", BENCH_DIR);
+		exit(1);
+	}
+}
+
+static void bench_unmount(){
+
+	hello_oper.destroy(NULL);
+}
+
+//function to make directories and files until there's no room for more
+static void bench_create(struct bench_times *t){
+
+	char path[64];
+	uint64_t t0;
+	int d, f, res;
+
+	for(d = 0; ; d++)
+	{
+		sprintf(path, "/d%d", d);
+		t0 = now_ns();
+		res = hello_oper.mkdir(path, 0755);
+		if(res != 0 && res != -EEXIST)
+		{
+			break;
+		}
+		times_add(t, now_ns() - t0);
+		for(f = 0; ; f++)
+		{
+			sprintf(path, "/d%d/f%d.dat", d, f);
+			t0 = now_ns();
+			res = hello_oper.mknod(path, S_IFREG | 0644, 0);
+			if(res != 0 && res != -EEXIST)
+			{
+				break;
+			}
+			times_add(t, now_ns() - t0);
+		}
+	}
+}
+
+//function to write the big file from start to end
+static void bench_seqwrite(struct bench_times *t){
+
+	struct fuse_file_info fi;
+	struct stat st;
+	char *buf = malloc(config.chunk);
+	long long off;
+	long i, n;
+	uint64_t t0;
+	int res;
+
+	memset(&fi, 0, sizeof(fi));
+	for(i = 0; buf != NULL && i < config.chunk; i++)
+	{
+		buf[i] = (char)(i * 31 + 7);
+	}
+	if(buf == NULL || (hello_oper.getattr(BENCH_FILE, &st) != 0 && hello_oper.mknod(BENCH_FILE, S_IFREG | 0644, 0) != 0) ||
+		hello_oper.open(BENCH_FILE, &fi) != 0)
+	{
+		fprintf(stderr, "cs1550_bench: cannot make %s\n", BENCH_FILE);
+		exit(1);
+	}
+	for(off = 0; off < config.fileSize; off += n)
+	{
+		n = config.fileSize - off < config.chunk ? config.fileSize - off : config.chunk;
+		t0 = now_ns();
+		res = hello_oper.write(BENCH_FILE, buf, n, off, &fi);
+		times_add(t, now_ns() - t0);
+		if(res != n)
+		{
+			fprintf(stderr, "cs1550_bench: write at %lld returned %d\n", off, res);
+			break;
+		}
+		t->bytes += n;
+	}
+	//the time to get it all to the image counts, but isn't a call of its own
+	hello_oper.flush(BENCH_FILE, &fi);
+	hello_oper.release(BENCH_FILE, &fi);
+	free(buf);
+}
+
+//function to get the big file's size, writing it first if it isn't there
+static long long bench_file_size(){
+
+	struct bench_times scratch;
+	struct stat st;
+
+	if(hello_oper.getattr(BENCH_FILE, &st) != 0 || st.st_size < config.fileSize)
+	{
+		memset(&scratch, 0, sizeof(scratch));
+		bench_seqwrite(&scratch);
+		free(scratch.ns);
+		hello_oper.getattr(BENCH_FILE, &st);
+	}
+	return st.st_size;
+}
+
+//function to read the big file from start to end
+static void bench_seqread(struct bench_times *t){
+
+	struct fuse_file_info fi;
+	char *buf = malloc(config.chunk);
+	long long off, size = bench_file_size();
+	uint64_t t0;
+	int res;
+
+	memset(&fi, 0, sizeof(fi));
+	if(hello_oper.open(BENCH_FILE, &fi) != 0)
+	{
+		fprintf(stderr, "cs1550_bench: cannot open %s\n", BENCH_FILE);
+		exit(1);
+	}
+	t->start = now_ns();
+	for(off = 0; buf != NULL && off < size; off += res)
+	{
+		t0 = now_ns();
+		res = hello_oper.read(BENCH_FILE, buf, config.chunk, off, &fi);
+		times_add(t, now_ns() - t0);
+		if(res <= 0)
+		{
+			fprintf(stderr, "cs1550_bench: read at %lld returned %d\n", off, res);
+			break;
+		}
+		t->bytes += res;
+	}
+	hello_oper.release(BENCH_FILE, &fi);
+	free(buf);
+}
+
+//function to read pieces of the big file at random offsets
+static void bench_randread(struct bench_times *t){
+
+	struct fuse_file_info fi;
+	char *buf = malloc(config.randomChunk);
+	long long size = bench_file_size(), off;
+	uint64_t t0, x = 88172645463325252ULL;
+	long i;
+	int res;
+
+	memset(&fi, 0, sizeof(fi));
+	if(hello_oper.open(BENCH_FILE, &fi) != 0)
+	{
+		fprintf(stderr, "cs1550_bench: cannot open %s\n", BENCH_FILE);
+		exit(1);
+	}
+	t->start = now_ns();
+	for(i = 0; buf != NULL && i < config.count && size > config.randomChunk; i++)
+	{
+		//xorshift, so every run reads the same offsets
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		off = x % (size - config.randomChunk);
+		t0 = now_ns();
+		res = hello_oper.read(BENCH_FILE, buf, config.randomChunk, off, &fi);
+		times_add(t, now_ns() - t0);
+		if(res <= 0)
+		{
+			fprintf(stderr, "cs1550_bench: read at %lld returned %d\n", off, res);
+			break;
+		}
+		t->bytes += res;
+	}
+	hello_oper.release(BENCH_FILE, &fi);
+	free(buf);
+}
+
+//function for readdir to hand entries to. Keeps the directory names when
+//buf is the list of them
+static int bench_filler(void *buf, const char *name, const struct stat *st, off_t off){
+
+	char (*names)[MAX_FILENAME + 2] = buf;
+	int i;
+
+	(void) st;
+	(void) off;
+	if(names == NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	{
+		return 0;
+	}
+	for(i = 0; i < (int)MAX_DIRS_IN_ROOT && names[i][0] != '\0'; i++)
+	{
+	}
+	if(i < (int)MAX_DIRS_IN_ROOT)
+	{
+		names[i][0] = '/';
+		strncpy(names[i] + 1, name, MAX_FILENAME);
+	}
+	return 0;
+}
+
+//function to list the root and each directory in turn
+static void bench_readdir(struct bench_times *t){
+
+	char names[MAX_DIRS_IN_ROOT + 1][MAX_FILENAME + 2];
+	const char *path;
+	uint64_t t0;
+	long i;
+	int nDirs;
+
+	memset(names, 0, sizeof(names));
+	hello_oper.readdir("/", names, bench_filler, 0, NULL);
+	for(nDirs = 0; names[nDirs][0] != '\0'; nDirs++)
+	{
+	}
+	t->start = now_ns();
+	for(i = 0; i < config.count; i++)
+	{
+		path = i % (nDirs + 1) == 0 ? "/" : names[i % (nDirs + 1) - 1];
+		t0 = now_ns();
+		hello_oper.readdir(path, NULL, bench_filler, 0, NULL);
+		times_add(t, now_ns() - t0);
+	}
+}
+
+//function to check that a crash round's directory, its files and its block
+//all made it through the remount
+static int crash_check(const char *dir, int nFiles){
+
+	cs1550_root_directory *root;
+	char path[64];
+	struct stat st;
+	long block;
+	int d, f;
+
+	if(hello_oper.getattr(dir, &st) != 0)
+	{
+		return -1;
+	}
+	for(f = 0; f < nFiles; f++)
+	{
+		sprintf(path, "%s/f%d.dat", dir, f);
+		if(hello_oper.getattr(path, &st) != 0)
+		{
+			return -1;
+		}
+	}
+	//the directory's block has to still be taken, or it would be handed out again
+	root = load_root();
+	d = root == NULL ? -1 : root_lookup(root, dir + 1);
+	if(d < 0 || allocBits == NULL)
+	{
+		return -1;
+	}
+	block = root->directories[d].nStartBlock;
+	return (allocBits[block / 64] >> (block % 64) & 1) ? 0 : -1;
+}
+
+//function to cut the image off part way through each unmount's write back
+//and check the remount puts everything back together from the journal
+//returns how many rounds lost something
+static int bench_crash(struct bench_times *t){
+
+	char dir[32], path[64];
+	uint64_t t0;
+	long n;
+	int f, res, lost = 0, done = 0;
+
+	if(header->nJournalBlocks == 0)
+	{
+		fprintf(stderr, "cs1550_bench: crash needs an image with a journal\n");
+		return 1;
+	}
+	for(n = 1; !done; n++)
+	{
+		sprintf(dir, "/c%ld", n);
+		res = hello_oper.mkdir(dir, 0755);
+		for(f = 0; res == 0 && f < 5; f++)
+		{
+			sprintf(path, "%s/f%d.dat", dir, f);
+			res = hello_oper.mknod(path, S_IFREG | 0644, 0);
+		}
+		if(res != 0)
+		{
+			fprintf(stderr, "cs1550_bench: cannot make %s: %s\n", dir, strerror(-res));
+			return lost + 1;
+		}
+		//the write back stops n blocks in, unless it was shorter than that
+		homeWritesLeft = n;
+		bench_unmount();
+		done = homeWritesLeft > 0;
+		homeWritesLeft = -1;
+		t0 = now_ns();
+		bench_mount();
+		times_add(t, now_ns() - t0);
+		if(crash_check(dir, 5) != 0)
+		{
+			fprintf(stderr, "cs1550_bench: lost %s after a crash %ld blocks into the write back\n", dir, n);
+			lost++;
+		}
+	}
+	return lost;
+}
+
+static void bench_usage(const char *prog){
+
+	fprintf(stderr, "usage: %s [-d image] [-k] [-s size] [-b block_size] [-j journal_size] [-f file_size]\n"
+		"\t[-c chunk] [-r random_chunk] [-n count] [-o options] [create|seqwrite|seqread|randread|readdir|crash]...\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *all[] = { "create", "seqwrite", "seqread", "randread", "readdir" };
+	struct bench_times t;
+	const char **workloads = all;
+	long long n;
+	int opt, i, nWorkloads = sizeof(all) / sizeof(all[0]), res, lost = 0;
+
+	while((opt = getopt(argc, argv, "d:ks:b:j:f:c:r:n:o:")) != -1)
+	{
+		n = 0;
+		if(strchr("sbjfcrn", opt) != NULL && (n = parse_size(optarg)) < 0)
+		{
+			opt = '?';
+		}
+		switch(opt)
+		{
+			case 'd': config.image = optarg; break;
+			case 'k': config.keep = 1; break;
+			case 's': config.size = n; break;
+			case 'b': config.blockSize = n; break;
+			case 'j': config.journalSize = n; break;
+			case 'f': config.fileSize = n; break;
+			case 'c': config.chunk = n; break;
+			case 'r': config.randomChunk = n; break;
+			case 'n': config.count = n; break;
+			case 'o':
+				if(bench_options(optarg) == 0)
+				{
+					break;
+				}
+				//fall through
+			default:
+				bench_usage(argv[0]);
+				return 2;
+		}
+	}
+	if(config.blockSize < MIN_BLOCK_SIZE || config.blockSize > MAX_BLOCK_SIZE || (config.blockSize & (config.blockSize - 1)) != 0 ||
+		config.chunk <= 0 || config.randomChunk <= 0)
+	{
+		bench_usage(argv[0]);
+		return 2;
+	}
+	if(optind < argc)
+	{
+		workloads = (const char **)argv + optind;
+		nWorkloads = argc - optind;
+	}
+
+	res = make_image(config.image, config.size, config.blockSize, config.journalSize, NULL);
+	if(res != 0)
+	{
+		fprintf(stderr, "cs1550_bench: cannot make %s: %s\n", config.image, strerror(-res));
+		return 1;
+	}
+
+	memset(&t, 0, sizeof(t));
+	for(i = 0; i < nWorkloads; i++)
+	{
+		bench_mount();
+		t.start = now_ns();
+		if(strcmp(workloads[i], "create") == 0)
+		{
+			bench_create(&t);
+		}
+		else if(strcmp(workloads[i], "seqwrite") == 0)
+		{
+			bench_seqwrite(&t);
+		}
+		else if(strcmp(workloads[i], "seqread") == 0)
+		{
+			bench_seqread(&t);
+		}
+		else if(strcmp(workloads[i], "randread") == 0)
+		{
+			bench_randread(&t);
+		}
+		else if(strcmp(workloads[i], "readdir") == 0)
+		{
+			bench_readdir(&t);
+		}
+		else if(strcmp(workloads[i], "crash") == 0)
+		{
+			lost += bench_crash(&t);
+		}
+		else
+		{
+			bench_unmount();
+			fprintf(stderr, "cs1550_bench: no workload called %s\n", workloads[i]);
+			bench_usage(argv[0]);
+			return 2;
+		}
+		times_report(&t, workloads[i]);
+		bench_unmount();
+	}
+
+	free(t.ns);
+	if(!config.keep)
+	{
+		unlink(config.image);
+	}
+	return lost > 0;
+}
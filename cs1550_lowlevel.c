@@ -0,0 +1,1338 @@
+/*
+	cs1550_lowlevel: mounts a cs1550 image through FUSE's low-level API.
+
+	It's the same filesystem, with the same -o options: cs1550.c is built in
+	(leaving out its main) and each request goes straight to its internals.
+	The kernel talks to it by inode number rather than by path, and a node
+	keeps where the thing it names lives (the directory block, the name, and
+	the slot its entry was last seen in), so no path is ever built or parsed:
+	a request checks that the slot still holds the name, looks the name up in
+	the directory's name table if it doesn't, and works on the entry there.
+	Reads and writes on an open file go through what open kept, without a
+	name being looked at.
+
+		gcc -Wall `pkg-config fuse --cflags` cs1550_lowlevel.c -o cs1550_lowlevel `pkg-config fuse --libs`
+
+	usage: cs1550_lowlevel [fuse options] [-o cs1550 options] mountpoint
+
+	Inode numbers come from where things start on disk (see CS1550_INO), so
+	they're the same from one mount to the next. The kernel is told about a
+	node each time lookup (or mknod, mkdir or create) finds it, and forgets
+	it the same number of times; a node is kept until then.
+
+	The locks are cs1550.c's, but a directory's is picked by its block and a
+	file's by its inode number, which come with the request, instead of by a
+	hash of the path. Directory listings are put together once, at opendir,
+	and handed out in as many pieces as the kernel asks for (libfuse 2 has no
+	readdirplus to send attributes along with them).
+*/
+
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+#include <fuse_lowlevel.h>
+
+//how long the kernel may keep entries and attributes before asking again
+#define LL_TIMEOUT 1.0
+
+#define NODE_BUCKETS 1024
+
+enum { NODE_ROOT, NODE_STATS, NODE_DIR, NODE_FILE };
+
+//Something the kernel holds an inode number for. Most requests name one,
+//and where it lives is all they need to find it. Nothing is renamed, so a
+//node's directory and name never change, only the slot its entry is in. A
+//file keeps the number it was first looked up with even if it moves (a
+//version 1 file moves onto an inode the first time it's written), for as
+//long as the kernel remembers it
+struct cs1550_node
+{
+	fuse_ino_t ino;
+	unsigned long generation;	//tells this node apart from an earlier one with the same number
+	uint64_t nLookup;			//times the kernel has been told about it and not yet forgotten
+	int kind;
+	int linked;					//0 once it has been unlinked
+	long dirBlock;				//a directory's own block, or the block of the directory a file is in
+	int slot;					//where its entry was last seen: in the root for a directory, in its directory for a file
+	char name[MAX_FILENAME+1];	//a directory's name, or a file's name without its extension
+	char ext[MAX_EXTENSION+1];	//a file's extension
+	struct cs1550_node *inoNext;	//next in the same bucket of nodesByIno
+	struct cs1550_node *nameNext;	//next in the same bucket of nodesByName, while it's linked
+};
+
+static struct cs1550_node *nodesByIno[NODE_BUCKETS];
+static struct cs1550_node *nodesByName[NODE_BUCKETS];
+static unsigned long nodeGeneration = 0;
+//numbers handed out when the one a node should have is already taken
+static fuse_ino_t nodeSpare;
+//guards the node tables, and the slots in the nodes
+static pthread_mutex_t nodeLock = PTHREAD_MUTEX_INITIALIZER;
+//the root and the stats file are always there, and never forgotten
+static struct cs1550_node rootNode = { .ino = FUSE_ROOT_ID, .nLookup = 1, .kind = NODE_ROOT, .linked = 1 };
+static struct cs1550_node statsNode = { .nLookup = 1, .kind = NODE_STATS, .linked = 1 };
+
+//function to find the node with an inode number, with nodeLock held
+static struct cs1550_node *node_find_ino(fuse_ino_t ino){
+
+	struct cs1550_node *node = nodesByIno[ino % NODE_BUCKETS];
+
+	while(node != NULL && node->ino != ino)
+	{
+		node = node->inoNext;
+	}
+	return node;
+}
+
+//function to pick the bucket of nodesByName for a name in the directory
+//block dirBlock (0 for the root)
+static unsigned long node_bucket(long dirBlock, const char *name, const char *ext){
+
+	return (file_hash(name, ext) ^ (unsigned long)dirBlock*31) % NODE_BUCKETS;
+}
+
+//function to find the linked node for what want names, with nodeLock held
+static struct cs1550_node *node_find_name(const struct cs1550_node *want){
+
+	struct cs1550_node *node = nodesByName[node_bucket(want->dirBlock, want->name, want->ext)];
+
+	while(node != NULL && !(node->kind == want->kind && node->dirBlock == want->dirBlock &&
+		strcmp(node->name, want->name) == 0 && strcmp(node->ext, want->ext) == 0))
+	{
+		node = node->nameNext;
+	}
+	return node;
+}
+
+//function to take a node out of the name table once what it named is gone,
+//with nodeLock held
+static void node_unlink_name(struct cs1550_node *node){
+
+	struct cs1550_node **link = &nodesByName[node_bucket(node->dirBlock, node->name, node->ext)];
+
+	while(*link != NULL && *link != node)
+	{
+		link = &(*link)->nameNext;
+	}
+	if(*link != NULL)
+	{
+		*link = node->nameNext;
+	}
+	node->linked = 0;
+}
+
+//function to make a node name what want does, with nodeLock held
+static void node_set_name(struct cs1550_node *node, const struct cs1550_node *want){
+
+	unsigned long b = node_bucket(want->dirBlock, want->name, want->ext);
+
+	node->kind = want->kind;
+	node->dirBlock = want->dirBlock;
+	node->slot = want->slot;
+	strcpy(node->name, want->name);
+	strcpy(node->ext, want->ext);
+	node->linked = 1;
+	node->nameNext = nodesByName[b];
+	nodesByName[b] = node;
+}
+
+//function to record that the kernel has been told about what want names,
+//whose number on disk is want->ino. The generation it's known by goes in
+//*generation
+//returns the inode number the kernel should use for it, or 0 if there's no
+//memory for a new node
+static fuse_ino_t node_remember(const struct cs1550_node *want, unsigned long *generation){
+
+	struct cs1550_node *node;
+	fuse_ino_t ino = want->ino;
+
+	if(want->kind == NODE_STATS)
+	{
+		*generation = statsNode.generation;
+		return statsNode.ino;
+	}
+
+	pthread_mutex_lock(&nodeLock);
+	node = node_find_name(want);
+	if(node == NULL)
+	{
+		node = node_find_ino(ino);
+		if(node != NULL && node->linked)
+		{
+			//the number belongs to something the kernel still knows by
+			//another name (a file that has since moved), so use a new one
+			ino = nodeSpare++;
+			node = NULL;
+		}
+		if(node != NULL)
+		{
+			//a deleted node the kernel hasn't forgotten yet has this number.
+			//A new generation tells the kernel it's something else now
+			node->generation = ++nodeGeneration;
+			node_set_name(node, want);
+		}
+		else
+		{
+			node = calloc(1, sizeof(struct cs1550_node));
+			if(node == NULL)
+			{
+				pthread_mutex_unlock(&nodeLock);
+				return 0;
+			}
+			node->ino = ino;
+			node->generation = ++nodeGeneration;
+			node->inoNext = nodesByIno[ino % NODE_BUCKETS];
+			nodesByIno[ino % NODE_BUCKETS] = node;
+			node_set_name(node, want);
+		}
+	}
+	else
+	{
+		node->slot = want->slot;
+	}
+	node->nLookup++;
+	*generation = node->generation;
+	ino = node->ino;
+	pthread_mutex_unlock(&nodeLock);
+	return ino;
+}
+
+//function to drop n of the kernel's references to a node, freeing it when
+//none are left
+static void node_forget(fuse_ino_t ino, uint64_t n){
+
+	struct cs1550_node *node, **link;
+
+	pthread_mutex_lock(&nodeLock);
+	node = node_find_ino(ino);
+	if(node != NULL && (node->kind == NODE_DIR || node->kind == NODE_FILE))
+	{
+		node->nLookup = node->nLookup > n ? node->nLookup - n : 0;
+		if(node->nLookup == 0)
+		{
+			if(node->linked)
+			{
+				node_unlink_name(node);
+			}
+			link = &nodesByIno[ino % NODE_BUCKETS];
+			while(*link != node)
+			{
+				link = &(*link)->inoNext;
+			}
+			*link = node->inoNext;
+			free(node);
+		}
+	}
+	pthread_mutex_unlock(&nodeLock);
+}
+
+//function to unlink the node for what want names, so a new file or
+//directory made with its name gets a node of its own
+static void node_detach(const struct cs1550_node *want){
+
+	struct cs1550_node *node;
+
+	pthread_mutex_lock(&nodeLock);
+	node = node_find_name(want);
+	if(node != NULL)
+	{
+		node_unlink_name(node);
+	}
+	pthread_mutex_unlock(&nodeLock);
+}
+
+//function to copy the node with an inode number into *node
+//returns 0, or -ENOENT if there's no such node or it has been unlinked
+static int node_get(fuse_ino_t ino, struct cs1550_node *node){
+
+	struct cs1550_node *found;
+	int res = -ENOENT;
+
+	pthread_mutex_lock(&nodeLock);
+	found = node_find_ino(ino);
+	if(found != NULL && found->linked)
+	{
+		*node = *found;
+		res = 0;
+	}
+	pthread_mutex_unlock(&nodeLock);
+	return res;
+}
+
+//function to note the slot a node's entry was found in
+static void node_moved(fuse_ino_t ino, int slot){
+
+	struct cs1550_node *node;
+
+	pthread_mutex_lock(&nodeLock);
+	node = node_find_ino(ino);
+	if(node != NULL && node->linked)
+	{
+		node->slot = slot;
+	}
+	pthread_mutex_unlock(&nodeLock);
+}
+
+//function to take the locks a request needs, in the modes asked for. A
+//dirBlock of 0 leaves out the directory's lock, and an ino of 0 the file's
+static void ll_lock(struct cs1550_held *held, long dirBlock, fuse_ino_t ino, int rootMode, int dirMode, int fileMode){
+
+	pin_done();
+	held->nLocks = 0;
+	held_take(held, &rootLock, rootMode);
+	if(dirBlock != 0)
+	{
+		held_take(held, &dirLocks[dirBlock % DIR_LOCKS], dirMode);
+	}
+	if(ino != 0)
+	{
+		held_take(held, &fileLocks[ino % FILE_LOCKS], fileMode);
+	}
+}
+
+//function to copy the node with an inode number into *node and take the
+//locks a request on it needs. It's copied again once they're held, so an
+//unlink that got in first is seen
+//returns 0, or -ENOENT with nothing held
+static int node_lock(fuse_ino_t ino, struct cs1550_node *node, struct cs1550_held *held, int rootMode, int dirMode, int fileMode){
+
+	int res = node_get(ino, node);
+
+	if(res != 0)
+	{
+		return res;
+	}
+	ll_lock(held, node->kind == NODE_DIR || node->kind == NODE_FILE ? node->dirBlock : 0,
+		node->kind == NODE_FILE ? ino : 0, rootMode, dirMode, fileMode);
+	res = node_get(ino, node);
+	if(res != 0)
+	{
+		path_unlock(held);
+	}
+	return res;
+}
+
+//function to find the slot a directory node's entry is in now, trying the
+//one it was last seen in before looking its name up
+//returns the slot, or -ENOENT if it's gone
+static int node_dir_slot(const struct cs1550_node *node, const struct cs1550_root_directory *root){
+
+	int i = node->slot;
+
+	if(i < 0 || i >= root->nDirectories || root->directories[i].nStartBlock != node->dirBlock)
+	{
+		i = root_lookup(root, node->name);
+		if(i < 0 || root->directories[i].nStartBlock != node->dirBlock)
+		{
+			return -ENOENT;
+		}
+		node_moved(node->ino, i);
+	}
+	return i;
+}
+
+//function to find the slot a file node's entry is in now, trying the one it
+//was last seen in before looking its name up. Its directory goes in *dirEntry
+//returns the slot, -ENOENT if it's gone, or -EIO
+static int node_file_slot(const struct cs1550_node *node, struct cs1550_directory_entry **dirEntry){
+
+	int j = node->slot;
+
+	*dirEntry = load_dirEntry(node->dirBlock);
+	if(*dirEntry == NULL)
+	{
+		return -EIO;
+	}
+	if(j < 0 || j >= (*dirEntry)->nFiles || strcmp((*dirEntry)->files[j].fname, node->name) != 0 ||
+		strcmp((*dirEntry)->files[j].fext, node->ext) != 0)
+	{
+		j = dir_lookup(node->dirBlock, *dirEntry, node->name, node->ext);
+		if(j < 0)
+		{
+			return -ENOENT;
+		}
+		node_moved(node->ino, j);
+	}
+	return j;
+}
+
+//function to split a name in a directory into the file name and extension
+//it's kept as
+//returns 0 or -ENAMETOOLONG
+static int ll_split(const char *name, char *fname, char *fext){
+
+	size_t len = strcspn(name, ".");
+
+	if(len > MAX_FILENAME)
+	{
+		return -ENAMETOOLONG;
+	}
+	memcpy(fname, name, len);
+	fname[len] = '\0';
+	fext[0] = '\0';
+	if(name[len] == '.')
+	{
+		name += len + 1;
+		len = strlen(name);
+		if(len > MAX_EXTENSION)
+		{
+			return -ENAMETOOLONG;
+		}
+		memcpy(fext, name, len + 1);
+	}
+	return 0;
+}
+
+//function to find name in the directory node dir, with dir's locks held.
+//What it is and where goes in *want, with its number on disk in want->ino
+//returns 0 or a negative error
+static int ll_find(const struct cs1550_node *dir, const char *name, struct cs1550_node *want){
+
+	const struct cs1550_root_directory *root;
+	struct cs1550_directory_entry *dirEntry;
+	int i, j, res;
+
+	memset(want, 0, sizeof(struct cs1550_node));
+	if(dir->kind == NODE_ROOT)
+	{
+		if(strcmp(name, STATS_PATH + 1) == 0)
+		{
+			*want = statsNode;
+			return 0;
+		}
+		if(strlen(name) > MAX_FILENAME)
+		{
+			return -ENAMETOOLONG;
+		}
+		root = load_root();
+		if(root == NULL)
+		{
+			return -EIO;
+		}
+		i = root_lookup(root, name);
+		if(i < 0)
+		{
+			return -ENOENT;
+		}
+		want->kind = NODE_DIR;
+		want->dirBlock = root->directories[i].nStartBlock;
+		want->slot = i;
+		strcpy(want->name, name);
+		want->ino = CS1550_INO(want->dirBlock);
+		return 0;
+	}
+	//only the root and the directories in it have anything in them
+	if(dir->kind != NODE_DIR)
+	{
+		return -ENOTDIR;
+	}
+	res = ll_split(name, want->name, want->ext);
+	if(res != 0)
+	{
+		return res;
+	}
+	dirEntry = load_dirEntry(dir->dirBlock);
+	if(dirEntry == NULL)
+	{
+		return -EIO;
+	}
+	j = dir_lookup(dir->dirBlock, dirEntry, want->name, want->ext);
+	if(j < 0)
+	{
+		return -ENOENT;
+	}
+	want->kind = NODE_FILE;
+	want->dirBlock = dir->dirBlock;
+	want->slot = j;
+	want->ino = CS1550_INO(dirEntry->files[j].nStartBlock);
+	return 0;
+}
+
+//function to fill in the attributes of what a node names, with its locks held
+//returns 0 or a negative error
+static int ll_stat(const struct cs1550_node *node, struct stat *st){
+
+	const struct cs1550_root_directory *root;
+	struct cs1550_directory_entry *dirEntry;
+	char stats[STATS_SIZE];
+	int i, j;
+
+	memset(st, 0, sizeof(struct stat));
+	st->st_ino = node->ino;
+	if(node->kind == NODE_FILE)
+	{
+		j = node_file_slot(node, &dirEntry);
+		if(j < 0)
+		{
+			return j;
+		}
+		st->st_mode = S_IFREG | 0666;
+		st->st_nlink = 1;
+		st->st_size = dirEntry->files[j].fsize;
+	}
+	else if(node->kind == NODE_STATS)
+	{
+		//the stats file is read only, and as long as its contents are now
+		st->st_mode = S_IFREG | 0444;
+		st->st_nlink = 1;
+		st->st_size = stats_render(stats);
+	}
+	else
+	{
+		if(node->kind == NODE_DIR)
+		{
+			root = load_root();
+			if(root == NULL)
+			{
+				return -EIO;
+			}
+			i = node_dir_slot(node, root);
+			if(i < 0)
+			{
+				return i;
+			}
+		}
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+	}
+	return 0;
+}
+
+//function to look name up in the directory node dir and remember what it
+//finds, with dir's locks held. Its entry goes in *e, and what it is and
+//where in *want
+//returns 0 or a negative error
+static int ll_lookup_locked(const struct cs1550_node *dir, const char *name, struct fuse_entry_param *e, struct cs1550_node *want){
+
+	int res = ll_find(dir, name, want);
+
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	if(res == 0)
+	{
+		res = ll_stat(want, &e->attr);
+	}
+	if(res != 0)
+	{
+		return res;
+	}
+	e->ino = node_remember(want, &e->generation);
+	if(e->ino == 0)
+	{
+		return -ENOMEM;
+	}
+	e->attr.st_ino = e->ino;
+	e->attr_timeout = LL_TIMEOUT;
+	e->entry_timeout = LL_TIMEOUT;
+	return 0;
+}
+
+//function to answer a request that found or made something with its entry,
+//or with res if that's an error. fi is the file create opened. If the reply
+//doesn't get there, the kernel never knew about the node
+static void ll_reply_entry(fuse_req_t req, int res, const struct fuse_entry_param *e, struct fuse_file_info *fi){
+
+	if(res == 0)
+	{
+		res = fi != NULL ? fuse_reply_create(req, e, fi) : fuse_reply_entry(req, e);
+		if(res != 0)
+		{
+			node_forget(e->ino, 1);
+		}
+	}
+	else
+	{
+		fuse_reply_err(req, -res);
+	}
+	if(res != 0 && fi != NULL)
+	{
+		cs1550_release(NULL, fi);
+	}
+}
+
+static void cs1550_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	hello_oper.init(conn);
+	//no image, so nothing to number; every request fails without the nodes
+	if(header == NULL)
+	{
+		return;
+	}
+	pthread_mutex_lock(&nodeLock);
+	if(node_find_ino(FUSE_ROOT_ID) == NULL)
+	{
+		rootNode.inoNext = nodesByIno[FUSE_ROOT_ID % NODE_BUCKETS];
+		nodesByIno[FUSE_ROOT_ID % NODE_BUCKETS] = &rootNode;
+		//past every block
+		statsNode.ino = CS1550_INO(header->nBlocks);
+		statsNode.inoNext = nodesByIno[statsNode.ino % NODE_BUCKETS];
+		nodesByIno[statsNode.ino % NODE_BUCKETS] = &statsNode;
+	}
+	//past every block, and the stats file's number
+	nodeSpare = CS1550_INO(header->nBlocks) + 1;
+	pthread_mutex_unlock(&nodeLock);
+}
+
+static void cs1550_ll_destroy(void *userdata)
+{
+	hello_oper.destroy(userdata);
+}
+
+static void cs1550_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct cs1550_node dir, want;
+	struct cs1550_held held;
+	struct fuse_entry_param e;
+	int res = node_lock(parent, &dir, &held, LOCK_READ, LOCK_READ, LOCK_NONE);
+
+	if(res == 0)
+	{
+		res = ll_lookup_locked(&dir, name, &e, &want);
+		path_unlock(&held);
+	}
+	ll_reply_entry(req, res, &e, NULL);
+}
+
+static void cs1550_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	node_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void cs1550_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct cs1550_node node;
+	struct cs1550_held held;
+	struct stat st;
+	unsigned long start = stats_clock();
+	int res = node_lock(ino, &node, &held, LOCK_READ, LOCK_READ, LOCK_READ);
+
+	(void) fi;
+
+	if(res == 0)
+	{
+		res = ll_stat(&node, &st);
+		path_unlock(&held);
+	}
+	stats_record(STAT_GETATTR, start, res);
+	if(res != 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+/*
+ * Only the size can be changed. Files have no times to set, so setting
+ * them does nothing (which keeps touch happy), and no owner or mode.
+ */
+static void cs1550_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			 int to_set, struct fuse_file_info *fi)
+{
+	struct cs1550_node node;
+	struct cs1550_held held;
+	struct cs1550_directory_entry *dirEntry;
+	struct cs1550_open_file *of = open_file_get(fi);
+	struct stat st;
+	int resize = to_set & FUSE_SET_ATTR_SIZE;
+	int j, res;
+
+	if(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+	{
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if(resize)
+	{
+		meta_journal_wait();
+	}
+	res = node_lock(ino, &node, &held, LOCK_READ, LOCK_READ, resize ? LOCK_WRITE : LOCK_READ);
+	if(res != 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if(resize && node.kind != NODE_FILE)
+	{
+		res = node.kind == NODE_STATS ? -EACCES : -EISDIR;
+	}
+	else if(resize && of != NULL)
+	{
+		res = open_file_truncate(of, attr->st_size);
+	}
+	else if(resize)
+	{
+		j = node_file_slot(&node, &dirEntry);
+		res = j < 0 ? j : file_resize(node.dirBlock, j, attr->st_size);
+	}
+	if(res == 0)
+	{
+		res = ll_stat(&node, &st);
+	}
+	path_unlock(&held);
+	if(resize)
+	{
+		meta_maybe_writeback();
+	}
+	if(res != 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+//function to make a file called name in the directory parent, opening it
+//too when fi is given (for create), and answer with its entry
+static void ll_make_file(fuse_req_t req, fuse_ino_t parent, const char *name, struct fuse_file_info *fi)
+{
+	struct cs1550_node dir, want;
+	struct cs1550_held held;
+	struct fuse_entry_param e;
+	const struct cs1550_root_directory *root;
+	char fname[MAX_FILENAME+1];
+	char fext[MAX_EXTENSION+1];
+	unsigned long start = stats_clock();
+	int i, res;
+
+	if(fi != NULL)
+	{
+		fi->fh = 0;
+	}
+	meta_journal_wait();
+	res = node_lock(parent, &dir, &held, LOCK_READ, LOCK_WRITE, LOCK_NONE);
+	if(res != 0)
+	{
+		stats_record(STAT_MKNOD, start, res);
+		fuse_reply_err(req, -res);
+		return;
+	}
+
+	//files only go in the directories under the root
+	if(dir.kind != NODE_DIR)
+	{
+		res = dir.kind == NODE_ROOT ? -EPERM : -ENOTDIR;
+	}
+	if(res == 0)
+	{
+		res = ll_split(name, fname, fext);
+	}
+	if(res == 0)
+	{
+		root = load_root();
+		res = root == NULL ? -EIO : node_dir_slot(&dir, root);
+	}
+	if(res >= 0)
+	{
+		i = res;
+		res = file_make(i, fname, fext);
+	}
+	if(res == 0)
+	{
+		res = ll_lookup_locked(&dir, name, &e, &want);
+	}
+	if(res == 0 && fi != NULL)
+	{
+		res = open_file_new(dir.dirBlock, want.slot, fi);
+		if(res != 0)
+		{
+			node_forget(e.ino, 1);
+		}
+	}
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_MKNOD, start, res);
+	ll_reply_entry(req, res, &e, fi);
+}
+
+static void cs1550_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode, dev_t rdev)
+{
+	(void) mode;
+	(void) rdev;
+
+	ll_make_file(req, parent, name, NULL);
+}
+
+static void cs1550_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+			 mode_t mode, struct fuse_file_info *fi)
+{
+	(void) mode;
+
+	ll_make_file(req, parent, name, fi);
+}
+
+static void cs1550_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	struct cs1550_node dir, want;
+	struct cs1550_held held;
+	struct fuse_entry_param e;
+	unsigned long start = stats_clock();
+	int res;
+
+	(void) mode;
+
+	meta_journal_wait();
+	res = node_lock(parent, &dir, &held, LOCK_WRITE, LOCK_NONE, LOCK_NONE);
+	if(res == 0)
+	{
+		//directories only go in the root
+		if(dir.kind != NODE_ROOT)
+		{
+			res = dir.kind == NODE_DIR ? -EPERM : -ENOTDIR;
+		}
+		else if(strlen(name) > MAX_FILENAME)
+		{
+			res = -ENAMETOOLONG;
+		}
+		else
+		{
+			res = dir_make(name);
+		}
+		if(res == 0)
+		{
+			res = ll_lookup_locked(&dir, name, &e, &want);
+		}
+		path_unlock(&held);
+		meta_maybe_writeback();
+	}
+	stats_record(STAT_MKDIR, start, res);
+	ll_reply_entry(req, res, &e, NULL);
+}
+
+static void cs1550_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct cs1550_node dir, want;
+	struct cs1550_held held;
+	const struct cs1550_root_directory *root;
+	unsigned long start = stats_clock();
+	int i, res;
+
+	meta_journal_wait();
+	res = node_lock(parent, &dir, &held, LOCK_READ, LOCK_WRITE, LOCK_NONE);
+	if(res == 0)
+	{
+		res = ll_find(&dir, name, &want);
+		if(res == 0 && want.kind != NODE_FILE)
+		{
+			res = want.kind == NODE_STATS ? -EPERM : -EISDIR;
+		}
+		if(res == 0)
+		{
+			root = load_root();
+			res = root == NULL ? -EIO : node_dir_slot(&dir, root);
+		}
+		if(res >= 0)
+		{
+			i = res;
+			res = file_remove(i, want.slot);
+		}
+		if(res == 0)
+		{
+			node_detach(&want);
+		}
+		path_unlock(&held);
+		meta_maybe_writeback();
+	}
+	stats_record(STAT_UNLINK, start, res);
+	fuse_reply_err(req, -res);
+}
+
+static void cs1550_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct cs1550_node dir, want;
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	meta_journal_wait();
+	res = node_lock(parent, &dir, &held, LOCK_WRITE, LOCK_NONE, LOCK_NONE);
+	if(res == 0)
+	{
+		res = ll_find(&dir, name, &want);
+		if(res == 0 && want.kind != NODE_DIR)
+		{
+			res = -ENOTDIR;
+		}
+		if(res == 0)
+		{
+			res = dir_remove(want.slot);
+		}
+		if(res == 0)
+		{
+			node_detach(&want);
+		}
+		path_unlock(&held);
+		meta_maybe_writeback();
+	}
+	stats_record(STAT_RMDIR, start, res);
+	fuse_reply_err(req, -res);
+}
+
+static void cs1550_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct cs1550_node node;
+	struct cs1550_held held;
+	struct cs1550_directory_entry *dirEntry;
+	int j, res = node_lock(ino, &node, &held, LOCK_READ, LOCK_READ, LOCK_READ);
+
+	fi->fh = 0;
+	if(res != 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if(node.kind == NODE_STATS)
+	{
+		//the stats file's size changes between getattr and read, so have the
+		//kernel read until it runs out instead of trusting it
+		res = (fi->flags & O_ACCMODE) != O_RDONLY ? -EACCES : 0;
+		fi->direct_io = 1;
+	}
+	else if(node.kind != NODE_FILE)
+	{
+		res = -EISDIR;
+	}
+	else
+	{
+		j = node_file_slot(&node, &dirEntry);
+		res = j < 0 ? j : open_file_new(node.dirBlock, j, fi);
+	}
+	path_unlock(&held);
+	if(res != 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	if(fuse_reply_open(req, fi) != 0)
+	{
+		cs1550_release(NULL, fi);
+	}
+}
+
+//function to read from an open file and send what was read, with the file's
+//locks held so nothing can change the blocks before they're sent. Whole
+//blocks of an inode file go from the image to libfuse without being copied
+//returns how many bytes were sent, or a negative error (and nothing was)
+static int ll_read_file(fuse_req_t req, struct cs1550_open_file *of, size_t size, off_t off){
+
+	char *buf;
+	int res;
+#if FUSE_VERSION >= 29
+	struct cs1550_block_index *idx = open_file_index(of);
+	struct fuse_bufvec *bufv;
+
+	if(idx != NULL && !idx->legacy && !idx->inlined)
+	{
+		res = file_read_buf(of, idx, of->dirEntry->files[of->slot].fsize, &bufv, size, off);
+		if(res == 0)
+		{
+			res = fuse_buf_size(bufv);
+			fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+			bufvec_free(bufv);
+		}
+		return res;
+	}
+#endif
+	//anything else (version 1 and inline files) is read into memory
+	buf = malloc(size > 0 ? size : 1);
+	if(buf == NULL)
+	{
+		return -ENOMEM;
+	}
+	res = open_file_read(of, buf, size, off);
+	if(res >= 0)
+	{
+		fuse_reply_buf(req, buf, res);
+	}
+	free(buf);
+	return res;
+}
+
+static void cs1550_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t off, struct fuse_file_info *fi)
+{
+	struct cs1550_open_file *of = open_file_get(fi);
+	struct cs1550_held held;
+	char stats[STATS_SIZE];
+	unsigned long start = stats_clock();
+	int res;
+
+	if(of != NULL)
+	{
+		ll_lock(&held, of->dirBlock, ino, LOCK_READ, LOCK_READ, LOCK_READ);
+		res = ll_read_file(req, of, size, off);
+		path_unlock(&held);
+		//the reply has gone, so the blocks pinned for it can go too
+		pin_done();
+	}
+	else if(ino == statsNode.ino)
+	{
+		//the stats file is made up from the counters for each read
+		res = stats_render(stats);
+		res = off < res ? ((size_t)(res - off) < size ? res - off : (int)size) : 0;
+		fuse_reply_buf(req, stats + (res > 0 ? off : 0), res);
+	}
+	else
+	{
+		//everything else is opened with an open file kept
+		res = -EBADF;
+	}
+	stats_record(STAT_READ, start, res);
+	if(res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	STAT_ADD(statBytesRead, res);
+}
+
+static void cs1550_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+			 size_t size, off_t off, struct fuse_file_info *fi)
+{
+	struct cs1550_open_file *of = open_file_get(fi);
+	struct cs1550_held held;
+	unsigned long start = stats_clock();
+	int res;
+
+	//the stats file, the only one opened without an open file, is read only
+	if(of == NULL)
+	{
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+	meta_journal_wait();
+	//the directory only needs reading: the file's own entry is covered by its lock
+	ll_lock(&held, of->dirBlock, ino, LOCK_READ, LOCK_READ, LOCK_WRITE);
+	res = open_file_write(of, buf, size, off);
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_WRITE, start, res);
+	if(res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	STAT_ADD(statBytesWritten, res);
+	fuse_reply_write(req, res);
+}
+
+#if FUSE_VERSION >= 29
+static void cs1550_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+			 off_t off, struct fuse_file_info *fi)
+{
+	struct cs1550_open_file *of = open_file_get(fi);
+	struct cs1550_held held;
+	size_t size = fuse_buf_size(bufv);
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	unsigned long start = stats_clock();
+	int res;
+
+	if(of == NULL)
+	{
+		fuse_reply_err(req, EBADF);
+		return;
+	}
+	meta_journal_wait();
+	ll_lock(&held, of->dirBlock, ino, LOCK_READ, LOCK_READ, LOCK_WRITE);
+	res = open_file_write_buf(of, bufv, size, off);
+	if(res == 0)
+	{
+		//anything else is gathered into one piece of memory and written as usual
+		dst.buf[0].mem = malloc(size > 0 ? size : 1);
+		res = dst.buf[0].mem == NULL ? -ENOMEM : fuse_buf_copy(&dst, bufv, 0);
+		if(res >= 0)
+		{
+			res = open_file_write(of, dst.buf[0].mem, res, off);
+		}
+		free(dst.buf[0].mem);
+	}
+	path_unlock(&held);
+	meta_maybe_writeback();
+	stats_record(STAT_WRITE, start, res);
+	if(res < 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	STAT_ADD(statBytesWritten, res);
+	fuse_reply_write(req, res);
+}
+#endif
+
+static void cs1550_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -cs1550_flush(NULL, fi));
+}
+
+static void cs1550_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -cs1550_release(NULL, fi));
+}
+
+static void cs1550_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	(void) ino;
+
+	fuse_reply_err(req, -cs1550_fsync(NULL, datasync, fi));
+}
+
+//A directory listing, put together at opendir and kept in fi->fh, so each
+//readdir after it only copies out the piece the kernel asked for
+struct ll_dirbuf
+{
+	char *p;
+	size_t size;
+	size_t nAlloc;
+};
+
+//function to add a name to a listing
+//returns 0, or -ENOMEM
+static int ll_dir_add(fuse_req_t req, struct ll_dirbuf *b, const char *name, fuse_ino_t ino, mode_t mode){
+
+	struct stat st;
+	size_t len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	size_t grow;
+	char *grown;
+
+	if(b->size + len > b->nAlloc)
+	{
+		grow = b->nAlloc > 0 ? b->nAlloc*2 : 4096;
+		while(grow < b->size + len)
+		{
+			grow *= 2;
+		}
+		grown = realloc(b->p, grow);
+		if(grown == NULL)
+		{
+			return -ENOMEM;
+		}
+		b->p = grown;
+		b->nAlloc = grow;
+	}
+	memset(&st, 0, sizeof(struct stat));
+	st.st_ino = ino;
+	st.st_mode = mode;
+	fuse_add_direntry(req, b->p + b->size, len, name, &st, b->size + len);
+	b->size += len;
+	return 0;
+}
+
+//function to list the directory node dir into b, with dir's locks held
+//returns 0 or a negative error
+static int ll_dir_fill(fuse_req_t req, const struct cs1550_node *dir, struct ll_dirbuf *b){
+
+	const struct cs1550_root_directory *root;
+	struct cs1550_directory_entry *dirEntry;
+	char fileAndExt[(MAX_FILENAME+1)+(MAX_EXTENSION+1)];
+	int i, j, res;
+
+	//the root is the only parent there is
+	res = ll_dir_add(req, b, ".", dir->ino, S_IFDIR);
+	if(res == 0)
+	{
+		res = ll_dir_add(req, b, "..", FUSE_ROOT_ID, S_IFDIR);
+	}
+	if(res != 0)
+	{
+		return res;
+	}
+	root = load_root();
+	if(root == NULL)
+	{
+		return -EIO;
+	}
+	if(dir->kind == NODE_ROOT)
+	{
+		for(i = 0; i < root->nDirectories && res == 0; i++)
+		{
+			res = ll_dir_add(req, b, root->directories[i].dname, CS1550_INO(root->directories[i].nStartBlock), S_IFDIR);
+		}
+		return res;
+	}
+	if(dir->kind != NODE_DIR)
+	{
+		return -ENOTDIR;
+	}
+	i = node_dir_slot(dir, root);
+	if(i < 0)
+	{
+		return i;
+	}
+	dirEntry = load_dirEntry(dir->dirBlock);
+	if(dirEntry == NULL)
+	{
+		return -EIO;
+	}
+	for(j = 0; j < dirEntry->nFiles && res == 0; j++)
+	{
+		snprintf(fileAndExt, sizeof(fileAndExt), "%s.%s", dirEntry->files[j].fname, dirEntry->files[j].fext);
+		res = ll_dir_add(req, b, fileAndExt, CS1550_INO(dirEntry->files[j].nStartBlock), S_IFREG);
+	}
+	return res;
+}
+
+static void cs1550_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct cs1550_node dir;
+	struct cs1550_held held;
+	struct ll_dirbuf *b = calloc(1, sizeof(struct ll_dirbuf));
+	unsigned long start = stats_clock();
+	int res = b == NULL ? -ENOMEM : node_lock(ino, &dir, &held, LOCK_READ, LOCK_READ, LOCK_NONE);
+
+	fi->fh = 0;
+	if(res == 0)
+	{
+		res = ll_dir_fill(req, &dir, b);
+		path_unlock(&held);
+	}
+	stats_record(STAT_READDIR, start, res);
+	if(res == 0)
+	{
+		fi->fh = (uintptr_t)b;
+		if(fuse_reply_open(req, fi) == 0)
+		{
+			return;
+		}
+	}
+	else
+	{
+		fuse_reply_err(req, -res);
+	}
+	if(b != NULL)
+	{
+		free(b->p);
+		free(b);
+	}
+	fi->fh = 0;
+}
+
+static void cs1550_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			 off_t off, struct fuse_file_info *fi)
+{
+	struct ll_dirbuf *b = (struct ll_dirbuf *)(uintptr_t)fi->fh;
+
+	(void) ino;
+
+	if(b != NULL && (size_t)off < b->size)
+	{
+		fuse_reply_buf(req, b->p + off, b->size - off < size ? b->size - off : size);
+	}
+	else
+	{
+		fuse_reply_buf(req, NULL, 0);
+	}
+}
+
+static void cs1550_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct ll_dirbuf *b = (struct ll_dirbuf *)(uintptr_t)fi->fh;
+
+	(void) ino;
+
+	if(b != NULL)
+	{
+		free(b->p);
+		free(b);
+		fi->fh = 0;
+	}
+	fuse_reply_err(req, 0);
+}
+
+static void cs1550_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+	int res = cs1550_statfs(NULL, &st);
+
+	(void) ino;
+
+	if(res != 0)
+	{
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_statfs(req, &st);
+}
+
+static struct fuse_lowlevel_ops cs1550_ll_oper = {
+	.init	= cs1550_ll_init,
+	.destroy	= cs1550_ll_destroy,
+	.lookup	= cs1550_ll_lookup,
+	.forget	= cs1550_ll_forget,
+	.getattr	= cs1550_ll_getattr,
+	.setattr	= cs1550_ll_setattr,
+	.mknod	= cs1550_ll_mknod,
+	.mkdir	= cs1550_ll_mkdir,
+	.unlink	= cs1550_ll_unlink,
+	.rmdir	= cs1550_ll_rmdir,
+	.open	= cs1550_ll_open,
+	.create	= cs1550_ll_create,
+	.read	= cs1550_ll_read,
+	.write	= cs1550_ll_write,
+#if FUSE_VERSION >= 29
+	.write_buf	= cs1550_ll_write_buf,
+#endif
+	.flush	= cs1550_ll_flush,
+	.release	= cs1550_ll_release,
+	.fsync	= cs1550_ll_fsync,
+	.opendir	= cs1550_ll_opendir,
+	.readdir	= cs1550_ll_readdir,
+	.releasedir	= cs1550_ll_releasedir,
+	.statfs	= cs1550_ll_statfs,
+};
+
+int main(int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch;
+	struct fuse_session *se;
+	char resolved[PATH_MAX];
+	char *mountpoint = NULL;
+	int multithreaded, foreground, err = -1;
+
+	//pull out our own -o options and leave the rest for fuse
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1)
+	{
+		return 1;
+	}
+#if FUSE_VERSION >= 28 && FUSE_VERSION < 30
+	fuse_opt_add_arg(&args, "-obig_writes");
+#endif
+
+	//pin the backing image to an absolute path before fuse_daemonize
+	//changes the working directory to /
+	if(realpath(diskPath, resolved) != NULL)
+	{
+		strcpy(diskPath, resolved);
+	}
+
+	if(fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+	{
+		return 1;
+	}
+	ch = fuse_mount(mountpoint, &args);
+	if(ch != NULL)
+	{
+		se = fuse_lowlevel_new(&args, &cs1550_ll_oper, sizeof(cs1550_ll_oper), NULL);
+		if(se != NULL)
+		{
+			if(fuse_set_signal_handlers(se) != -1)
+			{
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	fuse_opt_free_args(&args);
+	free(mountpoint);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,230 @@
+/*
+	mkfs_cs1550: makes an empty cs1550 image of any size and block size.
+
+	usage: mkfs_cs1550 [-b block_size] [-j journal_size] image size
+
+	Sizes can end in K, M or G. The image is created if it isn't there and
+	anything already in it is thrown away. It's left sparse, so even a big
+	image only takes up the space its metadata needs until files go in it.
+	The journal defaults to a 32nd of the image, but no more than
+	JOURNAL_MAX bytes. It's never fewer than JOURNAL_MIN_BLOCKS blocks; -j 0
+	makes an image without one.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "cs1550.h"
+
+#define JOURNAL_MIN_BLOCKS 64
+#define JOURNAL_MAX (16*1024*1024)
+
+//function to read a size like 4096, 64K, 512M or 4G
+//returns -1 if it isn't one
+static long long parse_size(const char *arg){
+
+	char *end;
+	long long n;
+
+	errno = 0;
+	n = strtoll(arg, &end, 10);
+	if(errno != 0 || end == arg || n < 0)
+	{
+		return -1;
+	}
+	switch(*end)
+	{
+		case 'k': case 'K':
+			n <<= 10;
+			end++;
+			break;
+		case 'm': case 'M':
+			n <<= 20;
+			end++;
+			break;
+		case 'g': case 'G':
+			n <<= 30;
+			end++;
+			break;
+	}
+	if(*end != '\0')
+	{
+		return -1;
+	}
+	return n;
+}
+
+//function to write len bytes at a byte offset into the image
+static int write_all(int fd, const void *buf, size_t len, off_t offset){
+
+	size_t done = 0;
+	ssize_t n;
+
+	while(done < len)
+	{
+		n = pwrite(fd, (const char *)buf + done, len - done, offset + done);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return -errno;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+//function to make an empty image of size bytes at path. A negative
+//journalSize gets the default journal. The header written is left in *made
+//returns 0, -EFBIG if the image is too small to hold anything, or -errno
+static int make_image(const char *path, long long size, long blockSize, long long journalSize, struct cs1550_header *made){
+
+	struct cs1550_header header;
+	long nBlocks, nWords, nBitmapBlocks, nBitmapStart, nJournalBlocks, nFirstDataBlock, i;
+	uint64_t *bits;
+	int fd, res;
+
+	if(journalSize < 0)
+	{
+		journalSize = size / 32 < JOURNAL_MAX ? size / 32 : JOURNAL_MAX;
+	}
+	//a smaller one couldn't take the changes of one write back
+	if(journalSize > 0 && journalSize < JOURNAL_MIN_BLOCKS*blockSize)
+	{
+		journalSize = JOURNAL_MIN_BLOCKS*blockSize;
+	}
+
+	//block 0 is the root, the header is at HEADER_OFFSET in whichever block
+	//that falls in, the bitmap takes the blocks after it and the journal
+	//the ones after that
+	nBlocks = size / blockSize;
+	nWords = (nBlocks + 63) / 64;
+	nBitmapStart = HEADER_OFFSET / blockSize + 1;
+	nBitmapBlocks = (nWords*sizeof(uint64_t) + blockSize - 1) / blockSize;
+	nJournalBlocks = (journalSize + blockSize - 1) / blockSize;
+	nFirstDataBlock = nBitmapStart + nBitmapBlocks + nJournalBlocks;
+	if(nFirstDataBlock >= nBlocks)
+	{
+		return -EFBIG;
+	}
+
+	bits = calloc(nBitmapBlocks, blockSize);
+	if(bits == NULL)
+	{
+		return -ENOMEM;
+	}
+	//the root, the header, the bitmap and the journal are taken, and so is
+	//anything past the end of the image that the last word has bits for
+	for(i = 0; i < nWords*64; i++)
+	{
+		if(i < nFirstDataBlock || i >= nBlocks)
+		{
+			bits[i / 64] |= 1ULL << (i % 64);
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.nMagic = CS1550_MAGIC;
+	header.nVersion = CS1550_VERSION_SUPER;
+	header.nBlocks = nBlocks;
+	header.nFreeBlocks = nBlocks - nFirstDataBlock;
+	header.nNextFit = nFirstDataBlock;
+	header.nBlockSize = blockSize;
+	header.nBitmapStart = nBitmapStart;
+	header.nBitmapBlocks = nBitmapBlocks;
+	header.nFirstDataBlock = nFirstDataBlock;
+	header.nJournalStart = nJournalBlocks > 0 ? nBitmapStart + nBitmapBlocks : 0;
+	header.nJournalBlocks = nJournalBlocks;
+
+	//truncating to nothing first leaves every block (the root included) zeroed
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(fd < 0 || ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)nBlocks*blockSize) != 0)
+	{
+		res = -errno;
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+		free(bits);
+		return res;
+	}
+	res = write_all(fd, bits, (size_t)nBitmapBlocks*blockSize, (off_t)nBitmapStart*blockSize);
+	if(res == 0)
+	{
+		res = write_all(fd, &header, sizeof(header), HEADER_OFFSET);
+	}
+	if(res == 0 && fsync(fd) != 0)
+	{
+		res = -errno;
+	}
+	close(fd);
+	free(bits);
+	if(res == 0 && made != NULL)
+	{
+		*made = header;
+	}
+	return res;
+}
+
+//cs1550_bench builds this in with its own main
+#ifndef CS1550_NO_MAIN
+static void usage(const char *prog){
+
+	fprintf(stderr, "usage: %s [-b block_size] [-j journal_size] image size\n", prog);
+	fprintf(stderr, "block_size is a power of two from %d to %d (default %d)\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE, BLOCK_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct cs1550_header header;
+	long long size, blockSize = BLOCK_SIZE, journalSize = -1;
+	int opt, res;
+
+	while((opt = getopt(argc, argv, "b:j:")) != -1)
+	{
+		if(opt == 'b' && (blockSize = parse_size(optarg)) >= 0)
+		{
+			continue;
+		}
+		if(opt == 'j' && (journalSize = parse_size(optarg)) >= 0)
+		{
+			continue;
+		}
+		usage(argv[0]);
+		return 2;
+	}
+	if(argc - optind != 2 || (size = parse_size(argv[optind + 1])) < 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+	if(blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE || (blockSize & (blockSize - 1)) != 0)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+
+	memset(&header, 0, sizeof(header));
+	res = make_image(argv[optind], size, blockSize, journalSize, &header);
+	if(res == -EFBIG)
+	{
+		fprintf(stderr, "%s: %s is too small to hold anything\n", argv[0], argv[optind + 1]);
+		return 1;
+	}
+	if(res != 0)
+	{
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(-res));
+		return 1;
+	}
+
+	printf("%s: %ld blocks of %lld bytes, %ld free, %ld in the journal\n", argv[optind], header.nBlocks, blockSize, header.nFreeBlocks, header.nJournalBlocks);
+	return 0;
+}
+#endif